@@ -0,0 +1,175 @@
+#include "BulkAssigner.h"
+
+#include <omp.h>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+#include "utils.h"
+
+#ifndef FINTEGER
+#define FINTEGER long
+#endif
+
+extern "C" {
+/// BLAS matrix multiplication, the same routine is used by faiss
+int sgemm_(const char *transa, const char *transb, FINTEGER *m, FINTEGER *n, FINTEGER *k,
+           const float *alpha, const float *a, FINTEGER *lda, const float *b, FINTEGER *ldb,
+           float *beta, float *c, FINTEGER *ldc);
+}
+
+namespace ivfhnsw {
+
+    BulkAssigner::BulkAssigner(hnswlib::HierarchicalNSW *quantizer, Mode mode):
+            quantizer(quantizer), d(quantizer->d_), nc(quantizer->maxelements_), mode(mode),
+            query_block_size(256), centroid_block_size(1024), nassigned(0), assign_time(0)
+    {}
+
+    BulkAssigner::~BulkAssigner()
+    {
+        for (ThreadScratch *s : scratch)
+            delete s;
+    }
+
+    void BulkAssigner::assign(size_t n, const float *x, idx_t *labels, size_t k, float *distances)
+    {
+        assign(n, x, VECTOR_FLOAT, labels, k, distances);
+    }
+
+    void BulkAssigner::assign(size_t n, const void *x, VectorType type, idx_t *labels, size_t k, float *distances)
+    {
+        StopW stopw = StopW();
+        if (mode == EXACT)
+            assign_exact(n, x, type, labels, k, distances);
+        else
+            assign_hnsw(n, x, type, labels, k, distances);
+
+        assign_time += stopw.getElapsedTimeMicro() / 1000000;
+        nassigned += n;
+    }
+
+    double BulkAssigner::throughput() const
+    {
+        return assign_time > 0 ? nassigned / assign_time : 0;
+    }
+
+    void BulkAssigner::report() const
+    {
+        std::cout << "Assigned " << nassigned << " vectors "
+                  << (mode == EXACT ? "exactly" : "by HNSW") << " in " << assign_time << "s, "
+                  << throughput() << " vectors/s" << std::endl;
+    }
+
+    void BulkAssigner::assign_hnsw(size_t n, const void *x, VectorType type, idx_t *labels, size_t k, float *distances)
+    {
+        // Scratch space is allocated once per thread and reused by all following calls
+        const size_t nthreads = omp_get_max_threads();
+        if (scratch.size() < nthreads)
+            scratch.resize(nthreads, nullptr);
+        for (size_t t = 0; t < nthreads; t++)
+            if (!scratch[t])
+                scratch[t] = new ThreadScratch(quantizer->maxelements_);
+
+        const size_t ef = std::max(quantizer->efSearch, k);
+        const size_t vector_size = d * vector_type_size(type);
+
+#pragma omp parallel for schedule(dynamic, 64)
+        for (size_t i = 0; i < n; i++) {
+            ThreadScratch &s = *scratch[omp_get_thread_num()];
+            const float *query = to_float_vectors(type, 1, d, (const uint8_t *) x + i * vector_size, s.query);
+
+            const idx_t ep = quantizer->greedySearch(quantizer->enterpoint_node, query, quantizer->maxlevel_, 0);
+            quantizer->searchLayer(ep, query, ef, 0, false, &s.visited, s.top, s.candidates);
+
+            // The heap is sorted in the ascending order of distances, the graph search returns the internal ids
+            std::sort_heap(s.top.begin(), s.top.end());
+            for (size_t j = 0; j < k; j++) {
+                const bool found = j < s.top.size();
+                labels[i * k + j] = found ? quantizer->getExternalLabel(s.top[j].second) : 0;
+                if (distances)
+                    distances[i * k + j] = found ? s.top[j].first : std::numeric_limits<float>::max();
+            }
+        }
+    }
+
+    void BulkAssigner::assign_exact(size_t n, const void *x, VectorType type, idx_t *labels, size_t k, float *distances)
+    {
+        // Contiguous copy of the centroids for sgemm, internal centroid ids are equal to the external ones
+        if (centroids.empty()) {
+            centroids.resize(nc * d);
+            centroid_norms.resize(nc);
+            for (size_t i = 0; i < nc; i++) {
+                const float *centroid = quantizer->getVector(i, centroids.data() + i * d);
+                if (centroid != centroids.data() + i * d)
+                    memcpy(centroids.data() + i * d, centroid, d * sizeof(float));
+                centroid_norms[i] = faiss::fvec_norm_L2sqr(centroid, d);
+            }
+        }
+        const size_t nblocks = (n + query_block_size - 1) / query_block_size;
+        const size_t vector_size = d * vector_type_size(type);
+
+        // The distance is the negative inner product if the quantizer graph is built for the inner product
+        const bool inner_product = quantizer->inner_product_;
+
+#pragma omp parallel
+        {
+            std::vector<float> ip_block(query_block_size * centroid_block_size);
+            std::vector<float> query_norms(query_block_size);
+            std::vector<std::pair<float, idx_t>> heaps(query_block_size * k);  // Max-heap of k results per query
+            std::vector<size_t> heap_sizes(query_block_size);
+            std::vector<float> converted_block;       // Query block converted to floats
+
+#pragma omp for schedule(dynamic)
+            for (size_t b = 0; b < nblocks; b++) {
+                const size_t i0 = b * query_block_size;
+                const size_t i1 = std::min(n, i0 + query_block_size);
+                const float *xb = to_float_vectors(type, i1 - i0, d, (const uint8_t *) x + i0 * vector_size,
+                                                   converted_block);
+
+                for (size_t i = i0; i < i1; i++)
+                    query_norms[i - i0] = faiss::fvec_norm_L2sqr(xb + (i - i0) * d, d);
+                std::fill(heap_sizes.begin(), heap_sizes.end(), 0);
+
+                for (size_t j0 = 0; j0 < nc; j0 += centroid_block_size) {
+                    const size_t j1 = std::min(nc, j0 + centroid_block_size);
+
+                    // ip_block[i * (j1 - j0) + j] = <x_i, c_j>
+                    {
+                        float one = 1, zero = 0;
+                        FINTEGER nyi = j1 - j0, nxi = i1 - i0, di = d;
+                        sgemm_("Transpose", "Not transpose", &nyi, &nxi, &di, &one,
+                               centroids.data() + j0 * d, &di, xb, &di, &zero, ip_block.data(), &nyi);
+                    }
+                    for (size_t i = 0; i < i1 - i0; i++) {
+                        const float *ip = ip_block.data() + i * (j1 - j0);
+                        std::pair<float, idx_t> *heap = heaps.data() + i * k;
+                        size_t &heap_size = heap_sizes[i];
+
+                        for (size_t j = j0; j < j1; j++) {
+                            const float dist = inner_product ? -ip[j - j0]
+                                                             : query_norms[i] + centroid_norms[j] - 2 * ip[j - j0];
+                            if (heap_size < k) {
+                                heap[heap_size++] = std::make_pair(dist, (idx_t) j);
+                                std::push_heap(heap, heap + heap_size);
+                            } else if (dist < heap[0].first) {
+                                std::pop_heap(heap, heap + k);
+                                heap[k - 1] = std::make_pair(dist, (idx_t) j);
+                                std::push_heap(heap, heap + k);
+                            }
+                        }
+                    }
+                }
+                for (size_t i = i0; i < i1; i++) {
+                    std::pair<float, idx_t> *heap = heaps.data() + (i - i0) * k;
+                    const size_t heap_size = heap_sizes[i - i0];
+                    std::sort_heap(heap, heap + heap_size);
+                    for (size_t j = 0; j < k; j++) {
+                        labels[i * k + j] = j < heap_size ? heap[j].second : 0;
+                        if (distances)
+                            distances[i * k + j] = j < heap_size ? heap[j].first : std::numeric_limits<float>::max();
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef IVF_HNSW_LIB_BULKASSIGNER_H
+#define IVF_HNSW_LIB_BULKASSIGNER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include <hnswlib/hnswalg.h>
+#include "utils.h"
+
+namespace ivfhnsw {
+    /** Assignment of large sets of vectors to the nearest coarse centroids
+      *
+      * Two modes are supported:
+      * - HNSW search in the quantizer graph. Each thread keeps its visited list and
+      *   heaps across the vectors, so the search does not lock the visited list pool
+      *   and does not allocate memory.
+      * - Exact brute-force search. Blocks of <query_block_size> vectors are compared with
+      *   blocks of <centroid_block_size> centroids by sgemm, so the centroid block stays in
+      *   the cache while it is reused by the whole query block. It needs a contiguous copy
+      *   of the centroids (nc * d floats), which is made on the first exact assignment.
+      *
+      * The vectors of the compact types are converted to floats by each thread: one vector at a time
+      * in the HNSW mode and one query block at a time in the exact mode.
+      *
+      * The time and the number of assigned vectors are accumulated, throughput() reports the rate.
+    */
+    struct BulkAssigner
+    {
+        typedef uint32_t idx_t;
+
+        enum Mode {
+            HNSW,   ///< Approximate assignment by the quantizer graph search, efSearch of the quantizer is used
+            EXACT   ///< Exact assignment by the blocked matrix multiplication
+        };
+
+        hnswlib::HierarchicalNSW *quantizer;
+        size_t d;                       ///< Vector dimension
+        size_t nc;                      ///< Number of centroids
+        Mode mode;
+
+        size_t query_block_size;        ///< Number of vectors per block in the exact mode
+        size_t centroid_block_size;     ///< Number of centroids per block in the exact mode
+
+        size_t nassigned;               ///< Number of vectors assigned so far
+        double assign_time;             ///< Time spent in assign(), in seconds
+
+        explicit BulkAssigner(hnswlib::HierarchicalNSW *quantizer, Mode mode = HNSW);
+        ~BulkAssigner();
+
+        /** Find the k nearest centroids of n vectors
+          *
+          * @param n           number of vectors
+          * @param x           vectors, size n * d
+          * @param labels      output centroid indices sorted by the distance, size n * k
+          * @param k           number of the nearest centroids
+          * @param distances   if non-null, output distances to the centroids, size n * k
+        */
+        void assign(size_t n, const float *x, idx_t *labels, size_t k = 1, float *distances = nullptr);
+
+        /** Find the k nearest centroids of n vectors of the given type
+          *
+          * @param x           vectors, size n * d elements of the type
+          * @param type        element type of x
+        */
+        void assign(size_t n, const void *x, VectorType type, idx_t *labels, size_t k = 1, float *distances = nullptr);
+
+        /// Vectors assigned per second
+        double throughput() const;
+
+        /// Print the mode and the throughput
+        void report() const;
+
+    private:
+        /// Scratch space of a thread in the HNSW mode
+        struct ThreadScratch
+        {
+            hnswlib::VisitedList visited;
+            std::vector<std::pair<float, idx_t>> top;
+            std::vector<std::pair<float, idx_t>> candidates;
+            std::vector<float> query;     ///< Vector converted to floats, size d
+
+            explicit ThreadScratch(size_t nc): visited(nc) {}
+        };
+        std::vector<ThreadScratch *> scratch;   ///< One per OpenMP thread
+
+        std::vector<float> centroids;           ///< Contiguous centroids for the exact mode, size nc * d
+        std::vector<float> centroid_norms;      ///< L2 square norms of the centroids for the exact mode
+
+        void assign_hnsw(size_t n, const void *x, VectorType type, idx_t *labels, size_t k, float *distances);
+        void assign_exact(size_t n, const void *x, VectorType type, idx_t *labels, size_t k, float *distances);
+    };
+}
+#endif //IVF_HNSW_LIB_BULKASSIGNER_H
@@ -0,0 +1,205 @@
+#include "GroupBuilder.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+namespace ivfhnsw {
+
+    GroupBuilder::GroupBuilder(IndexIVF_HNSW_Grouping *index, size_t memory_budget, const std::string &tmp_prefix):
+            index(index), memory_budget(memory_budget), tmp_prefix(tmp_prefix), batch_size(1000000), vector_size(0)
+    {}
+
+    std::string GroupBuilder::partition_path(size_t p) const
+    {
+        return tmp_prefix + "." + std::to_string(p);
+    }
+
+    void GroupBuilder::plan_partitions(const char *path_precomputed_idxs, size_t nb)
+    {
+        std::ifstream idx_input(path_precomputed_idxs, std::ios::binary);
+        if (!idx_input)
+            throw std::runtime_error(std::string("Could not open ") + path_precomputed_idxs);
+
+        group_sizes.assign(index->nc, 0);
+        std::vector<idx_t> idx_batch;
+        for (size_t i = 0; i < nb;) {
+            uint32_t size;
+            idx_input.read((char *) &size, sizeof(uint32_t));
+            if (!idx_input || size == 0)
+                throw std::runtime_error("Precomputed indices are truncated");
+            size = std::min<size_t>(size, nb - i);
+            idx_batch.resize(size);
+            idx_input.read((char *) idx_batch.data(), size * sizeof(idx_t));
+
+            for (idx_t idx : idx_batch) {
+                if (idx >= index->nc)
+                    throw std::runtime_error("Precomputed index " + std::to_string(idx) + " is out of range");
+                group_sizes[idx]++;
+            }
+            i += size;
+        }
+
+        // The loaded records and their sorted copy have to fit in the budget
+        const size_t record_size = 2 * sizeof(idx_t) + vector_size;
+        const size_t partition_bytes = memory_budget / 2;
+
+        partition_begin.assign(1, 0);
+        size_t bytes = 0;
+        for (size_t g = 0; g < index->nc; g++) {
+            const size_t group_bytes = group_sizes[g] * record_size;
+            if (bytes > 0 && bytes + group_bytes > partition_bytes) {
+                partition_begin.push_back(g);
+                bytes = 0;
+            }
+            bytes += group_bytes;
+        }
+        partition_begin.push_back(index->nc);
+    }
+
+    template<typename T>
+    void GroupBuilder::scatter(const char *path_base, const char *path_precomputed_idxs, size_t nb)
+    {
+        const size_t d = index->d;
+        const size_t npartitions = partition_begin.size() - 1;
+        const size_t record_size = 2 * sizeof(idx_t) + vector_size;
+
+        // Partition of each group
+        std::vector<uint32_t> group_partition(index->nc);
+        for (size_t p = 0; p < npartitions; p++)
+            for (size_t g = partition_begin[p]; g < partition_begin[p + 1]; g++)
+                group_partition[g] = p;
+
+        // Records are buffered per partition, the buffers take a quarter of the budget
+        const size_t buffer_size = std::max<size_t>(record_size, std::min<size_t>(1 << 22, memory_budget / (4 * npartitions)));
+        std::vector<std::ofstream> outputs(npartitions);
+        std::vector<std::vector<uint8_t>> buffers(npartitions);
+        for (size_t p = 0; p < npartitions; p++) {
+            outputs[p].open(partition_path(p), std::ios::binary);
+            if (!outputs[p])
+                throw std::runtime_error("Could not open " + partition_path(p) + " for writing");
+            buffers[p].reserve(buffer_size);
+        }
+
+        std::ifstream base_input(path_base, std::ios::binary);
+        std::ifstream idx_input(path_precomputed_idxs, std::ios::binary);
+        if (!base_input)
+            throw std::runtime_error(std::string("Could not open ") + path_base);
+
+        std::vector<T> batch(batch_size * d);
+        std::vector<idx_t> idx_batch;
+        size_t idx_available = 0, idx_pos = 0;
+
+        StopW stopw = StopW();
+        for (size_t b0 = 0; b0 < nb; b0 += batch_size) {
+            if ((b0 / batch_size) % 10 == 0)
+                std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
+                          << "Partitioning " << (100. * b0) / nb << "%" << std::endl;
+
+            const size_t n = std::min(batch_size, nb - b0);
+            readXvec<T>(base_input, batch.data(), d, n);
+
+            for (size_t i = 0; i < n; i++) {
+                // The indices are written in blocks independent of batch_size
+                if (idx_pos == idx_available) {
+                    uint32_t size;
+                    idx_input.read((char *) &size, sizeof(uint32_t));
+                    idx_batch.resize(size);
+                    idx_input.read((char *) idx_batch.data(), size * sizeof(idx_t));
+                    if (!idx_input)
+                        throw std::runtime_error("Precomputed indices are truncated");
+                    idx_available = size;
+                    idx_pos = 0;
+                }
+                const idx_t group = idx_batch[idx_pos++];
+                const idx_t id = b0 + i;
+                const uint32_t p = group_partition[group];
+
+                std::vector<uint8_t> &buffer = buffers[p];
+                if (buffer.size() + record_size > buffer_size) {
+                    outputs[p].write((char *) buffer.data(), buffer.size());
+                    buffer.clear();
+                }
+                const uint8_t *vec = (const uint8_t *) (batch.data() + i * d);
+                buffer.insert(buffer.end(), (const uint8_t *) &group, (const uint8_t *) &group + sizeof(idx_t));
+                buffer.insert(buffer.end(), (const uint8_t *) &id, (const uint8_t *) &id + sizeof(idx_t));
+                buffer.insert(buffer.end(), vec, vec + vector_size);
+            }
+        }
+        for (size_t p = 0; p < npartitions; p++) {
+            outputs[p].write((char *) buffers[p].data(), buffers[p].size());
+            outputs[p].close();
+            if (outputs[p].fail())
+                throw std::runtime_error("Could not write " + partition_path(p));
+        }
+    }
+
+    template<typename T>
+    void GroupBuilder::add_partition(size_t p)
+    {
+        const size_t d = index->d;
+        const size_t g0 = partition_begin[p];
+        const size_t g1 = partition_begin[p + 1];
+        const size_t record_size = 2 * sizeof(idx_t) + vector_size;
+
+        // Position of each group in the sorted arrays
+        std::vector<size_t> offsets(g1 - g0 + 1, 0);
+        for (size_t g = g0; g < g1; g++)
+            offsets[g - g0 + 1] = offsets[g - g0] + group_sizes[g];
+        const size_t n = offsets[g1 - g0];
+
+        std::vector<uint8_t> records(n * record_size);
+        {
+            std::ifstream input(partition_path(p), std::ios::binary);
+            input.read((char *) records.data(), records.size());
+            if (input.gcount() != (std::streamsize) records.size())
+                throw std::runtime_error(partition_path(p) + " is truncated");
+        }
+        std::remove(partition_path(p).c_str());
+
+        // Counting sort of the records by group
+        std::vector<idx_t> ids(n);
+        std::vector<T> data(n * d);
+        std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *record = records.data() + i * record_size;
+            idx_t group, id;
+            memcpy(&group, record, sizeof(idx_t));
+            memcpy(&id, record + sizeof(idx_t), sizeof(idx_t));
+
+            const size_t j = pos[group - g0]++;
+            ids[j] = id;
+            memcpy(data.data() + j * d, record + 2 * sizeof(idx_t), vector_size);
+        }
+        std::vector<uint8_t>().swap(records);
+
+        // The groups are passed in the input type, add_group converts one group per thread to floats
+        const VectorType type = vector_type_of(data.data());
+#pragma omp parallel for schedule(dynamic)
+        for (size_t g = g0; g < g1; g++)
+            index->add_group(g, group_sizes[g], data.data() + offsets[g - g0] * d, type, ids.data() + offsets[g - g0]);
+    }
+
+    template<typename T>
+    void GroupBuilder::build(const char *path_base, const char *path_precomputed_idxs, size_t nb)
+    {
+        vector_size = index->d * sizeof(T);
+        plan_partitions(path_precomputed_idxs, nb);
+        const size_t npartitions = partition_begin.size() - 1;
+        std::cout << "Sorting " << nb << " vectors into " << npartitions << " partitions" << std::endl;
+
+        scatter<T>(path_base, path_precomputed_idxs, nb);
+
+        StopW stopw = StopW();
+        for (size_t p = 0; p < npartitions; p++) {
+            std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
+                      << partition_begin[p] << " / " << index->nc << " groups added" << std::endl;
+            add_partition<T>(p);
+        }
+    }
+
+    template void GroupBuilder::build<uint8_t>(const char *path_base, const char *path_precomputed_idxs, size_t nb);
+    template void GroupBuilder::build<float>(const char *path_base, const char *path_precomputed_idxs, size_t nb);
+}
@@ -0,0 +1,70 @@
+#ifndef IVF_HNSW_LIB_GROUPBUILDER_H
+#define IVF_HNSW_LIB_GROUPBUILDER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "IndexIVF_HNSW_Grouping.h"
+
+namespace ivfhnsw {
+    /** Construction of the grouping index from the base set and precomputed assignments
+      *
+      * The base vectors are bucket sorted by their groups on disk, so the base set is read only once:
+      * 1. The assignments are read to count the group sizes. Consecutive groups are combined
+      *    into partitions, each partition holds at most memory_budget / 2 bytes of vectors.
+      * 2. Scatter: one pass over the base set and the assignments appends each vector
+      *    with its id to the file of its partition.
+      * 3. Gather: partitions are loaded one by one, sorted by group in memory, and their groups
+      *    are added to the index in parallel. A partition file is removed once it is added.
+      *
+      * The build reads the base set once and the partitions once, instead of the whole base set
+      * for every window of groups. A group larger than the budget gets a partition of its own.
+    */
+    struct GroupBuilder
+    {
+        typedef uint32_t idx_t;
+
+        IndexIVF_HNSW_Grouping *index;
+        size_t memory_budget;        ///< Memory for the partition being added, in bytes
+        std::string tmp_prefix;      ///< Prefix of the partition files
+        size_t batch_size;           ///< Number of base vectors read at once in the scatter pass
+
+        /** @param memory_budget   memory in bytes for the loaded partition
+          * @param tmp_prefix      partition files are named <tmp_prefix>.<partition number>
+        */
+        GroupBuilder(IndexIVF_HNSW_Grouping *index, size_t memory_budget, const std::string &tmp_prefix);
+
+        /** Add all groups of the base set to the index
+          *
+          * T is the element type of the base vectors: uint8_t for .bvecs, float for .fvecs
+          *
+          * @param path_base               path to the base vectors
+          * @param path_precomputed_idxs   path to the group indices of the base vectors,
+          *                                written in blocks: uint32 block size followed by the indices
+          * @param nb                      number of base vectors to add, ids of the vectors are 0..nb-1
+        */
+        template<typename T>
+        void build(const char *path_base, const char *path_precomputed_idxs, size_t nb);
+
+    private:
+        size_t vector_size;                    ///< Size of a base vector in bytes
+        std::vector<size_t> group_sizes;       ///< Number of vectors in each group
+        std::vector<idx_t> partition_begin;    ///< First group of each partition, size npartitions + 1
+
+        /// Count the group sizes and split the groups into partitions
+        void plan_partitions(const char *path_precomputed_idxs, size_t nb);
+
+        std::string partition_path(size_t p) const;
+
+        /// Write each base vector with its id to the file of its partition
+        template<typename T>
+        void scatter(const char *path_base, const char *path_precomputed_idxs, size_t nb);
+
+        /// Load the partition, add its groups to the index and remove the file
+        template<typename T>
+        void add_partition(size_t p);
+    };
+}
+#endif //IVF_HNSW_LIB_GROUPBUILDER_H
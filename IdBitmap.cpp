@@ -0,0 +1,73 @@
+#include "IdBitmap.h"
+
+namespace ivfhnsw {
+
+    IdBitmap::IdBitmap(): pages(new std::atomic<std::atomic<uint64_t> *>[npages]()), nids(0)
+    {}
+
+    IdBitmap::~IdBitmap()
+    {
+        clear();
+        delete[] pages;
+    }
+
+    bool IdBitmap::set(idx_t id)
+    {
+        std::atomic<uint64_t> *page = pages[id / page_bits].load(std::memory_order_acquire);
+        if (!page) {
+            // Several threads may allocate the page, only the first one publishes it
+            std::atomic<uint64_t> *new_page = new std::atomic<uint64_t>[page_words]();
+            if (pages[id / page_bits].compare_exchange_strong(page, new_page, std::memory_order_acq_rel))
+                page = new_page;
+            else
+                delete[] new_page;
+        }
+        const uint64_t mask = uint64_t(1) << (id % 64);
+        const uint64_t word = page[(id % page_bits) / 64].fetch_or(mask, std::memory_order_relaxed);
+        if (word & mask)
+            return false;
+        nids.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool IdBitmap::reset(idx_t id)
+    {
+        std::atomic<uint64_t> *page = pages[id / page_bits].load(std::memory_order_acquire);
+        if (!page)
+            return false;
+        const uint64_t mask = uint64_t(1) << (id % 64);
+        const uint64_t word = page[(id % page_bits) / 64].fetch_and(~mask, std::memory_order_relaxed);
+        if (!(word & mask))
+            return false;
+        nids.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    std::vector<IdBitmap::idx_t> IdBitmap::to_ids() const
+    {
+        std::vector<idx_t> ids;
+        ids.reserve(count());
+        for (size_t p = 0; p < npages; p++) {
+            const std::atomic<uint64_t> *page = pages[p].load(std::memory_order_acquire);
+            if (!page)
+                continue;
+            for (size_t w = 0; w < page_words; w++) {
+                uint64_t word = page[w].load(std::memory_order_relaxed);
+                while (word) {
+                    ids.push_back(p * page_bits + w * 64 + __builtin_ctzll(word));
+                    word &= word - 1;
+                }
+            }
+        }
+        return ids;
+    }
+
+    void IdBitmap::clear()
+    {
+        for (size_t p = 0; p < npages; p++) {
+            delete[] pages[p].load(std::memory_order_relaxed);
+            pages[p].store(nullptr, std::memory_order_relaxed);
+        }
+        nids.store(0, std::memory_order_relaxed);
+    }
+}
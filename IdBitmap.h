@@ -0,0 +1,57 @@
+#ifndef IVF_HNSW_LIB_IDBITMAP_H
+#define IVF_HNSW_LIB_IDBITMAP_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace ivfhnsw {
+    /** Set of 32-bit vector ids
+      *
+      * The bits are stored in pages of <page_bits> ids, which are allocated when the first id of the page is set,
+      * so the memory is proportional to the range of the set ids rather than to 2^32.
+      * Pages are never moved or released before clear(), hence contains() may run concurrently
+      * with set() and reset() without any lock.
+    */
+    class IdBitmap
+    {
+    public:
+        typedef uint32_t idx_t;
+
+        static const size_t page_bits = 1 << 16;                         ///< Ids per page
+        static const size_t page_words = page_bits / 64;
+        static const size_t npages = (size_t(1) << 32) / page_bits;
+
+        IdBitmap();
+        ~IdBitmap();
+
+        IdBitmap(const IdBitmap &) = delete;
+        IdBitmap &operator=(const IdBitmap &) = delete;
+
+        inline bool contains(idx_t id) const {
+            const std::atomic<uint64_t> *page = pages[id / page_bits].load(std::memory_order_acquire);
+            return page && (page[(id % page_bits) / 64].load(std::memory_order_relaxed) >> (id % 64)) & 1;
+        }
+
+        /// Number of ids in the set
+        inline size_t count() const { return nids.load(std::memory_order_relaxed); }
+
+        /// Add the id, returns false if it is already in the set
+        bool set(idx_t id);
+
+        /// Remove the id, returns false if it is not in the set
+        bool reset(idx_t id);
+
+        /// All ids of the set in the ascending order
+        std::vector<idx_t> to_ids() const;
+
+        /// Remove all ids and release the pages, must not run concurrently with the other methods
+        void clear();
+
+    private:
+        std::atomic<std::atomic<uint64_t> *> *pages;   ///< Page table, size npages
+        std::atomic<size_t> nids;
+    };
+}
+#endif //IVF_HNSW_LIB_IDBITMAP_H
@@ -0,0 +1,44 @@
+#ifndef IVF_HNSW_LIB_IDSELECTOR_H
+#define IVF_HNSW_LIB_IDSELECTOR_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace ivfhnsw {
+    /** Subset of vector ids, the filtered search returns only the vectors of the subset
+      *
+      * The selector is checked for each code of the scanned lists before any distance is computed.
+    */
+    struct IdSelector
+    {
+        typedef uint32_t idx_t;
+
+        virtual bool is_member(idx_t id) const = 0;
+        virtual ~IdSelector() {}
+    };
+
+    /// Ids in the range [imin, imax)
+    struct IdSelectorRange: IdSelector
+    {
+        idx_t imin, imax;
+
+        IdSelectorRange(idx_t imin, idx_t imax): imin(imin), imax(imax) {}
+
+        bool is_member(idx_t id) const { return id >= imin && id < imax; }
+    };
+
+    /** Ids set in a dense bitset, bit (id % 8) of byte id / 8. Ids beyond the bitset are not members
+      *
+      * The bitset is not copied, it has to stay alive while the selector is used.
+    */
+    struct IdSelectorBitmap: IdSelector
+    {
+        size_t n;                 ///< Number of ids covered by the bitset
+        const uint8_t *bitmap;    ///< Bitset, size (n + 7) / 8
+
+        IdSelectorBitmap(size_t n, const uint8_t *bitmap): n(n), bitmap(bitmap) {}
+
+        bool is_member(idx_t id) const { return id < n && (bitmap[id >> 3] >> (id & 7)) & 1; }
+    };
+}
+#endif //IVF_HNSW_LIB_IDSELECTOR_H
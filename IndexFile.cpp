@@ -0,0 +1,168 @@
+#include "IndexFile.h"
+
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace ivfhnsw {
+
+    /// Header of each section, the elements follow at the next aligned offset
+    struct SectionHeader
+    {
+        uint32_t tag;
+        uint32_t elem_size;
+        uint64_t count;
+    };
+
+    static size_t align_up(size_t pos)
+    {
+        return (pos + index_file_alignment - 1) / index_file_alignment * index_file_alignment;
+    }
+
+    //=============
+    // MappedFile
+    //=============
+    MappedFile::MappedFile(const char *path): data(nullptr), size(0)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(std::string("Could not open ") + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            throw std::runtime_error(std::string("Could not stat ") + path);
+        }
+        size = st.st_size;
+
+        // Shared mapping: processes serving the same file share its pages in the page cache
+        void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+            throw std::runtime_error(std::string("Could not mmap ") + path);
+        data = (const uint8_t *) ptr;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        munmap((void *) data, size);
+    }
+
+    //==================
+    // IndexFileWriter
+    //==================
+    IndexFileWriter::IndexFileWriter(const char *path): out(path, std::ios::binary), pos(0)
+    {
+        if (!out)
+            throw std::runtime_error(std::string("Could not open ") + path + " for writing");
+    }
+
+    void IndexFileWriter::pad()
+    {
+        static const char zeros[index_file_alignment] = {0};
+        const size_t aligned = align_up(pos);
+        write(zeros, aligned - pos);
+    }
+
+    void IndexFileWriter::write_header(const IndexFileHeader &header)
+    {
+        write(&header, sizeof(header));
+        pad();
+    }
+
+    void IndexFileWriter::begin_section(uint32_t tag, size_t elem_size, size_t count)
+    {
+        SectionHeader section = {tag, (uint32_t) elem_size, count};
+        write(&section, sizeof(section));
+        pad();
+    }
+
+    void IndexFileWriter::write(const void *data, size_t nbytes)
+    {
+        out.write((const char *) data, nbytes);
+        pos += nbytes;
+    }
+
+    void IndexFileWriter::end_section()
+    {
+        pad();
+    }
+
+    void IndexFileWriter::close()
+    {
+        out.close();
+        if (out.fail())
+            throw std::runtime_error("Could not write the index file");
+    }
+
+    //==================
+    // IndexFileReader
+    //==================
+    IndexFileReader::IndexFileReader(const char *path, bool use_mmap):
+            file(new MappedFile(path)), pos(0), use_mmap(use_mmap)
+    {
+        if (use_mmap)
+            hnswlib::advise_memory(file->data, file->size);
+    }
+
+    IndexFileHeader IndexFileReader::read_header()
+    {
+        IndexFileHeader header;
+        if (file->size < sizeof(header))
+            throw std::runtime_error("Index file is truncated");
+        memcpy(&header, file->data, sizeof(header));
+
+        if (header.magic != index_file_magic)
+            throw std::runtime_error("Not an index file");
+        if (header.version > index_file_version)
+            throw std::runtime_error("Index file version " + std::to_string(header.version) + " is not supported");
+
+        pos = align_up(sizeof(header));
+        return header;
+    }
+
+    const uint8_t *IndexFileReader::next_section(uint32_t tag, size_t elem_size, size_t &count)
+    {
+        SectionHeader section;
+        if (pos + sizeof(section) > file->size)
+            throw std::runtime_error("Index file is truncated");
+        memcpy(&section, file->data + pos, sizeof(section));
+
+        if (section.tag != tag || section.elem_size != elem_size)
+            throw std::runtime_error("Unexpected section " + std::to_string(section.tag) +
+                                     " in the index file, expected " + std::to_string(tag));
+        if (count != 0 && section.count != count)
+            throw std::runtime_error("Section " + std::to_string(tag) + " has " + std::to_string(section.count) +
+                                     " elements, expected " + std::to_string(count));
+
+        const size_t begin = align_up(pos + sizeof(section));
+        const size_t nbytes = section.count * elem_size;
+        if (begin + nbytes > file->size)
+            throw std::runtime_error("Index file is truncated");
+
+        count = section.count;
+        pos = align_up(begin + nbytes);
+        return file->data + begin;
+    }
+
+    bool IndexFileReader::next_section_is(uint32_t tag) const
+    {
+        SectionHeader section;
+        if (pos + sizeof(section) > file->size)
+            return false;
+        memcpy(&section, file->data + pos, sizeof(section));
+        return section.tag == tag;
+    }
+
+    bool is_index_file(const char *path)
+    {
+        std::ifstream input(path, std::ios::binary);
+        uint64_t magic = 0;
+        input.read((char *) &magic, sizeof(magic));
+        return input.good() && magic == index_file_magic;
+    }
+}
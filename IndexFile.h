@@ -0,0 +1,205 @@
+#ifndef IVF_HNSW_LIB_INDEXFILE_H
+#define IVF_HNSW_LIB_INDEXFILE_H
+
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+#include <hnswlib/memory_policy.h>
+
+namespace ivfhnsw {
+    /** Index file format
+      *
+      * The file starts with a header followed by sections. Each section is a small header
+      * (tag, element size, number of elements) and an array of elements. Both the section
+      * headers and the arrays start at file offsets aligned to <index_file_alignment>,
+      * so a memory-mapped file can be searched in place without any copy.
+      *
+      * Files written by the earlier versions start with the vector dimension instead of
+      * the magic number, they are still read by the stream-based loader.
+    */
+    const uint64_t index_file_magic = 0x3157534e48465649;  ///< "IVFHNSW1"
+    const uint32_t index_file_version = 1;
+    const size_t index_file_alignment = 64;
+
+    enum IndexType: uint32_t {
+        INDEX_IVF_HNSW = 0,
+        INDEX_IVF_HNSW_GROUPING = 1
+    };
+
+    enum SectionTag: uint32_t {
+        SECTION_OFFSETS = 1,            ///< Position of each inverted list in the id and norm code arenas
+        SECTION_CODE_OFFSETS,           ///< Position of each inverted list in the code arena
+        SECTION_IDS,
+        SECTION_CODES,
+        SECTION_NORM_CODES,
+        SECTION_CENTROID_NORMS,
+        SECTION_NN_CENTROID_IDXS,
+        SECTION_SUBGROUP_SIZES,
+        SECTION_ALPHAS,
+        SECTION_INTER_CENTROID_DISTS,
+        SECTION_DELETED_IDS,            ///< Optional, ids removed from the index but still stored in the lists
+        SECTION_MAX_RESIDUAL_NORMS      ///< Optional, bounds of the lists used by the range search
+    };
+
+    struct IndexFileHeader
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t index_type;    ///< One of IndexType
+        uint64_t d;             ///< Vector dimension
+        uint64_t nc;            ///< Number of centroids
+        uint64_t nsubc;         ///< Number of sub-centroids per group, 0 for IndexIVF_HNSW
+        uint64_t code_size;     ///< Code size per vector in bytes
+        uint32_t fast_scan;     ///< Whether the codes are stored in the 4-bit fast-scan blocks
+        uint32_t metric;        ///< MetricType of the index, zero (L2) in the files written before the metric was stored
+    };
+
+    /// Read-only memory mapping of a whole file
+    struct MappedFile
+    {
+        const uint8_t *data;
+        size_t size;
+
+        explicit MappedFile(const char *path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+    };
+
+    /** Array, which either owns its elements or borrows them from a mapped file
+      *
+      * Read accessors never copy, so a borrowed array is searched in place. Elements are
+      * modified only through mutable_data(), which first copies borrowed elements to the
+      * owned storage, hence the mapped memory is never written.
+      *
+      * The owned storage follows the hnswlib::MemoryPolicy: large arenas may get huge pages
+      * and be interleaved over the NUMA nodes.
+    */
+    template<typename T>
+    class MaybeOwnedVector
+    {
+        std::vector<T, hnswlib::PolicyAllocator<T>> storage;  ///< Elements of the owned array
+        std::shared_ptr<MappedFile> file;       ///< Keeps the mapping alive while the elements are borrowed
+        const T *view;                          ///< Elements of the borrowed array
+        size_t view_size;
+
+    public:
+        MaybeOwnedVector(): view(nullptr), view_size(0) {}
+
+        inline bool is_owned() const { return !file; }
+        inline size_t size() const { return file ? view_size : storage.size(); }
+        inline bool empty() const { return size() == 0; }
+
+        inline const T *data() const { return file ? view : storage.data(); }
+        inline const T &operator[](size_t i) const { return data()[i]; }
+        inline const T &back() const { return data()[size() - 1]; }
+
+        inline T *mutable_data() { make_owned(); return storage.data(); }
+
+        void resize(size_t n, const T &val = T()) {
+            make_owned();
+            storage.resize(n, val);
+        }
+
+        void assign(const T *first, const T *last) {
+            clear();
+            storage.assign(first, last);
+        }
+
+        /// Release the elements
+        void clear() {
+            file.reset();
+            view = nullptr;
+            view_size = 0;
+            std::vector<T, hnswlib::PolicyAllocator<T>>().swap(storage);
+        }
+
+        /// Borrow n elements from the mapped file
+        void borrow(const std::shared_ptr<MappedFile> &mapped_file, const T *ptr, size_t n) {
+            clear();
+            file = mapped_file;
+            view = ptr;
+            view_size = n;
+        }
+
+        /// Copy the borrowed elements to the owned storage
+        void make_owned() {
+            if (!file)
+                return;
+            storage.assign(view, view + view_size);
+            file.reset();
+            view = nullptr;
+            view_size = 0;
+        }
+    };
+
+    /// Writes the header and the aligned sections
+    class IndexFileWriter
+    {
+        std::ofstream out;
+        size_t pos;
+
+        void pad();
+
+    public:
+        explicit IndexFileWriter(const char *path);
+
+        void write_header(const IndexFileHeader &header);
+
+        /// Start a section of count elements of elem_size bytes, the elements are written by write()
+        void begin_section(uint32_t tag, size_t elem_size, size_t count);
+        void write(const void *data, size_t nbytes);
+        void end_section();
+
+        template<typename T>
+        void write_section(uint32_t tag, const T *data, size_t count) {
+            begin_section(tag, sizeof(T), count);
+            write(data, count * sizeof(T));
+            end_section();
+        }
+
+        /// Flush the file, throws if any write failed
+        void close();
+    };
+
+    /** Reads the sections of a mapped file
+      *
+      * If use_mmap is set, sections are borrowed from the mapping, otherwise they are
+      * copied to the owned storage and the file is unmapped once the reader is destroyed.
+      * The borrowed mapping is advised for the huge pages if the memory policy asks for them.
+    */
+    class IndexFileReader
+    {
+        std::shared_ptr<MappedFile> file;
+        size_t pos;
+        bool use_mmap;
+
+        const uint8_t *next_section(uint32_t tag, size_t elem_size, size_t &count);
+
+    public:
+        IndexFileReader(const char *path, bool use_mmap);
+
+        IndexFileHeader read_header();
+
+        /// Whether the next section has the tag, used for the optional sections
+        bool next_section_is(uint32_t tag) const;
+
+        /// Read the section with the tag, count is checked unless it is zero
+        template<typename T>
+        void read_section(uint32_t tag, MaybeOwnedVector<T> &vec, size_t count = 0) {
+            const T *ptr = (const T *) next_section(tag, sizeof(T), count);
+            if (use_mmap)
+                vec.borrow(file, ptr, count);
+            else
+                vec.assign(ptr, ptr + count);
+        }
+    };
+
+    /// Check whether the file starts with index_file_magic
+    bool is_index_file(const char *path);
+}
+#endif //IVF_HNSW_LIB_INDEXFILE_H
@@ -6,55 +6,85 @@ namespace ivfhnsw {
     // IVF_HNSW implementation 
     //=========================
     IndexIVF_HNSW::IndexIVF_HNSW(size_t dim, size_t ncentroids, size_t bytes_per_code,
-                                 size_t nbits_per_idx, size_t max_group_size):
-            d(dim), nc(ncentroids), quantizer(nullptr), pq(nullptr), norm_pq(nullptr),
-            opq_matrix(nullptr)
+                                 size_t nbits_per_idx, size_t max_group_size, MetricType metric_type):
+            d(dim), nc(ncentroids), metric(metric_type), quantizer(nullptr), assigner(nullptr), assign_mode(BulkAssigner::HNSW), pq(nullptr), norm_pq(nullptr),
+            opq_matrix(nullptr), search_batch_size(1024), refine_vectors(nullptr), k_factor(1), stats(nullptr),
+            invlists(std::make_shared<InvertedLists>(ncentroids, 0, metric_type == METRIC_L2)),
+            list_locks(std::min<size_t>(ncentroids, 4096))
     {
-        pq = new faiss::ProductQuantizer(d, bytes_per_code, nbits_per_idx);
-        norm_pq = new faiss::ProductQuantizer(1, 1, nbits_per_idx);
+        // With 4-bit sub-quantizers each byte of the code holds 2 indices, the norms are still encoded with 8 bits
+        fast_scan = (nbits_per_idx == 4);
+        const size_t M = fast_scan ? 2 * bytes_per_code : bytes_per_code;
 
-        code_size = pq->code_size;
-        norms.resize(max_group_size); // buffer for reconstructed base point norms. It is used at search time.
-        precomputed_table.resize(pq->ksub * pq->M);
+        pq = new faiss::ProductQuantizer(d, M, nbits_per_idx);
+        norm_pq = new faiss::ProductQuantizer(1, 1, fast_scan ? 8 : nbits_per_idx);
+
+        code_size = fast_scan ? bytes_per_code : pq->code_size;
+        context.norms.resize(max_group_size); // buffer for reconstructed base point norms. It is used at search time.
+        context.precomputed_table.resize(pq->ksub * pq->M);
 
-        codes.resize(nc);
-        norm_codes.resize(nc);
-        ids.resize(nc);
         centroid_norms.resize(nc);
+        max_residual_norms.resize(nc, 0);
     }
 
     IndexIVF_HNSW::~IndexIVF_HNSW()
     {
+        if (assigner) delete assigner;
         if (quantizer) delete quantizer;
         if (pq) delete pq;
         if (norm_pq) delete norm_pq;
         if (opq_matrix) delete opq_matrix;
+        if (refine_vectors) delete refine_vectors;
     }
 
     /**
-     * There has been removed parallel HNSW construction in order to make internal centroid ids equal to external ones.
-     * Construction time is still acceptable: ~5 minutes for 1 million 96-d vectors on Intel Xeon E5-2650 V2 2.60GHz.
+     * Centroids are inserted in parallel with preassigned ids, so internal centroid ids are equal to external ones,
+     * i.e. to the order in the file. Centroids are read in batches of <report_every> to bound the memory.
      */
     void IndexIVF_HNSW::build_quantizer(const char *path_data, const char *path_info,
                                         const char *path_edges, size_t M, size_t efConstruction)
     {
         if (exists(path_info) && exists(path_edges)) {
             quantizer = new hnswlib::HierarchicalNSW(path_info, path_data, path_edges);
+            if (quantizer->metric_ != metric)
+                throw std::runtime_error(std::string(path_info) + " is built for the metric " +
+                                         std::to_string(quantizer->metric_) + ", the index uses " +
+                                         std::to_string(metric) + " (0 - l2, 1 - ip, 2 - cosine)");
             quantizer->efSearch = efConstruction;
+            quantizer->inner_product_ = (metric != METRIC_L2);
+
+            // The graph was built on the normalized centroids, the file keeps the original ones
+            if (metric == METRIC_COSINE) {
+                for (size_t i = 0; i < nc; i++)
+                    faiss::fvec_renorm_L2(d, 1, quantizer->getDataByInternalId(i));
+            }
             return;
         }
         quantizer = new hnswlib::HierarchicalNSW(d, nc, M, 2 * M, efConstruction);
+        quantizer->inner_product_ = (metric != METRIC_L2);
+        quantizer->metric_ = metric;
 
         std::cout << "Constructing quantizer\n";
         std::ifstream input(path_data, std::ios::binary);
 
-        size_t report_every = 100000;
-        for (size_t i = 0; i < nc; i++) {
-            float mass[d];
-            readXvec<float>(input, mass, d);
-            if (i % report_every == 0)
-                std::cout << i / (0.01 * nc) << " %\n";
-            quantizer->addPoint(mass);
+        const size_t report_every = 100000;
+        std::vector<float> batch(std::min(nc, report_every) * d);
+        for (size_t i0 = 0; i0 < nc; i0 += report_every) {
+            const size_t i1 = std::min(nc, i0 + report_every);
+            readXvec<float>(input, batch.data(), d, i1 - i0);
+            if (metric == METRIC_COSINE)
+                faiss::fvec_renorm_L2(d, i1 - i0, batch.data());
+            std::cout << i0 / (0.01 * nc) << " %\n";
+
+            // Centroid 0 becomes the enter point before the parallel insertions start
+            size_t j0 = 0;
+            if (i0 == 0) {
+                quantizer->addPoint(batch.data(), 0);
+                j0 = 1;
+            }
+#pragma omp parallel for schedule(dynamic, 128)
+            for (size_t j = j0; j < i1 - i0; j++)
+                quantizer->addPoint(batch.data() + j * d, i0 + j);
         }
         quantizer->SaveInfo(path_info);
         quantizer->SaveEdges(path_edges);
@@ -62,75 +92,155 @@ namespace ivfhnsw {
 
 
     void IndexIVF_HNSW::assign(size_t n, const float *x, idx_t *labels, size_t k) {
-#pragma omp parallel for
-        for (size_t i = 0; i < n; i++)
-            labels[i] = quantizer->searchKnn(const_cast<float *>(x + i * d), k).top().second;
+        assign(n, x, VECTOR_FLOAT, labels, k);
+    }
+
+    void IndexIVF_HNSW::assign(size_t n, const void *x, VectorType type, idx_t *labels, size_t k) {
+        std::lock_guard<std::mutex> lock(assign_lock);
+
+        // The assigner keeps the per-thread scratch space and the centroid copy, so it is recreated
+        // only if the quantizer is replaced
+        if (assigner && assigner->quantizer != quantizer) {
+            delete assigner;
+            assigner = nullptr;
+        }
+        if (!assigner)
+            assigner = new BulkAssigner(quantizer);
+        assigner->mode = assign_mode;
+        assigner->assign(n, x, type, labels, k);
     }
 
 
     void IndexIVF_HNSW::add_batch(size_t n, const float *x, const idx_t *xids, const idx_t *precomputed_idx)
     {
-        const idx_t *idx;
+        add_batch(n, x, VECTOR_FLOAT, xids, precomputed_idx);
+    }
+
+    void IndexIVF_HNSW::add_batch(size_t n, const void *x, VectorType type, const idx_t *xids,
+                                  const idx_t *precomputed_idx)
+    {
         // Check whether idxs are precomputed. If not, assign x
-        if (precomputed_idx)
-            idx = precomputed_idx;
-        else {
-            idx = new idx_t[n];
-            assign(n, x, const_cast<idx_t *>(idx));
+        std::vector<idx_t> assigned;
+        const idx_t *idx = precomputed_idx;
+        if (!idx) {
+            assigned.resize(n);
+            assign(n, x, type, assigned.data());
+            idx = assigned.data();
         }
-        // Compute residuals for original vectors
-        std::vector<float> residuals(n * d);
-        compute_residuals(n, x, residuals.data(), idx);
+        const size_t vector_size = d * vector_type_size(type);
 
-        // If do_opq, rotate residuals
-        if (do_opq){
-            std::vector<float> copy_residuals(n * d);
-            memcpy(copy_residuals.data(), residuals.data(), n * d * sizeof(float));
-            opq_matrix->apply_noalloc(n, copy_residuals.data(), residuals.data());
-        }
+        std::vector <uint8_t> xcodes(n * pq->code_size);
+        std::vector <uint8_t> xnorm_codes(metric == METRIC_L2 ? n : 0);
+        std::vector <float> residual_norms(n);
 
-        // Encode residuals
-        std::vector <uint8_t> xcodes(n * code_size);
-        pq->compute_codes(residuals.data(), xcodes.data(), n);
+        // Encode the vectors in independent blocks, so that the whole pipeline runs in parallel
+        const size_t block_size = 8192;
+        const size_t nblocks = (n + block_size - 1) / block_size;
 
-        // Decode residuals
-        std::vector<float> decoded_residuals(n * d);
-        pq->decode(xcodes.data(), decoded_residuals.data(), n);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t b = 0; b < nblocks; b++) {
+            const size_t i0 = b * block_size;
+            const size_t nblock = std::min(n, i0 + block_size) - i0;
+            const idx_t *block_idx = idx + i0;
+            uint8_t *block_codes = xcodes.data() + i0 * pq->code_size;
 
-        // Reverse rotation
-        if (do_opq){
-            std::vector<float> copy_decoded_residuals(n * d);
-            memcpy(copy_decoded_residuals.data(), decoded_residuals.data(), n * d * sizeof(float));
-            opq_matrix->transform_transpose(n, copy_decoded_residuals.data(), decoded_residuals.data());
+            // Only the block is converted to floats. The cosine metric encodes the normalized vectors,
+            // the nearest centroids do not depend on the norms
+            std::vector<float> converted_x, normalized_x;
+            const float *block_x = to_float_vectors(type, nblock, d, (const uint8_t *) x + i0 * vector_size, converted_x);
+            block_x = normalize_vectors(nblock, block_x, normalized_x);
+
+            // Compute residuals for original vectors
+            std::vector<float> residuals(nblock * d);
+            compute_residuals(nblock, block_x, residuals.data(), block_idx);
+
+            // If do_opq, rotate residuals
+            if (do_opq){
+                std::vector<float> copy_residuals(nblock * d);
+                memcpy(copy_residuals.data(), residuals.data(), nblock * d * sizeof(float));
+                opq_matrix->apply_noalloc(nblock, copy_residuals.data(), residuals.data());
+            }
+
+            // Encode residuals
+            pq->compute_codes(residuals.data(), block_codes, nblock);
+
+            // Decode residuals
+            std::vector<float> decoded_residuals(nblock * d);
+            pq->decode(block_codes, decoded_residuals.data(), nblock);
+
+            // Reverse rotation
+            if (do_opq){
+                std::vector<float> copy_decoded_residuals(nblock * d);
+                memcpy(copy_decoded_residuals.data(), decoded_residuals.data(), nblock * d * sizeof(float));
+                opq_matrix->transform_transpose(nblock, copy_decoded_residuals.data(), decoded_residuals.data());
+            }
+
+            // Distances between the reconstructed vectors and the centroids bound the lists for range_search
+            faiss::fvec_norms_L2sqr(residual_norms.data() + i0, decoded_residuals.data(), d, nblock);
+
+            // The inner product does not use the norms
+            if (metric != METRIC_L2)
+                continue;
+
+            // Reconstruct original vectors
+            std::vector<float> reconstructed_x(nblock * d);
+            reconstruct(nblock, reconstructed_x.data(), decoded_residuals.data(), block_idx);
+
+            // Compute l2 square norms of reconstructed vectors
+            std::vector<float> norms(nblock);
+            faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, nblock);
+
+            // Encode norms
+            norm_pq->compute_codes(norms.data(), xnorm_codes.data() + i0, nblock);
         }
 
-        // Reconstruct original vectors 
-        std::vector<float> reconstructed_x(n * d);
-        reconstruct(n, reconstructed_x.data(), decoded_residuals.data(), idx);
+        {
+            std::lock_guard<std::mutex> lock(unpack_lock);
+            invlists->unpack();
+            max_residual_norms.make_owned();
+        }
 
-        // Compute l2 square norms of reconstructed vectors
-        std::vector<float> norms(n);
-        faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, n);
+        // Order the vectors by list, so that each list is appended by one thread in the input order
+        std::vector<idx_t> order(n);
+        for (size_t i = 0; i < n; i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [idx](idx_t a, idx_t b) { return idx[a] < idx[b]; });
 
-        // Encode norms
-        std::vector <uint8_t> xnorm_codes(n);
-        norm_pq->compute_codes(norms.data(), xnorm_codes.data(), n);
+        std::vector<size_t> run_begin;
+        for (size_t i = 0; i < n; i++)
+            if (i == 0 || idx[order[i]] != idx[order[i - 1]])
+                run_begin.push_back(i);
+        run_begin.push_back(n);
 
         // Add vector indices and PQ codes for residuals and norms to Index
-        for (size_t i = 0; i < n; i++) {
-            const idx_t key = idx[i];
-            const idx_t id = xids[i];
-            ids[key].push_back(id);
-            const uint8_t *code = xcodes.data() + i * code_size;
-            for (size_t j = 0; j < code_size; j++)
-                codes[key].push_back(code[j]);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t r = 0; r < run_begin.size() - 1; r++) {
+            const idx_t key = idx[order[run_begin[r]]];
+            std::lock_guard<std::mutex> lock(list_locks[key % list_locks.size()]);
 
-            norm_codes[key].push_back(xnorm_codes[i]);
+            std::vector<idx_t> &list_ids = invlists->ids[key];
+            std::vector<uint8_t> &list_codes = invlists->codes[key];
+            std::vector<uint8_t> &list_norm_codes = invlists->norm_codes[key];
+            list_ids.reserve(list_ids.size() + run_begin[r + 1] - run_begin[r]);
+            if (metric == METRIC_L2)
+                list_norm_codes.reserve(list_norm_codes.size() + run_begin[r + 1] - run_begin[r]);
+
+            float max_residual_norm = max_residual_norms[key];
+            for (size_t j = run_begin[r]; j < run_begin[r + 1]; j++) {
+                const idx_t i = order[j];
+                append_code(list_codes, list_ids.size(), xcodes.data() + i * pq->code_size);
+                list_ids.push_back(xids[i]);
+                if (metric == METRIC_L2)
+                    list_norm_codes.push_back(xnorm_codes[i]);
+                max_residual_norm = std::max(max_residual_norm, std::sqrt(residual_norms[i]));
+            }
+            max_residual_norms.mutable_data()[key] = max_residual_norm;
         }
-        
-        // Free memory, if it is allocated 
-        if (idx != precomputed_idx)
-            delete idx;
+    }
+
+    void IndexIVF_HNSW::search(size_t k, const float *x, float *distances, long *labels)
+    {
+        search(k, x, distances, labels, context);
     }
 
     /** Search procedure
@@ -160,14 +270,197 @@ namespace ivfhnsw {
       * Since y_R defined by a product quantizer, it is split across
       * sub-vectors and stored separately for each subvector.
       *
+      * With the inner product the distance is d = -(x|y_C) - (x|y_R): the first term is computed by
+      * the HNSW search and only the term 3 is computed for each code.
+      *
     */
-    void IndexIVF_HNSW::search(size_t k, const float *x, float *distances, long *labels)
+    void IndexIVF_HNSW::search(size_t k, const float *x, float *distances, long *labels,
+                               SearchContext &ctx, const IdSelector *sel) const
     {
-        float query_centroid_dists[nprobe]; // Distances to the coarse centroids.
-        idx_t centroid_idxs[nprobe];        // Indices of the nearest coarse centroids
+        QueryStats *query_stats = this->query_stats(ctx);
+        uint64_t start = 0, t = 0;
+        if (query_stats) {
+            query_stats->reset();
+            start = t = stats_ticks();
+        }
+
+        x = normalize_vectors(1, x, ctx.normalized_query);
 
         // For correct search using OPQ rotate a query
-        const float *query = (do_opq) ? opq_matrix->apply(1, x) : x;
+        const float *query = rotate_query(x, ctx);
+        if (query_stats)
+            t = query_stats->lap(STAGE_ROTATION, t);
+
+        // Precompute table
+        ctx.precomputed_table.resize(pq->ksub * pq->M);
+        pq->compute_inner_prod_table(query, ctx.precomputed_table.data());
+        if (query_stats)
+            query_stats->lap(STAGE_TABLE, t);
+
+        search_and_refine(k, x, query, ctx.precomputed_table.data(), distances, labels, ctx, sel);
+
+        if (query_stats) {
+            query_stats->lap(STAGE_TOTAL, start);
+            stats->add(*query_stats);
+        }
+    }
+
+    void IndexIVF_HNSW::search(size_t n, const float *x, size_t k, float *distances, long *labels,
+                               const IdSelector *sel) const
+    {
+        const size_t table_size = pq->ksub * pq->M;
+        const size_t batch_size = std::min(n, search_batch_size);
+
+        std::vector<float> normalized_queries;
+        std::vector<float> rotated_queries(do_opq ? batch_size * d : 0);
+        std::vector<float> precomputed_tables(batch_size * table_size);
+
+        // Scratch space is reused by the same thread across all blocks
+        std::vector<SearchContext> contexts(omp_get_max_threads());
+
+        for (size_t i0 = 0; i0 < n; i0 += batch_size) {
+            const size_t i1 = std::min(n, i0 + batch_size);
+            const uint64_t block_start = stats ? stats_ticks() : 0;
+            const float *block = normalize_vectors(i1 - i0, x + i0 * d, normalized_queries);
+            const float *queries = block;
+
+            // Rotate and precompute tables for the whole block
+            if (do_opq) {
+                opq_matrix->apply_noalloc(i1 - i0, queries, rotated_queries.data());
+                queries = rotated_queries.data();
+            }
+            const uint64_t block_rotated = stats ? stats_ticks() : 0;
+            pq->compute_inner_prod_tables(i1 - i0, queries, precomputed_tables.data());
+
+            // Each query of the block gets an equal share of the block stages
+            const uint64_t rotation_share = stats ? (block_rotated - block_start) / (i1 - i0) : 0;
+            const uint64_t table_share = stats ? (stats_ticks() - block_rotated) / (i1 - i0) : 0;
+
+#pragma omp parallel for schedule(dynamic)
+            for (size_t i = i0; i < i1; i++) {
+                SearchContext &ctx = contexts[omp_get_thread_num()];
+                QueryStats *query_stats = this->query_stats(ctx);
+                uint64_t start = 0;
+                if (query_stats) {
+                    query_stats->reset();
+                    query_stats->ticks[STAGE_ROTATION] = rotation_share;
+                    query_stats->ticks[STAGE_TABLE] = table_share;
+                    start = stats_ticks();
+                }
+
+                search_and_refine(k, block + (i - i0) * d, queries + (i - i0) * d,
+                                  precomputed_tables.data() + (i - i0) * table_size,
+                                  distances + i * k, labels + i * k, ctx, sel);
+
+                if (query_stats) {
+                    query_stats->lap(STAGE_TOTAL, start);
+                    query_stats->ticks[STAGE_TOTAL] += rotation_share + table_share;
+                    stats->add(*query_stats);
+                }
+            }
+        }
+    }
+
+    void IndexIVF_HNSW::range_search(size_t n, const float *x, float radius, RangeSearchResult &result,
+                                     const IdSelector *sel) const
+    {
+        const size_t table_size = pq->ksub * pq->M;
+        const size_t batch_size = std::min(n, search_batch_size);
+
+        std::vector<float> normalized_queries;
+        std::vector<float> rotated_queries(do_opq ? batch_size * d : 0);
+        std::vector<float> precomputed_tables(batch_size * table_size);
+        std::vector<std::vector<float>> query_distances(batch_size);
+        std::vector<std::vector<long>> query_labels(batch_size);
+
+        std::vector<SearchContext> contexts(omp_get_max_threads());
+
+        result.nq = n;
+        result.lims.assign(1, 0);
+        result.labels.clear();
+        result.distances.clear();
+
+        for (size_t i0 = 0; i0 < n; i0 += batch_size) {
+            const size_t i1 = std::min(n, i0 + batch_size);
+            const float *block = normalize_vectors(i1 - i0, x + i0 * d, normalized_queries);
+            const float *queries = block;
+
+            // Rotate and precompute tables for the whole block
+            if (do_opq) {
+                opq_matrix->apply_noalloc(i1 - i0, queries, rotated_queries.data());
+                queries = rotated_queries.data();
+            }
+            pq->compute_inner_prod_tables(i1 - i0, queries, precomputed_tables.data());
+
+#pragma omp parallel for schedule(dynamic)
+            for (size_t i = i0; i < i1; i++) {
+                SearchContext &ctx = contexts[omp_get_thread_num()];
+                query_distances[i - i0].clear();
+                query_labels[i - i0].clear();
+                range_search_rotated(queries + (i - i0) * d, precomputed_tables.data() + (i - i0) * table_size,
+                                     radius, query_distances[i - i0], query_labels[i - i0], ctx, sel);
+            }
+
+            // Gather the results of the block in the query order
+            for (size_t i = i0; i < i1; i++) {
+                const std::vector<float> &dists = query_distances[i - i0];
+                const std::vector<long> &labels = query_labels[i - i0];
+                result.distances.insert(result.distances.end(), dists.begin(), dists.end());
+                result.labels.insert(result.labels.end(), labels.begin(), labels.end());
+                result.lims.push_back(result.labels.size());
+            }
+        }
+    }
+
+    /**
+     * Each reconstructed vector y of the list lies within max_residual_norms of the centroid c, hence
+     * || x - y || >= || x - c || - max_residual_norm. The probes are visited in the order of || x - c ||,
+     * so once the bound of all remaining probes exceeds the radius, none of them can contain a result.
+     * With the inner product -(x|y) >= -(x|c) - || x || * max_residual_norm in the same way.
+     * The bound holds for the reconstructed vectors, the L2 distances of the codes may differ from it
+     * by the quantization error of the norms.
+     */
+    void IndexIVF_HNSW::compute_probe_bounds(const idx_t *centroid_idxs, SearchContext &ctx) const
+    {
+        ctx.probe_bounds.resize(nprobe);
+        float bound = 0;
+        for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
+            bound = std::max(bound, max_residual_norms[centroid_idxs[i]]);
+            ctx.probe_bounds[i] = bound;
+        }
+    }
+
+    float IndexIVF_HNSW::list_dist_bound(float centroid_dist, float max_residual_norm, float query_norm) const
+    {
+        // Triangle inequality for L2 and Cauchy-Schwarz inequality for the inner product
+        if (metric != METRIC_L2)
+            return centroid_dist - query_norm * max_residual_norm;
+        const float diff = std::sqrt(centroid_dist) - max_residual_norm;
+        return diff > 0 ? diff * diff : 0;
+    }
+
+    float IndexIVF_HNSW::centroid_dist(const float *x, const float *centroid) const
+    {
+        return metric == METRIC_L2 ? fvec_L2sqr(x, centroid, d) : -faiss::fvec_inner_product(x, centroid, d);
+    }
+
+    const float *IndexIVF_HNSW::normalize_vectors(size_t n, const float *x, std::vector<float> &buf) const
+    {
+        if (metric != METRIC_COSINE)
+            return x;
+        buf.assign(x, x + n * d);
+        faiss::fvec_renorm_L2(d, n, buf.data());
+        return buf.data();
+    }
+
+    void IndexIVF_HNSW::range_search_rotated(const float *query, const float *precomputed_table, float radius,
+                                             std::vector<float> &distances, std::vector<long> &labels,
+                                             SearchContext &ctx, const IdSelector *sel) const
+    {
+        ctx.query_centroid_dists.resize(nprobe); // Distances to the coarse centroids.
+        ctx.centroid_idxs.resize(nprobe);        // Indices of the nearest coarse centroids
+        float *query_centroid_dists = ctx.query_centroid_dists.data();
+        idx_t *centroid_idxs = ctx.centroid_idxs.data();
 
         // Find the nearest coarse centroids to the query
         auto coarse = quantizer->searchKnn(query, nprobe);
@@ -176,46 +469,223 @@ namespace ivfhnsw {
             centroid_idxs[i] = coarse.top().second;
             coarse.pop();
         }
-        // Precompute table
-        pq->compute_inner_prod_table(query, precomputed_table.data());
+        compute_probe_bounds(centroid_idxs, ctx);
+        quantize_table(precomputed_table, ctx);
+
+        // Snapshot of the lists, which stay alive even if compact() replaces them during the query
+        const std::shared_ptr<InvertedLists> lists = std::atomic_load(&invlists);
+        const bool check_deleted = deleted.count() > 0;
+        const bool inner_product = (metric != METRIC_L2);
+        const float query_norm = inner_product ? std::sqrt(faiss::fvec_norm_L2sqr(query, d)) : 0;
+
+        for (size_t i = 0; i < nprobe; i++) {
+            // No remaining list has vectors within the radius
+            if (list_dist_bound(query_centroid_dists[i], ctx.probe_bounds[i], query_norm) >= radius)
+                break;
+
+            const idx_t centroid_idx = centroid_idxs[i];
+            const size_t group_size = lists->list_size(centroid_idx);
+            if (group_size == 0 ||
+                list_dist_bound(query_centroid_dists[i], max_residual_norms[centroid_idx], query_norm) >= radius)
+                continue;
+
+            const uint8_t *code = lists->get_codes(centroid_idx);
+            const uint8_t *norm_code = lists->get_norm_codes(centroid_idx);
+            const idx_t *id = lists->get_ids(centroid_idx);
+            const float term1 = inner_product ? query_centroid_dists[i]
+                                              : query_centroid_dists[i] - centroid_norms[centroid_idx];
+
+            if (ctx.norms.size() < group_size)
+                ctx.norms.resize(group_size);
+            if (ctx.code_dists.size() < group_size)
+                ctx.code_dists.resize(group_size);
+            float *norms = ctx.norms.data();
+            float *code_dists = ctx.code_dists.data();
+
+            size_t nselected = group_size;
+            if (sel) {
+                nselected = scan_selected_codes(code, 0, group_size, id, sel, precomputed_table, code_dists, ctx);
+                if (nselected == 0)
+                    continue;
+            }
+            else {
+                scan_codes(code, 0, group_size, precomputed_table, code_dists, ctx);
+            }
+            if (!inner_product)
+                norm_pq->decode(norm_code, norms, group_size);
+
+            for (size_t s = 0; s < nselected; s++) {
+                const size_t j = sel ? ctx.selected[s] : s;
+                const float dist = inner_product ? term1 - code_dists[j] : term1 + norms[j] - 2 * code_dists[j];
+                if (dist < radius) {
+                    if (check_deleted && deleted.contains(id[j]))
+                        continue;
+                    distances.push_back(dist);
+                    labels.push_back(id[j]);
+                }
+            }
+        }
+    }
+
+    /**
+     * The PQ search collects k_factor * k candidates. Their rows are prefetched at once, so the reads
+     * from the disk overlap, then the exact distances are computed in the order of the candidates.
+     */
+    void IndexIVF_HNSW::search_and_refine(size_t k, const float *x, const float *query, const float *precomputed_table,
+                                          float *distances, long *labels, SearchContext &ctx,
+                                          const IdSelector *sel) const
+    {
+        if (!refine_vectors) {
+            search_rotated(k, query, precomputed_table, distances, labels, ctx, sel);
+            return;
+        }
+
+        const size_t ncandidates = k_factor * k;
+        ctx.candidate_dists.resize(ncandidates);
+        ctx.candidate_labels.resize(ncandidates);
+        const long *candidates = ctx.candidate_labels.data();
+        search_rotated(ncandidates, query, precomputed_table, ctx.candidate_dists.data(),
+                       ctx.candidate_labels.data(), ctx, sel);
+
+        QueryStats *query_stats = this->query_stats(ctx);
+        const uint64_t t = query_stats ? stats_ticks() : 0;
+        refine_vectors->prefetch(ncandidates, candidates);
+
+        faiss::maxheap_heapify(k, distances, labels);
+        for (size_t i = 0; i < ncandidates; i++) {
+            // Vectors added after the file was loaded have no rows in it
+            if (candidates[i] < 0 || size_t(candidates[i]) >= refine_vectors->n)
+                continue;
+            float dist;
+            if (metric == METRIC_L2)
+                dist = refine_vectors->l2sqr(x, candidates[i]);
+            else if (metric == METRIC_INNER_PRODUCT)
+                dist = -refine_vectors->inner_product(x, candidates[i]);
+            else
+                dist = -refine_vectors->inner_product(x, candidates[i]) /
+                       std::sqrt(refine_vectors->norm_L2sqr(candidates[i]));
+            if (dist < distances[0]) {
+                faiss::maxheap_pop(k, distances, labels);
+                faiss::maxheap_push(k, distances, labels, dist, candidates[i]);
+            }
+        }
+        if (query_stats)
+            query_stats->lap(STAGE_REFINE, t);
+    }
+
+    void IndexIVF_HNSW::search_rotated(size_t k, const float *query, const float *precomputed_table,
+                                       float *distances, long *labels, SearchContext &ctx,
+                                       const IdSelector *sel) const
+    {
+        ctx.query_centroid_dists.resize(nprobe); // Distances to the coarse centroids.
+        ctx.centroid_idxs.resize(nprobe);        // Indices of the nearest coarse centroids
+        float *query_centroid_dists = ctx.query_centroid_dists.data();
+        idx_t *centroid_idxs = ctx.centroid_idxs.data();
+
+        QueryStats *query_stats = this->query_stats(ctx);
+        hnswlib::SearchCounters hnsw_counters;
+        uint64_t t = query_stats ? stats_ticks() : 0;
+
+        // Find the nearest coarse centroids to the query
+        auto coarse = quantizer->searchKnn(query, nprobe, query_stats ? &hnsw_counters : nullptr);
+        for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
+            query_centroid_dists[i] = coarse.top().first;
+            centroid_idxs[i] = coarse.top().second;
+            coarse.pop();
+        }
+        if (query_stats) {
+            t = query_stats->lap(STAGE_COARSE, t);
+            query_stats->counters[COUNTER_HNSW_HOPS] += hnsw_counters.hops;
+            query_stats->counters[COUNTER_HNSW_DIST_CALCS] += hnsw_counters.dist_calcs;
+        }
+        quantize_table(precomputed_table, ctx);
+        if (query_stats)
+            t = query_stats->lap(STAGE_TABLE, t);
+
+        // Snapshot of the lists, which stay alive even if compact() replaces them during the query
+        const std::shared_ptr<InvertedLists> lists = std::atomic_load(&invlists);
+        const bool check_deleted = deleted.count() > 0;
+        const bool inner_product = (metric != METRIC_L2);
 
         // Prepare max heap with k answers
         faiss::maxheap_heapify(k, distances, labels);
 
         size_t ncode = 0;
+        size_t nlists = 0;
+        size_t ninserted = 0;
         for (size_t i = 0; i < nprobe; i++) {
             const idx_t centroid_idx = centroid_idxs[i];
-            const size_t group_size = norm_codes[centroid_idx].size();
+            const size_t group_size = lists->list_size(centroid_idx);
             if (group_size == 0)
                 continue;
 
-            const uint8_t *code = codes[centroid_idx].data();
-            const uint8_t *norm_code = norm_codes[centroid_idx].data();
-            const idx_t *id = ids[centroid_idx].data();
-            const float term1 = query_centroid_dists[i] - centroid_norms[centroid_idx];
+            const uint8_t *code = lists->get_codes(centroid_idx);
+            const uint8_t *norm_code = lists->get_norm_codes(centroid_idx);
+            const idx_t *id = lists->get_ids(centroid_idx);
+            const float term1 = inner_product ? query_centroid_dists[i]
+                                              : query_centroid_dists[i] - centroid_norms[centroid_idx];
+
+            if (ctx.norms.size() < group_size)
+                ctx.norms.resize(group_size);
+            if (ctx.code_dists.size() < group_size)
+                ctx.code_dists.resize(group_size);
+            float *norms = ctx.norms.data();
+            float *code_dists = ctx.code_dists.data();
+
+            size_t nselected = group_size;
+            if (sel) {
+                // Compute term 3 only for the codes of the selected ids
+                nselected = scan_selected_codes(code, 0, group_size, id, sel, precomputed_table, code_dists, ctx);
+                if (nselected == 0)
+                    continue;
+            }
+            else {
+                // Compute term 3 for the whole list at once
+                scan_codes(code, 0, group_size, precomputed_table, code_dists, ctx);
+            }
+
+            if (query_stats)
+                t = query_stats->lap(STAGE_SCAN, t);
 
-            // Decode the norms of each vector in the list
-            norm_pq->decode(norm_code, norms.data(), group_size);
+            // Decode the norms of each vector in the list, the inner product does not need them
+            if (!inner_product)
+                norm_pq->decode(norm_code, norms, group_size);
+            if (query_stats)
+                t = query_stats->lap(STAGE_NORMS, t);
 
-            for (size_t j = 0; j < group_size; j++) {
-                const float term3 = 2 * pq_L2sqr(code + j * code_size);
-                const float dist = term1 + norms[j] - term3; //term2 = norms[j]
+            for (size_t s = 0; s < nselected; s++) {
+                const size_t j = sel ? ctx.selected[s] : s;
+                const float dist = inner_product ? term1 - code_dists[j]
+                                                 : term1 + norms[j] - 2 * code_dists[j]; //term2 = norms[j]
                 if (dist < distances[0]) {
+                    // Removed vectors are skipped only if they would enter the heap
+                    if (check_deleted && deleted.contains(id[j]))
+                        continue;
                     faiss::maxheap_pop(k, distances, labels);
                     faiss::maxheap_push(k, distances, labels, dist, id[j]);
+                    ninserted++;
                 }
             }
-            ncode += group_size;
+            if (query_stats)
+                t = query_stats->lap(STAGE_SCAN, t);
+            nlists++;
+            ncode += nselected;
             if (ncode >= max_codes)
                 break;
         }
-        if (do_opq)
-            delete const_cast<float *>(query);
+        if (query_stats) {
+            query_stats->counters[COUNTER_LISTS_PROBED] += nlists;
+            query_stats->counters[COUNTER_CODES_SCANNED] += ncode;
+            query_stats->counters[COUNTER_HEAP_INSERTIONS] += ninserted;
+        }
     }
 
 
     void IndexIVF_HNSW::train_pq(size_t n, const float *x)
     {
+        std::vector<float> normalized_x;
+        x = normalize_vectors(n, x, normalized_x);
+
         // Assign train vectors 
         std::vector <idx_t> assigned(n);
         assign(n, x, assigned.data());
@@ -244,8 +714,12 @@ namespace ivfhnsw {
         pq->verbose = true;
         pq->train(n, residuals.data());
 
+        // The inner product does not use the norm PQ
+        if (metric != METRIC_L2)
+            return;
+
         // Encode residuals
-        std::vector <uint8_t> xcodes(n * code_size);
+        std::vector <uint8_t> xcodes(n * pq->code_size);
         pq->compute_codes(residuals.data(), xcodes.data(), n);
 
         // Decode residuals
@@ -273,67 +747,275 @@ namespace ivfhnsw {
         norm_pq->train(n, norms.data());
     }
 
+    void IndexIVF_HNSW::finalize()
+    {
+        invlists->finalize();
+    }
+
+    size_t IndexIVF_HNSW::remove_ids(size_t n, const idx_t *ids)
+    {
+        std::lock_guard<std::mutex> lock(pending_lock);
+        size_t nremoved = 0;
+        for (size_t i = 0; i < n; i++) {
+            // A pending id is reclaimed, i.e. it is removed again, so the release must keep it
+            const bool was_pending = pending.reset(ids[i]);
+            nremoved += deleted.set(ids[i]) || was_pending;
+        }
+        return nremoved;
+    }
+
+    void IndexIVF_HNSW::release_pending(const std::vector<idx_t> &ids)
+    {
+        std::lock_guard<std::mutex> lock(pending_lock);
+        for (idx_t id : ids)
+            if (pending.reset(id))
+                deleted.reset(id);
+    }
+
+    size_t IndexIVF_HNSW::compact()
+    {
+        std::lock_guard<std::mutex> lock(compact_lock);
+        const std::shared_ptr<InvertedLists> old_lists = std::atomic_load(&invlists);
+        const size_t nsubgroups = old_lists->nsubgroups;
+
+        // Vectors of the build layout are appended, the result is packed if the current lists are
+        std::shared_ptr<InvertedLists> lists = std::make_shared<InvertedLists>(nc, nsubgroups, old_lists->has_norm_codes);
+        std::vector<std::vector<idx_t>> reclaimed(nc);
+
+        // Ids removed before compaction, including the ones matching no stored vector
+        std::vector<idx_t> released = deleted.to_ids();
+
+#pragma omp parallel for schedule(dynamic, 64)
+        for (size_t list_no = 0; list_no < nc; list_no++) {
+            const size_t list_size = old_lists->list_size(list_no);
+            const idx_t *ids = old_lists->get_ids(list_no);
+            const uint8_t *codes = old_lists->get_codes(list_no);
+            const uint8_t *norm_codes = old_lists->get_norm_codes(list_no);
+
+            std::vector<idx_t> &list_ids = lists->ids[list_no];
+            std::vector<uint8_t> &list_codes = lists->codes[list_no];
+            std::vector<uint8_t> &list_norm_codes = lists->norm_codes[list_no];
+
+            // Lists without subgroups are treated as a single subgroup
+            const size_t nsubc = std::max<size_t>(nsubgroups, 1);
+            const idx_t *old_subgroup_sizes = old_lists->subgroup_sizes.data() + list_no * nsubgroups;
+            idx_t *new_subgroup_sizes = lists->subgroup_sizes.mutable_data() + list_no * nsubgroups;
+
+            size_t j = 0;
+            for (size_t subc = 0; subc < nsubc; subc++) {
+                const size_t subgroup_end = nsubgroups ? j + old_subgroup_sizes[subc] : list_size;
+                const size_t subgroup_begin = list_ids.size();
+                for (; j < subgroup_end; j++) {
+                    if (deleted.contains(ids[j])) {
+                        reclaimed[list_no].push_back(ids[j]);
+                        continue;
+                    }
+                    copy_code(codes, j, list_codes, list_ids.size());
+                    list_ids.push_back(ids[j]);
+                    if (norm_codes)
+                        list_norm_codes.push_back(norm_codes[j]);
+                }
+                if (nsubgroups)
+                    new_subgroup_sizes[subc] = list_ids.size() - subgroup_begin;
+            }
+        }
+        if (old_lists->packed)
+            lists->finalize();
+
+        // Queries started after the store see the compacted lists
+        std::atomic_store(&invlists, lists);
+
+        // The reclaimed ids may be added again once no query uses the old lists: they are cleared
+        // from the deleted bitmap by the last holder of the old lists, which may be this call.
+        // The ids pending from an earlier compaction are left to the release of its lists
+        size_t nreclaimed = 0;
+        for (size_t list_no = 0; list_no < nc; list_no++) {
+            released.insert(released.end(), reclaimed[list_no].begin(), reclaimed[list_no].end());
+            nreclaimed += reclaimed[list_no].size();
+        }
+        {
+            std::lock_guard<std::mutex> pending_guard(pending_lock);
+            size_t npending = 0;
+            for (idx_t id : released)
+                if (deleted.contains(id) && pending.set(id))
+                    released[npending++] = id;
+            released.resize(npending);
+        }
+        old_lists->on_release = [this, released]() { release_pending(released); };
+        return nreclaimed;
+    }
+
     // Write index 
     void IndexIVF_HNSW::write(const char *path_index)
     {
-        std::ofstream output(path_index, std::ios::binary);
+        const std::string tmp_path = std::string(path_index) + ".tmp";
 
-        write_variable(output, d);
-        write_variable(output, nc);
+        IndexFileWriter writer(tmp_path.c_str());
+        writer.write_header(file_header());
+        write_sections(writer);
 
-        // Save vector indices
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, ids[i]);
+        // Save the bounds of the lists for range_search
+        writer.write_section(SECTION_MAX_RESIDUAL_NORMS, max_residual_norms.data(), nc);
 
-        // Save PQ codes
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, codes[i]);
+        // Save removed ids, which are not compacted yet. The pending ones are not stored in the lists
+        if (deleted.count() > 0) {
+            std::vector<idx_t> deleted_ids;
+            {
+                std::lock_guard<std::mutex> lock(pending_lock);
+                for (idx_t id : deleted.to_ids())
+                    if (!pending.contains(id))
+                        deleted_ids.push_back(id);
+            }
+            if (!deleted_ids.empty())
+                writer.write_section(SECTION_DELETED_IDS, deleted_ids.data(), deleted_ids.size());
+        }
+        writer.close();
 
-        // Save norm PQ codes
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, norm_codes[i]);
+        if (rename(tmp_path.c_str(), path_index) != 0)
+            throw std::runtime_error(std::string("Could not rename the index file to ") + path_index);
+    }
+
+    // Read index 
+    void IndexIVF_HNSW::read(const char *path_index, bool use_mmap)
+    {
+        if (!is_index_file(path_index)) {
+            if (metric != METRIC_L2)
+                throw std::runtime_error(std::string("Legacy index ") + path_index + " supports only the L2 metric");
+            std::ifstream input(path_index, std::ios::binary);
+            read_legacy(input);
+
+            // Legacy files do not bound the lists, so range_search visits all of them
+            max_residual_norms.clear();
+            max_residual_norms.resize(nc, std::numeric_limits<float>::infinity());
+            return;
+        }
+        IndexFileReader reader(path_index, use_mmap);
+        const IndexFileHeader header = reader.read_header();
+        const IndexFileHeader expected = file_header();
+        if (header.index_type != expected.index_type || header.d != d || header.nc != nc ||
+            header.nsubc != expected.nsubc || header.code_size != code_size || header.fast_scan != fast_scan ||
+            header.metric != metric)
+            throw std::runtime_error(std::string("Parameters of the index in ") + path_index +
+                                     " do not match the parameters of this index");
+        read_sections(reader);
+
+        // Read the bounds of the lists, the files written without them are searched without the bounds
+        if (reader.next_section_is(SECTION_MAX_RESIDUAL_NORMS))
+            reader.read_section(SECTION_MAX_RESIDUAL_NORMS, max_residual_norms, nc);
+        else {
+            max_residual_norms.clear();
+            max_residual_norms.resize(nc, std::numeric_limits<float>::infinity());
+        }
+
+        // Read removed ids
+        deleted.clear();
+        pending.clear();
+        if (reader.next_section_is(SECTION_DELETED_IDS)) {
+            MaybeOwnedVector<idx_t> deleted_ids;
+            reader.read_section(SECTION_DELETED_IDS, deleted_ids);
+            for (size_t i = 0; i < deleted_ids.size(); i++)
+                deleted.set(deleted_ids[i]);
+        }
+    }
+
+    IndexFileHeader IndexIVF_HNSW::file_header() const
+    {
+        IndexFileHeader header = {};
+        header.magic = index_file_magic;
+        header.version = index_file_version;
+        header.index_type = INDEX_IVF_HNSW;
+        header.d = d;
+        header.nc = nc;
+        header.nsubc = 0;
+        header.code_size = code_size;
+        header.fast_scan = fast_scan;
+        header.metric = metric;
+        return header;
+    }
+
+    void IndexIVF_HNSW::write_sections(IndexFileWriter &writer) const
+    {
+        // Save vector indices, PQ codes and norm PQ codes
+        invlists->write(writer);
 
         // Save centroid norms
-        write_vector(output, centroid_norms);
+        writer.write_section(SECTION_CENTROID_NORMS, centroid_norms.data(), nc);
     }
 
-    // Read index 
-    void IndexIVF_HNSW::read(const char *path_index)
+    void IndexIVF_HNSW::read_sections(IndexFileReader &reader)
     {
-        std::ifstream input(path_index, std::ios::binary);
+        // Read vector indices, PQ codes and norm PQ codes
+        invlists->read(reader);
+
+        // Read centroid norms
+        reader.read_section(SECTION_CENTROID_NORMS, centroid_norms, nc);
+    }
 
+    void IndexIVF_HNSW::read_legacy(std::istream &input)
+    {
         read_variable(input, d);
         read_variable(input, nc);
 
-        // Read vector indices
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, ids[i]);
-
-        // Read PQ codes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, codes[i]);
-
-        // Read norm PQ codes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, norm_codes[i]);
+        // Read vector indices, PQ codes and norm PQ codes into the packed lists
+        invlists->read_legacy(input);
 
         // Read centroid norms
-        read_vector(input, centroid_norms);
+        std::vector<float> norms;
+        read_vector(input, norms);
+        centroid_norms.assign(norms.data(), norms.data() + norms.size());
     }
 
     void IndexIVF_HNSW::compute_centroid_norms()
     {
+        centroid_norms.resize(nc);
+        float *norms = centroid_norms.mutable_data();
+        std::vector<float> decoded_centroid(d);
         for (size_t i = 0; i < nc; i++) {
-            const float *centroid = quantizer->getDataByInternalId(i);
-            centroid_norms[i] = faiss::fvec_norm_L2sqr(centroid, d);
+            const float *centroid = quantizer->getVector(i, decoded_centroid.data());
+            norms[i] = faiss::fvec_norm_L2sqr(centroid, d);
         }
     }
 
+    void IndexIVF_HNSW::load_refine_vectors(const char *path, size_t k_factor)
+    {
+        if (k_factor == 0)
+            throw std::runtime_error("k_factor must be positive");
+        RawVectors *vectors = new RawVectors(path, d);
+
+        // The candidates are read by their ids, a shorter file is a wrong base set or a wrong -nb
+        const std::shared_ptr<InvertedLists> lists = std::atomic_load(&invlists);
+        size_t max_id = 0;
+        for (size_t list_no = 0; list_no < nc; list_no++) {
+            const idx_t *ids = lists->get_ids(list_no);
+            for (size_t j = 0; j < lists->list_size(list_no); j++)
+                max_id = std::max<size_t>(max_id, ids[j] + 1);
+        }
+        if (max_id > vectors->n) {
+            const std::string message = std::string(path) + " contains " + std::to_string(vectors->n) +
+                                        " vectors, but the index stores the id " + std::to_string(max_id - 1);
+            delete vectors;
+            throw std::runtime_error(message);
+        }
+        if (refine_vectors)
+            delete refine_vectors;
+        refine_vectors = vectors;
+        this->k_factor = k_factor;
+    }
+
+    void IndexIVF_HNSW::set_search_params(const SearchParams &params)
+    {
+        nprobe = params.nprobe;
+        max_codes = params.max_codes;
+        quantizer->efSearch = params.efSearch;
+    }
+
     void IndexIVF_HNSW::rotate_quantizer() {
         if (!do_opq){
             printf("OPQ encoding is turned off\n");
             abort();
         }
+        if (quantizer->storage_ != hnswlib::STORAGE_FLOAT)
+            throw std::runtime_error("The quantizer has to be rotated before it is compressed");
         std::vector<float> copy_centroid(d);
         for (size_t i = 0; i < nc; i++){
             float *centroid = quantizer->getDataByInternalId(i);
@@ -342,7 +1024,116 @@ namespace ivfhnsw {
         }
     }
 
-    float IndexIVF_HNSW::pq_L2sqr(const uint8_t *code)
+    const float *IndexIVF_HNSW::rotate_query(const float *x, SearchContext &ctx) const
+    {
+        if (!do_opq)
+            return x;
+        ctx.query.resize(d);
+        opq_matrix->apply_noalloc(1, x, ctx.query.data());
+        return ctx.query.data();
+    }
+
+    void IndexIVF_HNSW::quantize_table(const float *precomputed_table, SearchContext &ctx) const
+    {
+        if (!fast_scan)
+            return;
+        // The scan minimizes the sum, hence the table is negated
+        ctx.lut.resize(pq->M * pq->ksub);
+        pq4_quantize_lut(pq->M, precomputed_table, -1, ctx.lut.data(), &ctx.lut_scale, &ctx.lut_bias);
+        ctx.scanned_codes = nullptr;
+        ctx.scanned_begin = ctx.scanned_end = 0;
+    }
+
+    void IndexIVF_HNSW::scan_codes(const uint8_t *list_codes, size_t offset, size_t n,
+                                   const float *precomputed_table, float *code_dists, SearchContext &ctx) const
+    {
+        if (!fast_scan) {
+            pq_scan_codes(n, list_codes + offset * code_size, code_size, pq->ksub, precomputed_table, code_dists);
+            return;
+        }
+        // Blocks overlapping [offset, offset + n)
+        const size_t first_block = offset / pq4_block_size;
+        const size_t last_block = (offset + n + pq4_block_size - 1) / pq4_block_size;
+
+        // The ranges of a list are scanned in the increasing order, so the scanned blocks stay contiguous:
+        // only the blocks past the scanned ones are scanned, unless the range starts elsewhere
+        if (ctx.scanned_codes != list_codes || first_block < ctx.scanned_begin || first_block > ctx.scanned_end) {
+            ctx.scanned_codes = list_codes;
+            ctx.scanned_begin = ctx.scanned_end = first_block;
+        }
+        if (last_block > ctx.scanned_end) {
+            const size_t nscanned = ctx.scanned_end - ctx.scanned_begin;
+            if (ctx.block_dists.size() < (last_block - ctx.scanned_begin) * pq4_block_size)
+                ctx.block_dists.resize((last_block - ctx.scanned_begin) * pq4_block_size);
+            pq4_scan_blocks(last_block - ctx.scanned_end, list_codes + ctx.scanned_end * pq->M * 16, pq->M,
+                            ctx.lut.data(), ctx.block_dists.data() + nscanned * pq4_block_size);
+            ctx.scanned_end = last_block;
+        }
+
+        const uint16_t *block_dists = ctx.block_dists.data() + offset - ctx.scanned_begin * pq4_block_size;
+        for (size_t j = 0; j < n; j++)
+            code_dists[j] = -(ctx.lut_bias + block_dists[j] / ctx.lut_scale);
+    }
+
+    size_t IndexIVF_HNSW::scan_selected_codes(const uint8_t *list_codes, size_t offset, size_t n, const idx_t *ids,
+                                              const IdSelector *sel, const float *precomputed_table,
+                                              float *code_dists, SearchContext &ctx) const
+    {
+        std::vector<uint32_t> &selected = ctx.selected;
+        selected.clear();
+        for (size_t j = 0; j < n; j++)
+            if (sel->is_member(ids[j]))
+                selected.push_back(j);
+        if (selected.empty())
+            return 0;
+
+        const size_t first = selected.front();
+        const size_t last = selected.back() + 1;
+        if (!fast_scan && 4 * selected.size() < last - first) {
+            // Few byte codes are selected: look up the table only for them
+            for (uint32_t j : selected)
+                code_dists[j] = pq_L2sqr(list_codes + (offset + j) * code_size, precomputed_table);
+        }
+        else {
+            // Otherwise the SIMD scan of the range of the selected codes is faster
+            scan_codes(list_codes, offset + first, last - first, precomputed_table, code_dists + first, ctx);
+        }
+        return selected.size();
+    }
+
+    void IndexIVF_HNSW::append_code(std::vector<uint8_t> &list_codes, size_t list_size, const uint8_t *code) const
+    {
+        if (!fast_scan) {
+            list_codes.insert(list_codes.end(), code, code + code_size);
+            return;
+        }
+        // Allocate a new block, if the last one is full
+        if (list_size % pq4_block_size == 0)
+            list_codes.resize(pq4_blocks_size(list_size + 1, pq->M));
+
+        // Depending on the version, faiss stores 4-bit indices either one per byte or two per byte
+        uint8_t idx[pq->M];
+        for (size_t m = 0; m < pq->M; m++)
+            idx[m] = (pq->code_size == pq->M) ? code[m] : (code[m / 2] >> (4 * (m % 2))) & 0x0f;
+        pq4_set_code(list_codes.data(), list_size, pq->M, idx);
+    }
+
+    void IndexIVF_HNSW::copy_code(const uint8_t *src_codes, size_t i, std::vector<uint8_t> &list_codes,
+                                  size_t list_size) const
+    {
+        if (!fast_scan) {
+            list_codes.insert(list_codes.end(), src_codes + i * code_size, src_codes + (i + 1) * code_size);
+            return;
+        }
+        if (list_size % pq4_block_size == 0)
+            list_codes.resize(pq4_blocks_size(list_size + 1, pq->M));
+
+        uint8_t idx[pq->M];
+        pq4_get_code(src_codes, i, pq->M, idx);
+        pq4_set_code(list_codes.data(), list_size, pq->M, idx);
+    }
+
+    float IndexIVF_HNSW::pq_L2sqr(const uint8_t *code, const float *precomputed_table) const
     {
         float result = 0.;
         const size_t dim = code_size >> 2;
@@ -359,16 +1150,18 @@ namespace ivfhnsw {
     // Private 
     void IndexIVF_HNSW::reconstruct(size_t n, float *x, const float *decoded_residuals, const idx_t *keys)
     {
+        std::vector<float> decoded_centroid(d);
         for (size_t i = 0; i < n; i++) {
-            const float *centroid = quantizer->getDataByInternalId(keys[i]);
+            const float *centroid = quantizer->getVector(keys[i], decoded_centroid.data());
             faiss::fvec_madd(d, decoded_residuals + i*d, 1., centroid, x + i*d);
         }
     }
 
     void IndexIVF_HNSW::compute_residuals(size_t n, const float *x, float *residuals, const idx_t *keys)
     {
+        std::vector<float> decoded_centroid(d);
         for (size_t i = 0; i < n; i++) {
-            const float *centroid = quantizer->getDataByInternalId(keys[i]);
+            const float *centroid = quantizer->getVector(keys[i], decoded_centroid.data());
             faiss::fvec_madd(d, x + i*d, -1., centroid, residuals + i*d);
         }
     }
@@ -5,6 +5,11 @@
 #include <fstream>
 #include <cstdio>
 #include <unordered_map>
+#include <string>
+#include <stdexcept>
+#include <mutex>
+#include <memory>
+#include <omp.h>
 
 #include <faiss/index_io.h>
 #include <faiss/Heap.h>
@@ -15,6 +20,15 @@
 
 #include <hnswlib/hnswalg.h>
 #include "utils.h"
+#include "pq_scan.h"
+#include "InvertedLists.h"
+#include "BulkAssigner.h"
+#include "IdBitmap.h"
+#include "IdSelector.h"
+#include "RawVectors.h"
+#include "RangeSearchResult.h"
+#include "SearchStats.h"
+#include "SearchParams.h"
 
 namespace ivfhnsw {
     /** Index based on a inverted file (IVF) with Product Quantizer encoding.
@@ -36,6 +50,11 @@ namespace ivfhnsw {
       *
       * Each residual vector is encoded as a product quantizer code.
       *
+      * With the inner product and the cosine metrics the distances are the negative inner products,
+      * so the nearest vectors still have the smallest distances. The inner product of a vector is
+      * decomposed into the inner products with its centroid and with its residual, the norm codes
+      * are not stored.
+      *
       * Currently only asymmetric queries are supported:
       * database-to-database queries are not implemented.
     */
@@ -46,8 +65,12 @@ namespace ivfhnsw {
         size_t d;               ///< Vector dimension
         size_t nc;              ///< Number of centroids
         size_t code_size;       ///< Code size per vector in bytes
+        MetricType metric;      ///< L2, inner product or cosine, the quantizer graph is built in the same metric
+        bool fast_scan;         ///< 4-bit PQ codes stored in blocks of pq4_block_size and scanned with uint8 LUTs
 
         hnswlib::HierarchicalNSW *quantizer; ///< Quantizer that maps vectors to inverted lists (HNSW [Y.Malkov])
+        BulkAssigner *assigner;              ///< Assigns vectors to the inverted lists, created by the first assign()
+        BulkAssigner::Mode assign_mode;      ///< HNSW search or exact search of the nearest centroids in assign()
 
         faiss::ProductQuantizer *pq;         ///< Produces the residual codes
         faiss::ProductQuantizer *norm_pq;    ///< Produces the norm codes of reconstructed base vectors
@@ -56,23 +79,98 @@ namespace ivfhnsw {
 
         size_t nprobe;        ///< Number of probes at search time
         size_t max_codes;     ///< Max number of codes to visit to do a query
+        size_t search_batch_size;  ///< Number of queries per block in the batch search
+
+        RawVectors *refine_vectors;  ///< If set, the candidates of the PQ search are re-ranked by the exact distances
+        size_t k_factor;             ///< Number of candidates to re-rank per result, k_factor * k in total
 
-        std::vector<std::vector<idx_t> > ids;           ///< Inverted lists for indexes
-        std::vector<std::vector<uint8_t> > codes;       ///< PQ codes of residuals
-        std::vector<std::vector<uint8_t> > norm_codes;  ///< PQ codes of norms of reconstructed base vectors
+        /** If set, the search times its stages and counts its work for each query, and adds the query to it
+          *
+          * The collector is not owned by the index. The statistics are compiled out if IVFHNSW_SEARCH_STATS is 0.
+        */
+        SearchStatsCollector *stats;
+
+        /** Vector indices, PQ codes of residuals and PQ codes of norms of reconstructed base vectors
+          *
+          * Queries take a snapshot of the pointer by std::atomic_load, so compact() can replace the lists
+          * while the index is searched.
+        */
+        std::shared_ptr<InvertedLists> invlists;
+
+        IdBitmap deleted;        ///< Ids removed by remove_ids(), which are still stored in the lists
+
+        /** Ids reclaimed by compact(), which stay in the deleted bitmap until the old lists are released
+          *
+          * remove_ids() takes an id out of it, so the release does not undo a later removal.
+        */
+        IdBitmap pending;
+
+        /** Per-query scratch space of the search procedure
+          *
+          * All buffers written at query time live here instead of in the index,
+          * so one index instance can serve several threads at once as long as
+          * each thread passes its own context. A context is reusable across queries.
+        */
+        struct SearchContext
+        {
+            std::vector<float> query;                    ///< Rotated query (OPQ only), size d
+            std::vector<float> normalized_query;         ///< Normalized query (cosine only), size d
+            std::vector<float> precomputed_table;        ///< Size pq.M * pq.ksub
+            std::vector<float> norms;                    ///< L2 square norms of reconstructed base vectors of a (sub)group
+            std::vector<float> code_dists;               ///< Inner products between the query and the PQ codes of a (sub)group
+            std::vector<uint8_t> lut;                    ///< Quantized look-up table (fast-scan only), size pq.M * pq.ksub
+            float lut_scale;                             ///< Scale of the quantized look-up table
+            float lut_bias;                              ///< Bias of the quantized look-up table
+            std::vector<uint16_t> block_dists;           ///< Sums of the quantized table entries for scanned blocks
+            const uint8_t *scanned_codes;                ///< List, whose blocks [scanned_begin, scanned_end) are in block_dists
+            size_t scanned_begin;                        ///< First scanned block of the list (fast-scan only)
+            size_t scanned_end;                          ///< End of the scanned blocks of the list (fast-scan only)
+            std::vector<float> query_centroid_dists;     ///< Distances to the coarse centroids
+            std::vector<idx_t> centroid_idxs;            ///< Indices of the nearest coarse centroids
+            std::vector<idx_t> used_centroid_idxs;       ///< Indices of coarse centroids, which distances are computed (Grouping)
+            std::vector<float> query_subcentroid_dists;  ///< Distances to sub-centroids, used for pruning (Grouping)
+            std::vector<float> decoded_centroid;         ///< Centroid decoded from the compressed quantizer (Grouping), size d
+            std::vector<uint32_t> selected;              ///< Positions of the codes accepted by the selector (filtered search)
+            std::vector<float> candidate_dists;          ///< PQ distances of the candidates to re-rank, size k_factor * k
+            std::vector<long> candidate_labels;          ///< Labels of the candidates to re-rank, size k_factor * k
+            std::vector<float> probe_bounds;             ///< Max residual norms of the remaining probes (range search), size nprobe
+            QueryStats stats;                            ///< Statistics of the last query, if the index collects them
+        };
 
     protected:
-        std::vector<float> norms;           ///< L2 square norms of reconstructed base vectors
-        std::vector<float> centroid_norms;  ///< L2 square norms of coarse centroids
+        MaybeOwnedVector<float> centroid_norms;  ///< L2 square norms of coarse centroids
+
+        /** Max distance between a reconstructed vector of each list and the coarse centroid, size nc
+          *
+          * It bounds the distances of the list codes from below by the distance to the centroid,
+          * so range_search skips the lists, which are out of the radius. Infinite for the lists
+          * of the indexes written without the bounds.
+        */
+        MaybeOwnedVector<float> max_residual_norms;
+
+        std::vector<std::mutex> list_locks;      ///< Striped locks of the inverted lists used by add_batch
+        std::mutex unpack_lock;                  ///< Guards unpacking of the finalized lists before adding
+        std::mutex assign_lock;                  ///< Serializes assign() calls, each of them runs in parallel
+        std::mutex compact_lock;                 ///< Serializes compact() calls
+        std::mutex pending_lock;                 ///< Guards the pending ids against remove_ids() and write()
+
+        SearchContext context;                   ///< Context used by the single-threaded search
 
     public:
+        /** @param bytes_per_code   code size per vector in bytes
+          * @param nbits_per_idx    bits per sub-quantizer index: 8, or 4 for the fast-scan codes
+          *                         (then each byte of the code holds 2 sub-quantizer indices)
+          * @param metric_type      metric of the search
+        */
         explicit IndexIVF_HNSW(size_t dim, size_t ncentroids, size_t bytes_per_code,
-                               size_t nbits_per_idx, size_t max_group_size = 65536);
+                               size_t nbits_per_idx, size_t max_group_size = 65536,
+                               MetricType metric_type = METRIC_L2);
         virtual ~IndexIVF_HNSW();
 
         /** Construct from stretch or load the existing quantizer (HNSW) instance
           *
-          * if all files exist, quantizer will be loaded, else HNSW will be constructed
+          * if all files exist, quantizer will be loaded, else HNSW will be constructed.
+          * The metric is stored in path_info, loading a graph built for another metric throws
           * @param path_data           path to input vectors
           * @param path_info           path to parameters for HNSW
           * @param path_edges          path to edges for HNSW
@@ -83,34 +181,102 @@ namespace ivfhnsw {
                              size_t M=16, size_t efConstruction = 500);
 
         /** Return the indices of the k HNSW vertices closest to the query x.
+          *
+          * Vectors are assigned by the assigner in the assign_mode, the time is accumulated in the assigner.
           *
           * @param n           number of input vectors
           * @param x           query vectors, size n * d
-          * @param labels      output labels of the nearest neighbours, size n * k
+          * @param labels      output labels of the nearest neighbours sorted by the distance, size n * k
           * @param k           number of the closest HNSW vertices to the query x
         */
         void assign (size_t n, const float *x, idx_t *labels, size_t k = 1);
 
+        /** Assign n vectors of the given type, the vectors are converted to floats block by block
+          *
+          * @param x           vectors, size n * d elements of the type
+          * @param type        element type of x: float, uint8, int8 or fp16
+        */
+        void assign (size_t n, const void *x, VectorType type, idx_t *labels, size_t k = 1);
+
         /** Query n vectors of dimension d to the index.
          *
          * Return at most k vectors. If there are not enough results for a
          * query, the result array is padded with -1s.
          *
+         * Uses the context owned by the index, hence it is not thread-safe.
+         *
          * @param k           number of the closest vertices to search
          * @param x           query vector, size d
          * @param distances   output pairwise distances, size k
          * @param labels      output labels of the nearest neighbours, size k
          */
-        virtual void search(size_t k, const float *x, float *distances, long *labels);
+        void search(size_t k, const float *x, float *distances, long *labels);
+
+        /** Thread-safe version of the search: all the scratch data is kept in ctx.
+         *
+         * Several threads may query the same index concurrently, each with its own context.
+         *
+         * @param ctx         per-thread search context, reused across queries
+         * @param sel         if non-null, only the vectors of the subset are returned. The subset is checked
+         *                    before the distances are computed and max_codes counts only the selected codes
+         */
+        void search(size_t k, const float *x, float *distances, long *labels, SearchContext &ctx,
+                    const IdSelector *sel = nullptr) const;
+
+        /** Query n vectors of dimension d to the index in parallel.
+         *
+         * Queries are processed in blocks of <search_batch_size>: the OPQ rotation and
+         * the inner product tables are computed for the whole block at once (BLAS),
+         * then the queries of the block are distributed across the OpenMP threads.
+         *
+         * @param n           number of queries
+         * @param x           query vectors, size n * d
+         * @param k           number of the closest vertices to search
+         * @param distances   output pairwise distances, size n * k
+         * @param labels      output labels of the nearest neighbours, size n * k
+         * @param sel         if non-null, only the vectors of the subset are returned
+         */
+        void search(size_t n, const float *x, size_t k, float *distances, long *labels,
+                    const IdSelector *sel = nullptr) const;
+
+        /** Find all vectors within the radius of each of n queries in parallel.
+         *
+         * The same nprobe nearest lists are visited as by search, but max_codes is not used. The lists
+         * whose vectors are all farther than the radius, judging by the distance to the centroid, are skipped,
+         * and the search stops once no remaining list may contain a result.
+         *
+         * @param n           number of queries
+         * @param x           query vectors, size n * d
+         * @param radius      L2 square distance threshold, the vectors with a smaller distance are returned
+         * @param result      output results of all queries
+         * @param sel         if non-null, only the vectors of the subset are returned
+         */
+        void range_search(size_t n, const float *x, float radius, RangeSearchResult &result,
+                          const IdSelector *sel = nullptr) const;
 
         /** Add n vectors of dimension d to the index.
+          *
+          * Vectors are encoded in parallel blocks, then appended to the inverted lists under striped locks.
+          * Several threads may call add_batch concurrently. Within a call, the vectors of each list keep
+          * the input order. The order across concurrent calls is unspecified, as their appends interleave.
           *
           * @param n                 number of base vectors in a batch
           * @param x                 base vectors to add, size n * d
           * @param xids              ids to store for the vectors (size n)
           * @param precomputed_idx   if non-null, assigned idxs to store for the vectors (size n)
         */
-        virtual void add_batch(size_t n, const float *x, const idx_t *xids, const idx_t *precomputed_idx = nullptr);
+        void add_batch(size_t n, const float *x, const idx_t *xids, const idx_t *precomputed_idx = nullptr);
+
+        /** Add n vectors of the given type to the index
+          *
+          * Each encoding block is converted to floats by its thread, so the batch stays in the input type
+          * and takes 4 (uint8, int8) or 2 (fp16) times less memory than the float batch.
+          *
+          * @param x                 base vectors to add, size n * d elements of the type
+          * @param type              element type of x: float, uint8, int8 or fp16
+        */
+        virtual void add_batch(size_t n, const void *x, VectorType type, const idx_t *xids,
+                               const idx_t *precomputed_idx = nullptr);
 
         /** Train product quantizers
           *
@@ -119,11 +285,78 @@ namespace ivfhnsw {
         */
         virtual void train_pq(size_t n, const float *x);
 
-        /// Write index to the path
-        virtual void write(const char *path);
+        /** Remove the vectors with the ids from the search results
+          *
+          * The ids are only marked in the deleted bitmap, the space is reclaimed by compact().
+          * May run concurrently with the search.
+          *
+          * @param n     number of ids
+          * @param ids   ids of the vectors to remove, size n
+          * @return      number of ids, which were not removed before
+        */
+        size_t remove_ids(size_t n, const idx_t *ids);
+
+        /** Rewrite the inverted lists without the removed vectors
+          *
+          * The compacted lists (and subgroup sizes of the grouping index) are built aside and
+          * replace the current ones at once, so compact() may run in a background thread while
+          * the index is searched. It must not run concurrently with adding vectors.
+          * Peak memory is the size of the current and the compacted lists.
+          *
+          * compact() does not wait for the queries: the reclaimed ids, and the removed ids matching
+          * no stored vector, become pending and are cleared from the deleted bitmap by the last release
+          * of the old lists, so they may be added again. Until then they are still filtered out of the
+          * results, but they are not written to the index file, and removing one of them again keeps it
+          * removed after the release. A thread holding a snapshot of the lists must not call compact(),
+          * as the ids are only cleared once it releases the snapshot.
+          *
+          * @return      number of vectors removed from the lists
+        */
+        size_t compact();
+
+    protected:
+        /// Clear the ids, which are still pending, from the deleted bitmap. Run by the release of the old lists
+        void release_pending(const std::vector<idx_t> &ids);
+
+    public:
+        /** Pack the inverted lists into contiguous arenas once all vectors are added
+          *
+          * Search works without it, but the packed lists take less memory and are scanned faster.
+          * Adding vectors after finalize() unpacks the lists again.
+        */
+        void finalize();
+
+        /** Write index to the path
+          *
+          * The file is written under a temporary name and renamed, so an index mapped
+          * from the same path keeps its data.
+        */
+        void write(const char *path);
+
+        /** Read index from the path
+          *
+          * Files in the sectioned format are memory-mapped and searched in place, so the
+          * load takes no time and several processes share the same pages. Otherwise the
+          * index is copied to memory: the legacy files are always loaded this way.
+          *
+          * @param use_mmap   map the file instead of copying it to memory.
+          *                   Adding vectors to a mapped index copies the lists first
+        */
+        void read(const char *path, bool use_mmap = true);
+
+        /** Re-rank the search results by the exact distances to the original vectors
+          *
+          * The file is memory-mapped: only the rows of the candidates are read at search time.
+          * Throws if the file has fewer vectors than the largest stored id. The candidates added
+          * after loading, which have no rows in the file, are dropped from the results.
+          *
+          * @param path       path to the base set in the fvecs or bvecs format
+          * @param k_factor   the PQ search returns k_factor * k candidates, which are re-ranked
+        */
+        void load_refine_vectors(const char *path, size_t k_factor);
 
-        /// Read index from the path
-        virtual void read(const char *path);
+        /// Set nprobe, max_codes and efSearch of the quantizer, e.g. chosen by select_search_params() from a tuned file
+        virtual void set_search_params(const SearchParams &params);
 
         /// Compute norms of the HNSW vertices
         void compute_centroid_norms();
@@ -132,11 +365,113 @@ namespace ivfhnsw {
         void rotate_quantizer();
 
     protected:
-        /// Size pq.M * pq.ksub
-        std::vector<float> precomputed_table;
+        /// Header of the index file, the derived indexes set their type and parameters
+        virtual IndexFileHeader file_header() const;
+
+        /// Write the sections of the index file
+        virtual void write_sections(IndexFileWriter &writer) const;
+
+        /// Read the sections of the index file
+        virtual void read_sections(IndexFileReader &reader);
+
+        /// Read the index from the legacy stream format
+        virtual void read_legacy(std::istream &input);
+
+        /** Search a query, which is already rotated and whose inner product table is precomputed
+          *
+          * @param query               (rotated) query vector, size d
+          * @param precomputed_table   inner products between the query and the PQ centroids, size pq.M * pq.ksub
+          * @param sel                 if non-null, subset of the ids to search
+        */
+        virtual void search_rotated(size_t k, const float *query, const float *precomputed_table,
+                                    float *distances, long *labels, SearchContext &ctx,
+                                    const IdSelector *sel) const;
+
+        /** Range search of a query, which is already rotated and whose inner product table is precomputed
+          *
+          * The results are appended to distances and labels in the scan order.
+        */
+        virtual void range_search_rotated(const float *query, const float *precomputed_table, float radius,
+                                          std::vector<float> &distances, std::vector<long> &labels,
+                                          SearchContext &ctx, const IdSelector *sel) const;
+
+        /** Bound the residual norms of the probed lists for the early stop of the range search
+          *
+          * The i-th entry of ctx.probe_bounds is the max of max_residual_norms over the i-th and all farther probes.
+          *
+          * @param centroid_idxs   nprobe nearest centroids sorted by the distance
+        */
+        void compute_probe_bounds(const idx_t *centroid_idxs, SearchContext &ctx) const;
+
+        /** Lower bound of the distances between the query and the vectors of a list
+          *
+          * @param centroid_dist       distance between the query and the list centroid
+          * @param max_residual_norm   max distance between the list vectors and the centroid
+          * @param query_norm          L2 norm of the query, used by the inner product
+        */
+        float list_dist_bound(float centroid_dist, float max_residual_norm, float query_norm) const;
+
+        /// Distance between a query and a centroid in the metric of the index
+        float centroid_dist(const float *x, const float *centroid) const;
+
+        /// Normalize n vectors for the cosine metric. Returns either x or the normalized copy stored in buf
+        const float *normalize_vectors(size_t n, const float *x, std::vector<float> &buf) const;
+
+        /** Search a rotated query and re-rank the candidates if refine_vectors are set
+          *
+          * @param x           original query vector, whose exact distances are used for re-ranking
+          * @param query       rotated query vector
+        */
+        void search_and_refine(size_t k, const float *x, const float *query, const float *precomputed_table,
+                               float *distances, long *labels, SearchContext &ctx, const IdSelector *sel) const;
+
+        /// Statistics of the current query in ctx, nullptr if they are not collected
+        inline QueryStats *query_stats(SearchContext &ctx) const {
+            return (search_stats_enabled && stats) ? &ctx.stats : nullptr;
+        }
+
+        /// Rotate the query if OPQ is used. Returns either x or the rotated copy stored in ctx
+        const float *rotate_query(const float *x, SearchContext &ctx) const;
+
+        /// Quantize the look-up table into ctx.lut and drop the scanned blocks of the previous query.
+        /// Has to be called once per query before scan_codes in the fast-scan mode
+        void quantize_table(const float *precomputed_table, SearchContext &ctx) const;
+
+        /** Compute inner products between the query and n codes of an inverted list
+          *
+          * In the fast-scan mode the codes are scanned in whole blocks. The blocks scanned for the previous
+          * range of the same list are reused, so the subgroups sharing a block scan it only once.
+          *
+          * @param list_codes          codes of the inverted list
+          * @param offset              position of the first code to scan in the list
+          * @param n                   number of codes to scan
+          * @param precomputed_table   inner products between the query and the PQ centroids
+          * @param code_dists          output inner products, size n
+        */
+        void scan_codes(const uint8_t *list_codes, size_t offset, size_t n, const float *precomputed_table,
+                        float *code_dists, SearchContext &ctx) const;
+
+        /** Compute inner products between the query and the codes of an inverted list, whose ids are in the subset
+          *
+          * Positions of the selected codes are stored in ctx.selected. If few codes are selected,
+          * the distances of the other codes are not computed at all.
+          *
+          * @param ids                 ids of the n codes to scan
+          * @param code_dists          output inner products at the positions of the selected codes, size n
+          * @return                    number of the selected codes
+        */
+        size_t scan_selected_codes(const uint8_t *list_codes, size_t offset, size_t n, const idx_t *ids,
+                                   const IdSelector *sel, const float *precomputed_table, float *code_dists,
+                                   SearchContext &ctx) const;
+
+        /// Append a code produced by pq to an inverted list of list_size codes
+        void append_code(std::vector<uint8_t> &list_codes, size_t list_size, const uint8_t *code) const;
+
+        /// Append the i-th code of an inverted list to another inverted list of list_size codes
+        void copy_code(const uint8_t *src_codes, size_t i, std::vector<uint8_t> &list_codes, size_t list_size) const;
 
         /// L2 sqr distance function for PQ codes
-        float pq_L2sqr(const uint8_t *code);
+        float pq_L2sqr(const uint8_t *code, const float *precomputed_table) const;
 
     private:
         void reconstruct(size_t n, float *x, const float *decoded_residuals, const idx_t *keys);
@@ -2,59 +2,83 @@
 
 namespace ivfhnsw
 {
+    /// Entries of ctx.query_centroid_dists, whose distances to the query are not computed yet
+    static const float dist_not_computed = std::numeric_limits<float>::max();
+
     //================================================
     // IVF_HNSW + grouping( + pruning) implementation
     //================================================
     IndexIVF_HNSW_Grouping::IndexIVF_HNSW_Grouping(size_t dim, size_t ncentroids, size_t bytes_per_code,
-                                                   size_t nbits_per_idx, size_t nsubcentroids):
-           IndexIVF_HNSW(dim, ncentroids, bytes_per_code, nbits_per_idx), nsubc(nsubcentroids)
+                                                   size_t nbits_per_idx, size_t nsubcentroids, MetricType metric_type):
+           IndexIVF_HNSW(dim, ncentroids, bytes_per_code, nbits_per_idx, 65536, metric_type), nsubc(nsubcentroids)
     {
-        alphas.resize(nc);
-        nn_centroid_idxs.resize(nc);
-        subgroup_sizes.resize(nc);
+        // Sub-centroids lie between a centroid and its nearest centroids, which are not defined
+        // by the inner product of the vectors with arbitrary norms
+        if (metric == METRIC_INNER_PRODUCT)
+            throw std::runtime_error("The grouping index supports the inner product only for the cosine metric");
 
-        query_centroid_dists.resize(nc);
-        std::fill(query_centroid_dists.begin(), query_centroid_dists.end(), 0);
-        inter_centroid_dists.resize(nc);
+        invlists = std::make_shared<InvertedLists>(nc, nsubc, metric == METRIC_L2);
+        alphas.resize(nc);
+        nn_centroid_idxs.resize(nc * nsubc);
+        inter_centroid_dists.resize(nc * nsubc);
     }
 
     void IndexIVF_HNSW_Grouping::add_group(size_t centroid_idx, size_t group_size,
                                            const float *data, const idx_t *idxs)
     {
+        add_group(centroid_idx, group_size, data, VECTOR_FLOAT, idxs);
+    }
+
+    void IndexIVF_HNSW_Grouping::add_group(size_t centroid_idx, size_t group_size,
+                                           const void *x, VectorType type, const idx_t *idxs)
+    {
+        if (invlists->packed) {
+            std::cout << "Groups cannot be added to the finalized index\n";
+            abort();
+        }
+        // Only the group is converted to floats. The cosine metric encodes the normalized vectors
+        std::vector<float> converted_data, normalized_data;
+        const float *data = to_float_vectors(type, group_size, d, x, converted_data);
+        data = normalize_vectors(group_size, data, normalized_data);
+
         // Find NN centroids to source centroid 
-        const float *centroid = quantizer->getDataByInternalId(centroid_idx);
+        std::vector<float> decoded_centroid(d), decoded_neighbor(d);
+        const float *centroid = quantizer->getVector(centroid_idx, decoded_centroid.data());
         std::priority_queue<std::pair<float, idx_t>> nn_centroids_raw = quantizer->searchKnn(centroid, nsubc + 1);
 
         std::vector<float> centroid_vector_norms_L2sqr(nsubc);
-        nn_centroid_idxs[centroid_idx].resize(nsubc);
+        idx_t *nn_centroids = nn_centroid_idxs.mutable_data() + centroid_idx * nsubc;
         while (nn_centroids_raw.size() > 1) {
             centroid_vector_norms_L2sqr[nn_centroids_raw.size() - 2] = nn_centroids_raw.top().first;
-            nn_centroid_idxs[centroid_idx][nn_centroids_raw.size() - 2] = nn_centroids_raw.top().second;
+            nn_centroids[nn_centroids_raw.size() - 2] = nn_centroids_raw.top().second;
             nn_centroids_raw.pop();
         }
         if (group_size == 0)
             return;
 
         const float *centroid_vector_norms = centroid_vector_norms_L2sqr.data();
-        const idx_t *nn_centroids = nn_centroid_idxs[centroid_idx].data();
 
         // Compute centroid-neighbor_centroid and centroid-group_point vectors
         std::vector<float> centroid_vectors(nsubc * d);
         for (size_t subc = 0; subc < nsubc; subc++) {
-            const float *neighbor_centroid = quantizer->getDataByInternalId(nn_centroids[subc]);
+            const float *neighbor_centroid = quantizer->getVector(nn_centroids[subc], decoded_neighbor.data());
             faiss::fvec_madd(d, neighbor_centroid, -1., centroid, centroid_vectors.data() + subc * d);
         }
+        // The quantizer returns the negative inner products, the L2 distances are needed here
+        if (metric != METRIC_L2)
+            faiss::fvec_norms_L2sqr(centroid_vector_norms_L2sqr.data(), centroid_vectors.data(), d, nsubc);
 
         // Compute alpha for group vectors
-        alphas[centroid_idx] = compute_alpha(centroid_vectors.data(), data, centroid,
-                                             centroid_vector_norms, group_size);
+        const float alpha = compute_alpha(centroid_vectors.data(), data, centroid,
+                                          centroid_vector_norms, group_size);
+        alphas.mutable_data()[centroid_idx] = alpha;
 
         // Compute final subcentroids
         std::vector<float> subcentroids(nsubc * d);
         for (size_t subc = 0; subc < nsubc; subc++) {
             const float *centroid_vector = centroid_vectors.data() + subc * d;
             float *subcentroid = subcentroids.data() + subc * d;
-            faiss::fvec_madd(d, centroid, alphas[centroid_idx], centroid_vector, subcentroid);
+            faiss::fvec_madd(d, centroid, alpha, centroid_vector, subcentroid);
         }
 
         // Find subcentroid idx
@@ -73,7 +97,7 @@ namespace ivfhnsw
         }
 
         // Compute codes
-        std::vector<uint8_t> xcodes(group_size * code_size);
+        std::vector<uint8_t> xcodes(group_size * pq->code_size);
         pq->compute_codes(residuals.data(), xcodes.data(), group_size);
 
         // Decode codes
@@ -92,13 +116,19 @@ namespace ivfhnsw
         reconstruct(group_size, reconstructed_x.data(), decoded_residuals.data(),
                     subcentroids.data(), subcentroid_idxs.data());
 
-        // Compute norms 
-        std::vector<float> norms(group_size);
-        faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, group_size);
+        // Distance between the farthest reconstructed vector and the centroid bounds the group for range_search
+        float max_residual_norm = 0;
+        for (size_t i = 0; i < group_size; i++)
+            max_residual_norm = std::max(max_residual_norm, fvec_L2sqr(reconstructed_x.data() + i * d, centroid, d));
+        max_residual_norms.mutable_data()[centroid_idx] = std::sqrt(max_residual_norm);
 
-        // Compute norm codes
+        // Compute norms and norm codes, the inner product does not use them
         std::vector<uint8_t> xnorm_codes(group_size);
-        norm_pq->compute_codes(norms.data(), xnorm_codes.data(), group_size);
+        if (metric == METRIC_L2) {
+            std::vector<float> norms(group_size);
+            faiss::fvec_norms_L2sqr(norms.data(), reconstructed_x.data(), d, group_size);
+            norm_pq->compute_codes(norms.data(), xnorm_codes.data(), group_size);
+        }
 
         // Distribute codes
         std::vector<std::vector<idx_t> > construction_ids(nsubc);
@@ -110,19 +140,23 @@ namespace ivfhnsw
 
             construction_ids[subcentroid_idx].push_back(idx);
             construction_norm_codes[subcentroid_idx].push_back(xnorm_codes[i]);
-            for (size_t j = 0; j < code_size; j++)
-                construction_codes[subcentroid_idx].push_back(xcodes[i * code_size + j]);
+            for (size_t j = 0; j < pq->code_size; j++)
+                construction_codes[subcentroid_idx].push_back(xcodes[i * pq->code_size + j]);
         }
         // Add codes to the index
+        std::vector<idx_t> &list_ids = invlists->ids[centroid_idx];
+        std::vector<uint8_t> &list_codes = invlists->codes[centroid_idx];
+        std::vector<uint8_t> &list_norm_codes = invlists->norm_codes[centroid_idx];
+        idx_t *group_subgroup_sizes = invlists->subgroup_sizes.mutable_data() + centroid_idx * nsubc;
         for (size_t subc = 0; subc < nsubc; subc++) {
-            idx_t subgroup_size = construction_norm_codes[subc].size();
-            subgroup_sizes[centroid_idx].push_back(subgroup_size);
+            idx_t subgroup_size = construction_ids[subc].size();
+            group_subgroup_sizes[subc] = subgroup_size;
 
             for (size_t i = 0; i < subgroup_size; i++) {
-                ids[centroid_idx].push_back(construction_ids[subc][i]);
-                for (size_t j = 0; j < code_size; j++)
-                    codes[centroid_idx].push_back(construction_codes[subc][i * code_size + j]);
-                norm_codes[centroid_idx].push_back(construction_norm_codes[subc][i]);
+                append_code(list_codes, list_ids.size(), construction_codes[subc].data() + i * pq->code_size);
+                list_ids.push_back(construction_ids[subc][i]);
+                if (metric == METRIC_L2)
+                    list_norm_codes.push_back(construction_norm_codes[subc][i]);
             }
         }
     }
@@ -156,21 +190,40 @@ namespace ivfhnsw
       * Since y_R defined by a product quantizer, it is split across
       * sub-vectors and stored separately for each sub-vector.
     */
-    void IndexIVF_HNSW_Grouping::search(size_t k, const float *x, float *distances, long *labels)
+    void IndexIVF_HNSW_Grouping::search_rotated(size_t k, const float *query, const float *precomputed_table,
+                                                float *distances, long *labels, SearchContext &ctx,
+                                                const IdSelector *sel) const
     {
+        // Distances to the coarse centroids. Used for distance computation between a query and base points.
+        // dist_not_computed entries mean that the distance has not been computed yet
+        if (ctx.query_centroid_dists.size() != nc)
+            ctx.query_centroid_dists.assign(nc, dist_not_computed);
+        float *query_centroid_dists = ctx.query_centroid_dists.data();
+
         // Distances to subcentroids. Used for pruning.
-        std::vector<float> query_subcentroid_dists;
+        std::vector<float> &query_subcentroid_dists = ctx.query_subcentroid_dists;
+
+        // Snapshot of the lists, which stay alive even if compact() replaces them during the query
+        const std::shared_ptr<InvertedLists> lists = std::atomic_load(&invlists);
+        const MaybeOwnedVector<idx_t> &subgroup_sizes = lists->subgroup_sizes;
+        const bool check_deleted = deleted.count() > 0;
+        const bool inner_product = (metric != METRIC_L2);
 
         // Indices of coarse centroids, which distances to the query are computed during the search time
-        std::vector<idx_t> used_centroid_idxs;
+        std::vector<idx_t> &used_centroid_idxs = ctx.used_centroid_idxs;
+        used_centroid_idxs.clear();
         used_centroid_idxs.reserve(nsubc * nprobe);
-        idx_t centroid_idxs[nprobe]; // Indices of the nearest coarse centroids
+        ctx.decoded_centroid.resize(d);
+
+        ctx.centroid_idxs.resize(nprobe); // Indices of the nearest coarse centroids
+        idx_t *centroid_idxs = ctx.centroid_idxs.data();
 
-        // For correct search using OPQ rotate a query
-        const float *query = (do_opq) ? opq_matrix->apply(1, x) : x;
+        QueryStats *query_stats = this->query_stats(ctx);
+        hnswlib::SearchCounters hnsw_counters;
+        uint64_t t = query_stats ? stats_ticks() : 0;
 
         // Find the nearest coarse centroids to the query
-        auto coarse = quantizer->searchKnn(query, nprobe);
+        auto coarse = quantizer->searchKnn(query, nprobe, query_stats ? &hnsw_counters : nullptr);
         for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
             idx_t centroid_idx = coarse.top().second;
             centroid_idxs[i] = centroid_idx;
@@ -189,7 +242,7 @@ namespace ivfhnsw
 
             for (size_t i = 0; i < nprobe; i++) {
                 const idx_t centroid_idx = centroid_idxs[i];
-                const size_t group_size = norm_codes[centroid_idx].size();
+                const size_t group_size = lists->list_size(centroid_idx);
                 if (group_size == 0)
                     continue;
 
@@ -197,18 +250,22 @@ namespace ivfhnsw
                 const float term1 = (1 - alpha) * query_centroid_dists[centroid_idx];
 
                 for (size_t subc = 0; subc < nsubc; subc++) {
-                    if (subgroup_sizes[centroid_idx][subc] == 0)
+                    if (subgroup_sizes[centroid_idx * nsubc + subc] == 0)
                         continue;
 
-                    const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
+                    const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx * nsubc + subc];
                     // Compute the distance to the coarse centroid if it is not computed
-                    if (query_centroid_dists[nn_centroid_idx] < EPS) {
-                        const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idx);
-                        query_centroid_dists[nn_centroid_idx] = fvec_L2sqr(query, nn_centroid, d);
+                    if (query_centroid_dists[nn_centroid_idx] == dist_not_computed) {
+                        const float *nn_centroid = quantizer->getVector(nn_centroid_idx, ctx.decoded_centroid.data());
+                        query_centroid_dists[nn_centroid_idx] = centroid_dist(query, nn_centroid);
                         used_centroid_idxs.push_back(nn_centroid_idx);
                     }
-                    qsd[subc] = term1 - alpha * ((1 - alpha) * inter_centroid_dists[centroid_idx][subc]
-                                                 - query_centroid_dists[nn_centroid_idx]);
+                    // With the inner product the distance to the sub-centroid is linear in alpha
+                    if (inner_product)
+                        qsd[subc] = term1 + alpha * query_centroid_dists[nn_centroid_idx];
+                    else
+                        qsd[subc] = term1 - alpha * ((1 - alpha) * inter_centroid_dists[centroid_idx * nsubc + subc]
+                                                     - query_centroid_dists[nn_centroid_idx]);
                     threshold += qsd[subc];
                     nsubgroups++;
                 }
@@ -219,157 +276,334 @@ namespace ivfhnsw
             }
             threshold /= nsubgroups;
         }
+        if (query_stats) {
+            t = query_stats->lap(STAGE_COARSE, t);
+            query_stats->counters[COUNTER_HNSW_HOPS] += hnsw_counters.hops;
+            query_stats->counters[COUNTER_HNSW_DIST_CALCS] += hnsw_counters.dist_calcs;
+        }
 
-        // Precompute table
-        pq->compute_inner_prod_table(query, precomputed_table.data());
+        quantize_table(precomputed_table, ctx);
+        if (query_stats)
+            t = query_stats->lap(STAGE_TABLE, t);
 
         // Prepare max heap with k answers
         faiss::maxheap_heapify(k, distances, labels);
 
         size_t ncode = 0;
+        size_t nlists = 0;
+        size_t ninserted = 0;
+        size_t npruned = 0;
         const float *qsd = query_subcentroid_dists.data();
 
         for (size_t i = 0; i < nprobe; i++) {
             const idx_t centroid_idx = centroid_idxs[i];
-            const size_t group_size = norm_codes[centroid_idx].size();
+            const size_t group_size = lists->list_size(centroid_idx);
             if (group_size == 0)
                 continue;
 
             const float alpha = alphas[centroid_idx];
-            const float term1 = (1 - alpha) * (query_centroid_dists[centroid_idx] - centroid_norms[centroid_idx]);
+            const float term1 = inner_product ? (1 - alpha) * query_centroid_dists[centroid_idx]
+                                              : (1 - alpha) * (query_centroid_dists[centroid_idx] - centroid_norms[centroid_idx]);
 
-            const uint8_t *code = codes[centroid_idx].data();
-            const uint8_t *norm_code = norm_codes[centroid_idx].data();
-            const idx_t *id = ids[centroid_idx].data();
+            const uint8_t *code = lists->get_codes(centroid_idx);
+            const uint8_t *norm_code = lists->get_norm_codes(centroid_idx);
+            const idx_t *id = lists->get_ids(centroid_idx);
+            size_t offset = 0; // Position of the current subgroup in the group
 
             for (size_t subc = 0; subc < nsubc; subc++) {
-                const size_t subgroup_size = subgroup_sizes[centroid_idx][subc];
+                const size_t subgroup_size = subgroup_sizes[centroid_idx * nsubc + subc];
                 if (subgroup_size == 0)
                     continue;
 
                 // Check pruning condition
                 if (!do_pruning || qsd[subc] < threshold) {
-                    const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx][subc];
-
-                    // Compute the distance to the coarse centroid if it is not computed
-                    if (query_centroid_dists[nn_centroid_idx] < EPS) {
-                        const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idx);
-                        query_centroid_dists[nn_centroid_idx] = fvec_L2sqr(query, nn_centroid, d);
-                        used_centroid_idxs.push_back(nn_centroid_idx);
+                    if (ctx.norms.size() < subgroup_size)
+                        ctx.norms.resize(subgroup_size);
+                    if (ctx.code_dists.size() < subgroup_size)
+                        ctx.code_dists.resize(subgroup_size);
+                    float *norms = ctx.norms.data();
+                    float *code_dists = ctx.code_dists.data();
+
+                    size_t nselected = subgroup_size;
+                    if (sel) {
+                        // Compute term 4 only for the codes of the selected ids
+                        nselected = scan_selected_codes(code, offset, subgroup_size, id, sel, precomputed_table,
+                                                        code_dists, ctx);
+                    }
+                    else {
+                        // Compute term 4 for the whole subgroup at once
+                        scan_codes(code, offset, subgroup_size, precomputed_table, code_dists, ctx);
                     }
 
-                    const float term2 = alpha * (query_centroid_dists[nn_centroid_idx] - centroid_norms[nn_centroid_idx]);
-                    norm_pq->decode(norm_code, norms.data(), subgroup_size);
+                    if (nselected > 0) {
+                        const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx * nsubc + subc];
+
+                        // Compute the distance to the coarse centroid if it is not computed
+                        if (query_centroid_dists[nn_centroid_idx] == dist_not_computed) {
+                            const float *nn_centroid = quantizer->getVector(nn_centroid_idx, ctx.decoded_centroid.data());
+                            query_centroid_dists[nn_centroid_idx] = centroid_dist(query, nn_centroid);
+                            used_centroid_idxs.push_back(nn_centroid_idx);
+                        }
 
-                    for (size_t j = 0; j < subgroup_size; j++) {
-                        const float term4 = 2 * pq_L2sqr(code + j * code_size);
-                        const float dist = term1 + term2 + norms[j] - term4; //term3 = norms[j]
-                        if (dist < distances[0]) {
-                            faiss::maxheap_pop(k, distances, labels);
-                            faiss::maxheap_push(k, distances, labels, dist, id[j]);
+                        const float term2 = inner_product ? alpha * query_centroid_dists[nn_centroid_idx]
+                                                          : alpha * (query_centroid_dists[nn_centroid_idx] - centroid_norms[nn_centroid_idx]);
+                        if (query_stats)
+                            t = query_stats->lap(STAGE_SCAN, t);
+                        if (!inner_product)
+                            norm_pq->decode(norm_code, norms, subgroup_size);
+                        if (query_stats)
+                            t = query_stats->lap(STAGE_NORMS, t);
+
+                        for (size_t s = 0; s < nselected; s++) {
+                            const size_t j = sel ? ctx.selected[s] : s;
+                            const float dist = inner_product ? term1 + term2 - code_dists[j]
+                                                             : term1 + term2 + norms[j] - 2 * code_dists[j]; //term3 = norms[j]
+                            if (dist < distances[0]) {
+                                if (check_deleted && deleted.contains(id[j]))
+                                    continue;
+                                faiss::maxheap_pop(k, distances, labels);
+                                faiss::maxheap_push(k, distances, labels, dist, id[j]);
+                                ninserted++;
+                            }
                         }
+                        ncode += nselected;
                     }
-                    ncode += subgroup_size;
+                }
+                else {
+                    npruned++;
                 }
                 // Shift to the next group
-                code += subgroup_size * code_size;
+                offset += subgroup_size;
                 norm_code += subgroup_size;
                 id += subgroup_size;
             }
+            if (query_stats)
+                t = query_stats->lap(STAGE_SCAN, t);
+            nlists++;
             if (ncode >= max_codes)
                 break;
             if (do_pruning)
                 qsd += nsubc;
         }
-        // Zero computed dists for later queries
+        // Reset computed dists to dist_not_computed for later queries
         for (idx_t used_centroid_idx : used_centroid_idxs)
-            query_centroid_dists[used_centroid_idx] = 0;
+            query_centroid_dists[used_centroid_idx] = dist_not_computed;
 
-        if (do_opq)
-            delete const_cast<float *>(query);
+        if (query_stats) {
+            query_stats->counters[COUNTER_LISTS_PROBED] += nlists;
+            query_stats->counters[COUNTER_CODES_SCANNED] += ncode;
+            query_stats->counters[COUNTER_HEAP_INSERTIONS] += ninserted;
+            query_stats->counters[COUNTER_PRUNED_SUBGROUPS] += npruned;
+        }
     }
 
-    void IndexIVF_HNSW_Grouping::write(const char *path_index)
+    /**
+     * The sub-groups are not pruned, since the pruning may lose the vectors within the radius.
+     * Instead the whole groups are skipped by the bound of their reconstructed vectors.
+     */
+    void IndexIVF_HNSW_Grouping::range_search_rotated(const float *query, const float *precomputed_table, float radius,
+                                                      std::vector<float> &distances, std::vector<long> &labels,
+                                                      SearchContext &ctx, const IdSelector *sel) const
     {
-        std::ofstream output(path_index, std::ios::binary);
+        // Distances to the coarse centroids, dist_not_computed entries mean that the distance has not been computed yet
+        if (ctx.query_centroid_dists.size() != nc)
+            ctx.query_centroid_dists.assign(nc, dist_not_computed);
+        float *query_centroid_dists = ctx.query_centroid_dists.data();
+
+        // Snapshot of the lists, which stay alive even if compact() replaces them during the query
+        const std::shared_ptr<InvertedLists> lists = std::atomic_load(&invlists);
+        const MaybeOwnedVector<idx_t> &subgroup_sizes = lists->subgroup_sizes;
+        const bool check_deleted = deleted.count() > 0;
+        const bool inner_product = (metric != METRIC_L2);
+
+        std::vector<idx_t> &used_centroid_idxs = ctx.used_centroid_idxs;
+        used_centroid_idxs.clear();
+        ctx.decoded_centroid.resize(d);
+
+        ctx.centroid_idxs.resize(nprobe);
+        idx_t *centroid_idxs = ctx.centroid_idxs.data();
+
+        // Find the nearest coarse centroids to the query
+        auto coarse = quantizer->searchKnn(query, nprobe);
+        for (int_fast32_t i = nprobe - 1; i >= 0; i--) {
+            idx_t centroid_idx = coarse.top().second;
+            centroid_idxs[i] = centroid_idx;
+            query_centroid_dists[centroid_idx] = coarse.top().first;
+            used_centroid_idxs.push_back(centroid_idx);
+            coarse.pop();
+        }
+        compute_probe_bounds(centroid_idxs, ctx);
+        quantize_table(precomputed_table, ctx);
+        const float query_norm = inner_product ? std::sqrt(faiss::fvec_norm_L2sqr(query, d)) : 0;
+
+        for (size_t i = 0; i < nprobe; i++) {
+            const idx_t centroid_idx = centroid_idxs[i];
+            const float dist_to_centroid = query_centroid_dists[centroid_idx];
+            // No remaining group has vectors within the radius
+            if (list_dist_bound(dist_to_centroid, ctx.probe_bounds[i], query_norm) >= radius)
+                break;
+
+            const size_t group_size = lists->list_size(centroid_idx);
+            if (group_size == 0 || list_dist_bound(dist_to_centroid, max_residual_norms[centroid_idx], query_norm) >= radius)
+                continue;
+
+            const float alpha = alphas[centroid_idx];
+            const float term1 = inner_product ? (1 - alpha) * query_centroid_dists[centroid_idx]
+                                              : (1 - alpha) * (query_centroid_dists[centroid_idx] - centroid_norms[centroid_idx]);
+
+            const uint8_t *code = lists->get_codes(centroid_idx);
+            const uint8_t *norm_code = lists->get_norm_codes(centroid_idx);
+            const idx_t *id = lists->get_ids(centroid_idx);
+            size_t offset = 0; // Position of the current subgroup in the group
+
+            for (size_t subc = 0; subc < nsubc; subc++) {
+                const size_t subgroup_size = subgroup_sizes[centroid_idx * nsubc + subc];
+                if (subgroup_size == 0)
+                    continue;
+
+                if (ctx.norms.size() < subgroup_size)
+                    ctx.norms.resize(subgroup_size);
+                if (ctx.code_dists.size() < subgroup_size)
+                    ctx.code_dists.resize(subgroup_size);
+                float *norms = ctx.norms.data();
+                float *code_dists = ctx.code_dists.data();
+
+                size_t nselected = subgroup_size;
+                if (sel)
+                    nselected = scan_selected_codes(code, offset, subgroup_size, id, sel, precomputed_table,
+                                                    code_dists, ctx);
+                else
+                    scan_codes(code, offset, subgroup_size, precomputed_table, code_dists, ctx);
+
+                if (nselected > 0) {
+                    const idx_t nn_centroid_idx = nn_centroid_idxs[centroid_idx * nsubc + subc];
 
-        write_variable(output, d);
-        write_variable(output, nc);
-        write_variable(output, nsubc);
+                    // Compute the distance to the coarse centroid if it is not computed
+                    if (query_centroid_dists[nn_centroid_idx] == dist_not_computed) {
+                        const float *nn_centroid = quantizer->getVector(nn_centroid_idx, ctx.decoded_centroid.data());
+                        query_centroid_dists[nn_centroid_idx] = centroid_dist(query, nn_centroid);
+                        used_centroid_idxs.push_back(nn_centroid_idx);
+                    }
 
-        // Save vector indices
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, ids[i]);
+                    const float term2 = inner_product ? alpha * query_centroid_dists[nn_centroid_idx]
+                                                      : alpha * (query_centroid_dists[nn_centroid_idx] - centroid_norms[nn_centroid_idx]);
+                    if (!inner_product)
+                        norm_pq->decode(norm_code, norms, subgroup_size);
+
+                    for (size_t s = 0; s < nselected; s++) {
+                        const size_t j = sel ? ctx.selected[s] : s;
+                        const float dist = inner_product ? term1 + term2 - code_dists[j]
+                                                         : term1 + term2 + norms[j] - 2 * code_dists[j];
+                        if (dist < radius) {
+                            if (check_deleted && deleted.contains(id[j]))
+                                continue;
+                            distances.push_back(dist);
+                            labels.push_back(id[j]);
+                        }
+                    }
+                }
+                // Shift to the next group
+                offset += subgroup_size;
+                norm_code += subgroup_size;
+                id += subgroup_size;
+            }
+        }
+        // Reset computed dists to dist_not_computed for later queries
+        for (idx_t used_centroid_idx : used_centroid_idxs)
+            query_centroid_dists[used_centroid_idx] = dist_not_computed;
+    }
 
-        // Save PQ codes
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, codes[i]);
+    IndexFileHeader IndexIVF_HNSW_Grouping::file_header() const
+    {
+        IndexFileHeader header = IndexIVF_HNSW::file_header();
+        header.index_type = INDEX_IVF_HNSW_GROUPING;
+        header.nsubc = nsubc;
+        return header;
+    }
 
-        // Save norm PQ codes
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, norm_codes[i]);
+    void IndexIVF_HNSW_Grouping::write_sections(IndexFileWriter &writer) const
+    {
+        // Save vector indices, PQ codes, norm PQ codes and centroid norms
+        IndexIVF_HNSW::write_sections(writer);
 
         // Save NN centroid indices
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, nn_centroid_idxs[i]);
+        writer.write_section(SECTION_NN_CENTROID_IDXS, nn_centroid_idxs.data(), nc * nsubc);
 
-        // Write group sizes
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, subgroup_sizes[i]);
+        // Save group sizes
+        writer.write_section(SECTION_SUBGROUP_SIZES, invlists->subgroup_sizes.data(), nc * nsubc);
 
         // Save alphas
-        write_vector(output, alphas);
-
-        // Save centroid norms
-        write_vector(output, centroid_norms);
+        writer.write_section(SECTION_ALPHAS, alphas.data(), nc);
 
         // Save inter centroid distances
-        for (size_t i = 0; i < nc; i++)
-            write_vector(output, inter_centroid_dists[i]);
+        writer.write_section(SECTION_INTER_CENTROID_DISTS, inter_centroid_dists.data(), nc * nsubc);
     }
 
-    void IndexIVF_HNSW_Grouping::read(const char *path_index)
+    void IndexIVF_HNSW_Grouping::read_sections(IndexFileReader &reader)
     {
-        std::ifstream input(path_index, std::ios::binary);
+        // Read vector indices, PQ codes, norm PQ codes and centroid norms
+        IndexIVF_HNSW::read_sections(reader);
 
+        // Read NN centroid indices
+        reader.read_section(SECTION_NN_CENTROID_IDXS, nn_centroid_idxs, nc * nsubc);
+
+        // Read group sizes
+        reader.read_section(SECTION_SUBGROUP_SIZES, invlists->subgroup_sizes, nc * nsubc);
+
+        // Read alphas
+        reader.read_section(SECTION_ALPHAS, alphas, nc);
+
+        // Read inter centroid distances
+        reader.read_section(SECTION_INTER_CENTROID_DISTS, inter_centroid_dists, nc * nsubc);
+    }
+
+    /// Read nc vectors of at most nsubc elements into the flat array, missing elements are zero
+    template<typename T>
+    static void read_group_vectors(std::istream &input, size_t nc, size_t nsubc, MaybeOwnedVector<T> &vec)
+    {
+        vec.resize(nc * nsubc);
+        T *data = vec.mutable_data();
+        std::vector<T> group;
+        for (size_t i = 0; i < nc; i++) {
+            read_vector(input, group);
+            group.resize(nsubc);
+            std::copy(group.begin(), group.end(), data + i * nsubc);
+        }
+    }
+
+    void IndexIVF_HNSW_Grouping::read_legacy(std::istream &input)
+    {
         read_variable(input, d);
         read_variable(input, nc);
         read_variable(input, nsubc);
 
-        // Read ids
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, ids[i]);
-
-        // Read PQ codes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, codes[i]);
-
-        // Read norm PQ codes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, norm_codes[i]);
+        // Read ids, PQ codes and norm PQ codes into the packed lists
+        invlists->read_legacy(input);
 
         // Read NN centroid indices
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, nn_centroid_idxs[i]);
+        read_group_vectors(input, nc, nsubc, nn_centroid_idxs);
 
         // Read group sizes
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, subgroup_sizes[i]);
+        read_group_vectors(input, nc, nsubc, invlists->subgroup_sizes);
 
         // Read alphas
-        read_vector(input, alphas);
+        std::vector<float> data;
+        read_vector(input, data);
+        alphas.assign(data.data(), data.data() + data.size());
 
         // Read centroid norms
-        read_vector(input, centroid_norms);
+        read_vector(input, data);
+        centroid_norms.assign(data.data(), data.data() + data.size());
 
         // Read inter centroid distances
-        for (size_t i = 0; i < nc; i++)
-            read_vector(input, inter_centroid_dists[i]);
+        read_group_vectors(input, nc, nsubc, inter_centroid_dists);
     }
 
-
     void IndexIVF_HNSW_Grouping::train_pq(size_t n, const float *x)
     {
+        std::vector<float> normalized_x;
+        x = normalize_vectors(n, x, normalized_x);
+
         std::vector<float> train_subcentroids;
         std::vector<float> train_residuals;
 
@@ -389,9 +623,10 @@ namespace ivfhnsw
 
         // Train Residual PQ
         std::cout << "Training Residual PQ codebook " << std::endl;
+        std::vector<float> decoded_centroid(d), decoded_neighbor(d);
         for (auto group : group_map) {
             const idx_t centroid_idx = group.first;
-            const float *centroid = quantizer->getDataByInternalId(centroid_idx);
+            const float *centroid = quantizer->getVector(centroid_idx, decoded_centroid.data());
             const std::vector<float> data = group.second;
             const int group_size = data.size() / d;
 
@@ -408,9 +643,11 @@ namespace ivfhnsw
             // Compute centroid-neighbor_centroid and centroid-group_point vectors
             std::vector<float> centroid_vectors(nsubc * d);
             for (size_t subc = 0; subc < nsubc; subc++) {
-                const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idxs[subc]);
+                const float *nn_centroid = quantizer->getVector(nn_centroid_idxs[subc], decoded_neighbor.data());
                 faiss::fvec_madd(d, nn_centroid, -1., centroid, centroid_vectors.data() + subc * d);
             }
+            if (metric != METRIC_L2)
+                faiss::fvec_norms_L2sqr(centroid_vector_norms.data(), centroid_vectors.data(), d, nsubc);
 
             // Find alphas for vectors
             const float alpha = compute_alpha(centroid_vectors.data(), data.data(), centroid,
@@ -457,6 +694,10 @@ namespace ivfhnsw
         pq->verbose = true;
         pq->train(n, train_residuals.data());
 
+        // The inner product does not use the norm PQ
+        if (metric != METRIC_L2)
+            return;
+
         // Norm PQ
         std::cout << "Training Norm PQ codebook " << std::endl;
         std::vector<float> train_norms;
@@ -468,7 +709,7 @@ namespace ivfhnsw
             const size_t group_size = data.size() / d;
 
             // Compute Codes 
-            std::vector<uint8_t> xcodes(group_size * code_size);
+            std::vector<uint8_t> xcodes(group_size * pq->code_size);
             pq->compute_codes(residuals, xcodes.data(), group_size);
 
             // Decode Codes 
@@ -504,17 +745,25 @@ namespace ivfhnsw
 
     void IndexIVF_HNSW_Grouping::compute_inter_centroid_dists()
     {
+        inter_centroid_dists.resize(nc * nsubc);
+        float *dists = inter_centroid_dists.mutable_data();
+        std::vector<float> decoded_centroid(d), decoded_neighbor(d);
         for (size_t i = 0; i < nc; i++) {
-            const float *centroid = quantizer->getDataByInternalId(i);
-            inter_centroid_dists[i].resize(nsubc);
+            const float *centroid = quantizer->getVector(i, decoded_centroid.data());
             for (size_t subc = 0; subc < nsubc; subc++) {
-                const idx_t nn_centroid_idx = nn_centroid_idxs[i][subc];
-                const float *nn_centroid = quantizer->getDataByInternalId(nn_centroid_idx);
-                inter_centroid_dists[i][subc] = fvec_L2sqr(nn_centroid, centroid, d);
+                const idx_t nn_centroid_idx = nn_centroid_idxs[i * nsubc + subc];
+                const float *nn_centroid = quantizer->getVector(nn_centroid_idx, decoded_neighbor.data());
+                dists[i * nsubc + subc] = fvec_L2sqr(nn_centroid, centroid, d);
             }
         }
     }
 
+    void IndexIVF_HNSW_Grouping::set_search_params(const SearchParams &params)
+    {
+        IndexIVF_HNSW::set_search_params(params);
+        do_pruning = params.do_pruning;
+    }
+
     void IndexIVF_HNSW_Grouping::compute_residuals(size_t n, const float *x, float *residuals,
                                                    const float *subcentroids, const idx_t *keys)
     {
@@ -12,15 +12,18 @@ namespace ivfhnsw{
         size_t nsubc;         ///< Number of sub-centroids per group
         bool do_pruning;      ///< Turn on/off pruning
 
-        std::vector<std::vector<idx_t> > nn_centroid_idxs;    ///< Indices of the <nsubc> nearest centroids for each centroid
-        std::vector<std::vector<idx_t> > subgroup_sizes;      ///< Sizes of sub-groups for each group
-        std::vector<float> alphas;    ///< Coefficients that determine the location of sub-centroids
+        MaybeOwnedVector<idx_t> nn_centroid_idxs;    ///< Indices of the <nsubc> nearest centroids for each centroid, size nc * nsubc
+        // Sizes of sub-groups for each group are stored along with the lists in invlists->subgroup_sizes
+        MaybeOwnedVector<float> alphas;              ///< Coefficients that determine the location of sub-centroids
 
     public:
+        /// @param metric_type   L2 or cosine, the plain inner product is not supported
         IndexIVF_HNSW_Grouping(size_t dim, size_t ncentroids, size_t bytes_per_code,
-                               size_t nbits_per_idx, size_t nsubcentroids);
+                               size_t nbits_per_idx, size_t nsubcentroids, MetricType metric_type = METRIC_L2);
 
         /** Add <group_size> vectors of dimension <d> from the <group_idx>-th group to the index.
+          *
+          * Groups may be added concurrently, hence the lists must not be packed by finalize() yet.
           *
           * @param group_idx         index of the group
           * @param group_size        number of base vectors in the group
@@ -29,35 +32,51 @@ namespace ivfhnsw{
         */
         void add_group(size_t group_idx, size_t group_size, const float *x, const idx_t *ids);
 
-        void search(size_t k, const float *x, float *distances, long *labels);
-
-        void write(const char *path_index);
-        void read(const char *path_index);
+        /** Add a group of vectors of the given type, the group is converted to floats by the calling thread
+          *
+          * @param x                 base vectors to add, size group_size * d elements of the type
+          * @param type              element type of x: float, uint8, int8 or fp16
+        */
+        void add_group(size_t group_idx, size_t group_size, const void *x, VectorType type, const idx_t *ids);
 
         void train_pq(size_t n, const float *x);
 
         /// Compute distances between the group centroid and its <subc> nearest neighbors in the HNSW graph
         void compute_inter_centroid_dists();
 
+        /// Also sets do_pruning
+        void set_search_params(const SearchParams &params);
+
     protected:
-        /// Distances to the coarse centroids. Used for distance computation between a query and base points
-        std::vector<float> query_centroid_dists;
+        IndexFileHeader file_header() const;
+        void write_sections(IndexFileWriter &writer) const;
+        void read_sections(IndexFileReader &reader);
+        void read_legacy(std::istream &input);
 
-        /// Distances between coarse centroids and their sub-centroids
-        std::vector<std::vector<float>> inter_centroid_dists;
+        void search_rotated(size_t k, const float *query, const float *precomputed_table,
+                            float *distances, long *labels, SearchContext &ctx, const IdSelector *sel) const;
 
-    private:
-        void compute_residuals(size_t n, const float *x, float *residuals,
-                               const float *subcentroids, const idx_t *keys);
+        void range_search_rotated(const float *query, const float *precomputed_table, float radius,
+                                  std::vector<float> &distances, std::vector<long> &labels,
+                                  SearchContext &ctx, const IdSelector *sel) const;
 
-        void reconstruct(size_t n, float *x, const float *decoded_residuals,
-                         const float *subcentroids, const idx_t *keys);
+        /// Distances between coarse centroids and their sub-centroids, size nc * nsubc
+        MaybeOwnedVector<float> inter_centroid_dists;
 
+        /// Index of the nearest of the nsubc sub-centroids for each of group_size points
         void compute_subcentroid_idxs(idx_t *subcentroid_idxs, const float *subcentroids,
                                       const float *points, size_t group_size);
 
+        /// Position of the sub-centroids on the vectors from the centroid to its neighbors, which fits the group best
         float compute_alpha(const float *centroid_vectors, const float *points,
                             const float *centroid, const float *centroid_vector_norms_L2sqr, size_t group_size);
+
+    private:
+        void compute_residuals(size_t n, const float *x, float *residuals,
+                               const float *subcentroids, const idx_t *keys);
+
+        void reconstruct(size_t n, float *x, const float *decoded_residuals,
+                         const float *subcentroids, const idx_t *keys);
     };
 }
 #endif //IVF_HNSW_LIB_INDEXIVF_HNSW_GROUPING_H
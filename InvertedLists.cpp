@@ -0,0 +1,184 @@
+#include "InvertedLists.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace ivfhnsw {
+
+    InvertedLists::InvertedLists(size_t nlist, size_t nsubgroups, bool has_norm_codes):
+            nlist(nlist), nsubgroups(nsubgroups), packed(false), has_norm_codes(has_norm_codes)
+    {
+        subgroup_sizes.resize(nlist * nsubgroups);
+        ids.resize(nlist);
+        codes.resize(nlist);
+        norm_codes.resize(nlist);
+    }
+
+    InvertedLists::~InvertedLists()
+    {
+        if (on_release)
+            on_release();
+    }
+
+    size_t InvertedLists::compute_ntotal() const
+    {
+        if (packed)
+            return offsets[nlist];
+
+        size_t ntotal = 0;
+        for (size_t i = 0; i < nlist; i++)
+            ntotal += ids[i].size();
+        return ntotal;
+    }
+
+    void InvertedLists::finalize()
+    {
+        if (packed)
+            return;
+
+        offsets.resize(nlist + 1);
+        code_offsets.resize(nlist + 1);
+        size_t *list_offsets = offsets.mutable_data();
+        size_t *list_code_offsets = code_offsets.mutable_data();
+        list_offsets[0] = list_code_offsets[0] = 0;
+        for (size_t i = 0; i < nlist; i++) {
+            list_offsets[i + 1] = list_offsets[i] + ids[i].size();
+            list_code_offsets[i + 1] = list_code_offsets[i] + codes[i].size();
+        }
+        packed_ids.resize(list_offsets[nlist]);
+        packed_codes.resize(list_code_offsets[nlist]);
+        packed_norm_codes.resize(has_norm_codes ? list_offsets[nlist] : 0);
+
+        // Free each list right after it is copied to keep the peak memory low
+        for (size_t i = 0; i < nlist; i++) {
+            std::copy(ids[i].begin(), ids[i].end(), packed_ids.mutable_data() + list_offsets[i]);
+            std::copy(codes[i].begin(), codes[i].end(), packed_codes.mutable_data() + list_code_offsets[i]);
+            if (has_norm_codes)
+                std::copy(norm_codes[i].begin(), norm_codes[i].end(), packed_norm_codes.mutable_data() + list_offsets[i]);
+
+            std::vector<idx_t>().swap(ids[i]);
+            std::vector<uint8_t>().swap(codes[i]);
+            std::vector<uint8_t>().swap(norm_codes[i]);
+        }
+        packed = true;
+    }
+
+    void InvertedLists::unpack()
+    {
+        if (!packed)
+            return;
+
+        ids.resize(nlist);
+        codes.resize(nlist);
+        norm_codes.resize(nlist);
+        for (size_t i = 0; i < nlist; i++) {
+            ids[i].assign(get_ids(i), get_ids(i) + list_size(i));
+            codes[i].assign(get_codes(i), get_codes(i) + list_codes_size(i));
+            if (has_norm_codes)
+                norm_codes[i].assign(get_norm_codes(i), get_norm_codes(i) + list_size(i));
+        }
+        offsets.clear();
+        code_offsets.clear();
+        packed_ids.clear();
+        packed_codes.clear();
+        packed_norm_codes.clear();
+        packed = false;
+    }
+
+    void InvertedLists::write(IndexFileWriter &writer) const
+    {
+        // Offsets are computed from the list sizes, so the lists are written packed in both layouts
+        std::vector<size_t> list_offsets(nlist + 1, 0);
+        std::vector<size_t> list_code_offsets(nlist + 1, 0);
+        for (size_t i = 0; i < nlist; i++) {
+            list_offsets[i + 1] = list_offsets[i] + list_size(i);
+            list_code_offsets[i + 1] = list_code_offsets[i] + list_codes_size(i);
+        }
+        writer.write_section(SECTION_OFFSETS, list_offsets.data(), nlist + 1);
+        writer.write_section(SECTION_CODE_OFFSETS, list_code_offsets.data(), nlist + 1);
+
+        writer.begin_section(SECTION_IDS, sizeof(idx_t), list_offsets[nlist]);
+        for (size_t i = 0; i < nlist; i++)
+            writer.write(get_ids(i), list_size(i) * sizeof(idx_t));
+        writer.end_section();
+
+        writer.begin_section(SECTION_CODES, sizeof(uint8_t), list_code_offsets[nlist]);
+        for (size_t i = 0; i < nlist; i++)
+            writer.write(get_codes(i), list_codes_size(i));
+        writer.end_section();
+
+        // The section is empty if the norm codes are not stored
+        writer.begin_section(SECTION_NORM_CODES, sizeof(uint8_t), has_norm_codes ? list_offsets[nlist] : 0);
+        for (size_t i = 0; i < nlist && has_norm_codes; i++)
+            writer.write(get_norm_codes(i), list_size(i));
+        writer.end_section();
+    }
+
+    void InvertedLists::read(IndexFileReader &reader)
+    {
+        ids.clear();
+        codes.clear();
+        norm_codes.clear();
+
+        reader.read_section(SECTION_OFFSETS, offsets, nlist + 1);
+        reader.read_section(SECTION_CODE_OFFSETS, code_offsets, nlist + 1);
+        reader.read_section(SECTION_IDS, packed_ids, offsets.back());
+        reader.read_section(SECTION_CODES, packed_codes, code_offsets.back());
+        if (has_norm_codes)
+            reader.read_section(SECTION_NORM_CODES, packed_norm_codes, offsets.back());
+        else {
+            reader.read_section(SECTION_NORM_CODES, packed_norm_codes);
+            if (!packed_norm_codes.empty())
+                throw std::runtime_error("Norm codes are stored for the metric, which does not use them");
+        }
+        packed = true;
+    }
+
+    /** Read nlist vectors of the arbitrary type into one arena
+      *
+      * The first pass collects the sizes, so the arena is allocated only once
+    */
+    template<typename T>
+    static void read_section(std::istream &in, size_t nlist, size_t *offsets, MaybeOwnedVector<T> &arena)
+    {
+        const std::streampos begin = in.tellg();
+        uint32_t size;
+
+        offsets[0] = 0;
+        for (size_t i = 0; i < nlist; i++) {
+            in.read((char *) &size, sizeof(uint32_t));
+            offsets[i + 1] = offsets[i] + size;
+            in.seekg(size * sizeof(T), std::ios::cur);
+        }
+        arena.resize(offsets[nlist]);
+
+        in.seekg(begin);
+        for (size_t i = 0; i < nlist; i++) {
+            in.read((char *) &size, sizeof(uint32_t));
+            in.read((char *) (arena.mutable_data() + offsets[i]), size * sizeof(T));
+        }
+    }
+
+    void InvertedLists::read_legacy(std::istream &in)
+    {
+        ids.clear();
+        codes.clear();
+        norm_codes.clear();
+        offsets.resize(nlist + 1);
+        code_offsets.resize(nlist + 1);
+
+        // Read vector indices
+        read_section(in, nlist, offsets.mutable_data(), packed_ids);
+
+        // Read PQ codes
+        read_section(in, nlist, code_offsets.mutable_data(), packed_codes);
+
+        // Read norm PQ codes
+        std::vector<size_t> norm_offsets(nlist + 1);
+        read_section(in, nlist, norm_offsets.data(), packed_norm_codes);
+        if (!std::equal(norm_offsets.begin(), norm_offsets.end(), offsets.data()))
+            throw std::runtime_error("Sizes of ids and norm codes do not match");
+
+        packed = true;
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef IVF_HNSW_LIB_INVERTEDLISTS_H
+#define IVF_HNSW_LIB_INVERTEDLISTS_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <functional>
+
+#include "IndexFile.h"
+
+namespace ivfhnsw {
+    /** Storage of the inverted lists: vector indices, PQ codes and norm codes
+      *
+      * At construction time each list is a separate std::vector, so appending is cheap.
+      * Once the index is built, finalize() packs all lists into three contiguous arenas
+      * (ids, codes, norm codes) addressed by offset arrays (CSR layout). It removes the
+      * per-list allocations and vector headers, and the list scan reads sequential memory.
+      *
+      * The accessors work in both layouts. Adding vectors to a packed storage
+      * requires unpack() to be called first.
+      *
+      * The arenas of the packed layout may be borrowed from a memory-mapped index file.
+      *
+      * In the grouping index each list is split into <nsubgroups> consecutive subgroups,
+      * their sizes are stored along with the lists, so that both are replaced at once.
+      *
+      * Norm codes are stored only if the distance needs the norms of the vectors (L2), otherwise
+      * norm_codes stay empty and get_norm_codes() returns nullptr.
+    */
+    struct InvertedLists
+    {
+        typedef uint32_t idx_t;
+
+        size_t nlist;       ///< Number of inverted lists
+        size_t nsubgroups;  ///< Number of subgroups per list, 0 if the lists are not split
+        bool packed;        ///< Whether the lists are stored in the contiguous arenas
+        bool has_norm_codes;  ///< Whether a norm code is stored for each vector
+
+        MaybeOwnedVector<idx_t> subgroup_sizes;  ///< Sizes of the subgroups of each list, size nlist * nsubgroups
+
+        //====================
+        // Build-time layout
+        //====================
+        std::vector<std::vector<idx_t> > ids;           ///< Inverted lists for indexes
+        std::vector<std::vector<uint8_t> > codes;       ///< PQ codes of residuals
+        std::vector<std::vector<uint8_t> > norm_codes;  ///< PQ codes of norms of reconstructed base vectors
+
+        //===============
+        // Packed layout
+        //===============
+        MaybeOwnedVector<size_t> offsets;             ///< Position of the first vector of each list in the arenas, size nlist + 1
+        MaybeOwnedVector<size_t> code_offsets;        ///< Position of the first code byte of each list, size nlist + 1
+        MaybeOwnedVector<idx_t> packed_ids;           ///< Ids of all lists
+        MaybeOwnedVector<uint8_t> packed_codes;       ///< Codes of all lists
+        MaybeOwnedVector<uint8_t> packed_norm_codes;  ///< Norm codes of all lists
+
+        /// Run by the destructor, i.e. once the last snapshot of the replaced lists is released
+        std::function<void()> on_release;
+
+        explicit InvertedLists(size_t nlist = 0, size_t nsubgroups = 0, bool has_norm_codes = true);
+        ~InvertedLists();
+
+        /// Number of vectors in the list
+        inline size_t list_size(size_t list_no) const {
+            return packed ? offsets[list_no + 1] - offsets[list_no] : ids[list_no].size();
+        }
+
+        /// Number of code bytes in the list
+        inline size_t list_codes_size(size_t list_no) const {
+            return packed ? code_offsets[list_no + 1] - code_offsets[list_no] : codes[list_no].size();
+        }
+
+        inline const idx_t *get_ids(size_t list_no) const {
+            return packed ? packed_ids.data() + offsets[list_no] : ids[list_no].data();
+        }
+
+        inline const uint8_t *get_codes(size_t list_no) const {
+            return packed ? packed_codes.data() + code_offsets[list_no] : codes[list_no].data();
+        }
+
+        inline const uint8_t *get_norm_codes(size_t list_no) const {
+            if (!has_norm_codes)
+                return nullptr;
+            return packed ? packed_norm_codes.data() + offsets[list_no] : norm_codes[list_no].data();
+        }
+
+        /// Total number of vectors
+        size_t compute_ntotal() const;
+
+        /// Pack the lists into the contiguous arenas and release the per-list vectors
+        void finalize();
+
+        /// Move the lists back to the per-list vectors, so that new vectors can be appended
+        void unpack();
+
+        /// Write the lists in the packed layout, the lists do not have to be finalized
+        void write(IndexFileWriter &writer) const;
+
+        /// Read the packed lists, the arenas are borrowed from the file if the reader maps it
+        void read(IndexFileReader &reader);
+
+        /// Read the lists from the legacy stream format: sections of ids, codes and norm codes,
+        /// each list is stored as a vector. The lists are loaded directly into the packed layout
+        void read_legacy(std::istream &in);
+    };
+}
+#endif //IVF_HNSW_LIB_INVERTEDLISTS_H
@@ -3,6 +3,10 @@
 
 #include <cstring>
 #include <iostream>
+#include <vector>
+
+#include <hnswlib/hnswalg.h>
+#include "utils.h"
 
 //==============
 // Parser Class
@@ -16,6 +20,9 @@ struct Parser
     //=================
     size_t M;               ///< Min number of edges per point
     size_t efConstruction;  ///< Max number of candidate vertices in priority queue to observe during construction
+    bool exact_assign;      ///< Assign base vectors to the exact nearest centroids instead of the HNSW search
+    hnswlib::StorageType quantizer_storage; ///< Storage of the centroids in the graph at search time
+    hnswlib::ReorderType reorder;           ///< Order of the centroids in the graph memory
 
     //=================
     // Data parameters
@@ -28,11 +35,14 @@ struct Parser
     size_t nq;             ///< Number of queries
     size_t ngt;            ///< Number of groundtruth neighbours per query
     size_t d;              ///< Vector dimension
+    size_t build_memory;   ///< Memory budget in GB for the groups loaded at once by the grouped build
+    ivfhnsw::MetricType metric; ///< Distance between the vectors: L2, inner product or cosine
 
     //=================
     // PQ parameters
     //=================
     size_t code_size;      ///< Code size per vector in bytes
+    size_t nbits;          ///< Number of bits per sub-quantizer index: 8, or 4 for fast-scan codes
     bool do_opq;           ///< Turn on/off OPQ fine encoding
 
     //===================
@@ -44,6 +54,28 @@ struct Parser
     size_t efSearch;       ///< Max number of candidate vertices in priority queue to observe during searching
     bool do_pruning;       ///< Turn on/off pruning in the grouping scheme
 
+    // The search parameters take comma-separated lists, which the benchmark sweeps.
+    // The tests use the first value of each list
+    std::vector<size_t> nprobe_values;
+    std::vector<size_t> max_codes_values;
+    std::vector<size_t> efSearch_values;
+    std::vector<bool> pruning_values;
+    size_t k_factor;       ///< Re-rank k_factor * k candidates by the exact distances to the base vectors, 0 - off
+    const char *stats_format; ///< Print the per-stage search statistics as "text" or "json", nullptr - off
+
+    //======================
+    // Benchmark parameters
+    //======================
+    size_t nthreads;       ///< Threads of the QPS measurement, 0 - all OpenMP threads
+    const char *label;     ///< Name of the run in the CSV, e.g. the version of the code
+    float target_recall;   ///< Recall@k, which the tuned search parameters have to reach, 0 - no constraint
+    double target_p99;     ///< p99 latency in us, which the tuned search parameters must not exceed, 0 - no constraint
+
+    //===================
+    // Memory parameters
+    //===================
+    hnswlib::MemoryPolicy memory_policy;  ///< Huge pages and NUMA placement of the graph and the inverted lists
+
     //=======
     // Paths
     //=======
@@ -62,6 +94,8 @@ struct Parser
     const char *path_opq_matrix;       ///< Path to OPQ rotation matrix for OPQ fine encoding
     const char *path_norm_pq;          ///< Path to the product quantizer for norms of reconstructed base points
     const char *path_index;            ///< Path to the constructed index
+    const char *path_csv;              ///< Path to the CSV, which the benchmark appends its results to
+    const char *path_params;           ///< Path to the search parameters written by the tuner
 
     Parser(int argc, char **argv)
     {
@@ -69,6 +103,22 @@ struct Parser
         if (argc == 1)
             usage();
 
+        nbits = 8;
+        nsubc = 0;
+        exact_assign = false;
+        build_memory = 16;
+        k_factor = 0;
+        stats_format = nullptr;
+        nthreads = 0;
+        label = "";
+        path_csv = nullptr;
+        path_params = nullptr;
+        target_recall = 0;
+        target_p99 = 0;
+        metric = ivfhnsw::METRIC_L2;
+        quantizer_storage = hnswlib::STORAGE_FLOAT;
+        reorder = hnswlib::REORDER_NONE;
+
         for (size_t i = 1 ; i < argc; i++) {
             char *a = argv[i];
 
@@ -83,6 +133,21 @@ struct Parser
             //=================
             if (!strcmp (a, "-M")) sscanf(argv[++i], "%zu", &M);
             else if (!strcmp (a, "-efConstruction")) sscanf(argv[++i], "%zu", &efConstruction);
+            else if (!strcmp (a, "-exact_assign")) exact_assign = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-quantizer_storage")) {
+                a = argv[++i];
+                if (!strcmp (a, "fp32")) quantizer_storage = hnswlib::STORAGE_FLOAT;
+                else if (!strcmp (a, "fp16")) quantizer_storage = hnswlib::STORAGE_FP16;
+                else if (!strcmp (a, "sq8")) quantizer_storage = hnswlib::STORAGE_SQ8;
+                else usage();
+            }
+            else if (!strcmp (a, "-reorder")) {
+                a = argv[++i];
+                if (!strcmp (a, "none")) reorder = hnswlib::REORDER_NONE;
+                else if (!strcmp (a, "bfs")) reorder = hnswlib::REORDER_BFS;
+                else if (!strcmp (a, "rcm")) reorder = hnswlib::REORDER_RCM;
+                else usage();
+            }
 
             //=================
             // Data parameters
@@ -95,21 +160,55 @@ struct Parser
             else if (!strcmp (a, "-nq")) sscanf(argv[++i], "%zu", &nq);
             else if (!strcmp (a, "-ngt")) sscanf(argv[++i], "%zu", &ngt);
             else if (!strcmp (a, "-d")) sscanf(argv[++i], "%zu", &d);
+            else if (!strcmp (a, "-build_memory")) sscanf(argv[++i], "%zu", &build_memory);
+            else if (!strcmp (a, "-metric")) {
+                a = argv[++i];
+                if (!strcmp (a, "l2")) metric = ivfhnsw::METRIC_L2;
+                else if (!strcmp (a, "ip")) metric = ivfhnsw::METRIC_INNER_PRODUCT;
+                else if (!strcmp (a, "cosine")) metric = ivfhnsw::METRIC_COSINE;
+                else usage();
+            }
 
             //===============
             // PQ parameters
             //===============
             else if (!strcmp (a, "-code_size"))sscanf(argv[++i], "%zu", &code_size);
+            else if (!strcmp (a, "-nbits")) sscanf(argv[++i], "%zu", &nbits);
             else if (!strcmp (a, "-opq")) do_opq = !strcmp(argv[++i], "on");
 
             //===================
             // Search parameters
             //===================
             else if (!strcmp (a, "-k")) sscanf(argv[++i], "%zu", &k);
-            else if (!strcmp (a, "-nprobe")) sscanf(argv[++i], "%zu", &nprobe);
-            else if (!strcmp (a, "-max_codes")) sscanf(argv[++i], "%zu", &max_codes);
-            else if (!strcmp (a, "-efSearch")) sscanf(argv[++i], "%zu", &efSearch);
-            else if (!strcmp (a, "-pruning")) do_pruning = !strcmp(argv[++i], "on");
+            else if (!strcmp (a, "-nprobe")) nprobe = parse_sizes(argv[++i], nprobe_values);
+            else if (!strcmp (a, "-max_codes")) max_codes = parse_sizes(argv[++i], max_codes_values);
+            else if (!strcmp (a, "-efSearch")) efSearch = parse_sizes(argv[++i], efSearch_values);
+            else if (!strcmp (a, "-pruning")) do_pruning = parse_switches(argv[++i], pruning_values);
+            else if (!strcmp (a, "-k_factor")) sscanf(argv[++i], "%zu", &k_factor);
+            else if (!strcmp (a, "-stats")) {
+                a = argv[++i];
+                if (!strcmp (a, "off")) stats_format = nullptr;
+                else if (!strcmp (a, "text") || !strcmp (a, "json")) stats_format = a;
+                else usage();
+            }
+
+            //===================
+            // Memory parameters
+            //===================
+            else if (!strcmp (a, "-huge_pages")) {
+                a = argv[++i];
+                if (!strcmp (a, "none")) memory_policy.huge_pages = hnswlib::HUGEPAGES_NONE;
+                else if (!strcmp (a, "thp")) memory_policy.huge_pages = hnswlib::HUGEPAGES_TRANSPARENT;
+                else if (!strcmp (a, "explicit")) memory_policy.huge_pages = hnswlib::HUGEPAGES_EXPLICIT;
+                else usage();
+            }
+            else if (!strcmp (a, "-numa")) {
+                a = argv[++i];
+                if (!strcmp (a, "none")) memory_policy.numa = hnswlib::NUMA_NONE;
+                else if (!strcmp (a, "interleave")) memory_policy.numa = hnswlib::NUMA_INTERLEAVE;
+                else if (!strcmp (a, "replicate")) memory_policy.numa = hnswlib::NUMA_REPLICATE;
+                else usage();
+            }
 
             //=======
             // Paths
@@ -129,9 +228,46 @@ struct Parser
             else if (!strcmp (a, "-path_opq_matrix")) path_opq_matrix = argv[++i];
             else if (!strcmp (a, "-path_norm_pq")) path_norm_pq = argv[++i];
             else if (!strcmp (a, "-path_index")) path_index = argv[++i];
+            else if (!strcmp (a, "-path_csv")) path_csv = argv[++i];
+            else if (!strcmp (a, "-path_params")) path_params = argv[++i];
+
+            //======================
+            // Benchmark parameters
+            //======================
+            else if (!strcmp (a, "-nthreads")) sscanf(argv[++i], "%zu", &nthreads);
+            else if (!strcmp (a, "-label")) label = argv[++i];
+            else if (!strcmp (a, "-target_recall")) sscanf(argv[++i], "%f", &target_recall);
+            else if (!strcmp (a, "-target_p99")) sscanf(argv[++i], "%lf", &target_p99);
         }
     }
 
+    /// Parse a comma-separated list of numbers into values, returns the first one
+    size_t parse_sizes(const char *list, std::vector<size_t> &values)
+    {
+        values.clear();
+        for (const char *p = list; p; p = strchr(p, ',')) {
+            size_t value;
+            if (*p == ',')
+                p++;
+            if (sscanf(p, "%zu", &value) != 1)
+                usage();
+            values.push_back(value);
+        }
+        return values[0];
+    }
+
+    /// Parse a comma-separated list of on/off into values, returns the first one
+    bool parse_switches(const char *list, std::vector<bool> &values)
+    {
+        values.clear();
+        for (const char *p = list; p; p = strchr(p, ',')) {
+            if (*p == ',')
+                p++;
+            values.push_back(!strncmp(p, "on", 2));
+        }
+        return values[0];
+    }
+
     void usage()
     {
         printf ("Usage: %s [options]\n", cmd);
@@ -140,6 +276,9 @@ struct Parser
                 "###################\n"
                 "    -M #                  Min number of edges per point\n"
                 "    -efConstruction #     Max number of candidate vertices in priority queue to observe during construction\n"
+                "    -exact_assign on/off  Assign base vectors to the exact nearest centroids (brute force) instead of HNSW\n"
+                "    -quantizer_storage fp32/fp16/sq8  Storage of the centroids in the graph at search time (default fp32)\n"
+                "    -reorder none/bfs/rcm  Reorder the centroids in the graph memory for the locality (default none)\n"
                 "###################\n"
                 "# Data Parameters #\n"
                 "###################\n"
@@ -151,10 +290,13 @@ struct Parser
                 "    -nq #                 Number of queries\n"
                 "    -ngt #                Number of groundtruth neighbours per query\n"
                 "    -d #                  Vector dimension\n"
+                "    -build_memory #       Memory budget in GB for the grouped build (default 16)\n"
+                "    -metric l2/ip/cosine  Distance between the vectors (default l2), the grouping index has no ip\n"
                 "#################\n"
                 "# PQ Parameters #\n"
                 "#################\n"
                 "    -code_size #          Code size per vector in bytes\n"
+                "    -nbits #              Number of bits per sub-quantizer index: 8 (default) or 4 (fast-scan)\n"
                 "    -opq on/off           Turn on/off OPQ compression\n"
                 "####################\n"
                 "# Search Parameters #\n"
@@ -164,6 +306,25 @@ struct Parser
                 "    -max_codes #          Max number of codes to visit to do a query\n"
                 "    -efSearch #           Max number of candidate vertices in priority queue to observe during searching\n"
                 "    -pruning on/off       Turn on/off pruning in the grouping scheme\n"
+                "                          The search parameters take comma-separated lists (e.g. -nprobe 32,64,128),\n"
+                "                          which the benchmark sweeps, the tests use the first value\n"
+                "    -k_factor #           Re-rank k_factor * k candidates by the exact distances to the base set (default 0, off)\n"
+                "    -stats off/text/json  Print the time of each search stage and the work per query (default off)\n"
+                "########################\n"
+                "# Benchmark Parameters #\n"
+                "########################\n"
+                "    -nthreads #           Threads of the QPS measurement (default 0, all OpenMP threads)\n"
+                "    -label name           Name of the run in the CSV, e.g. the version of the code\n"
+                "    -target_recall #      Recall@k, which the tuner has to reach, e.g. 0.9 (default 0, no constraint)\n"
+                "    -target_p99 #         p99 latency in us, which the tuner must not exceed (default 0, no constraint)\n"
+                "                          The tests choose the configuration of -path_params by the same constraints\n"
+                "#####################\n"
+                "# Memory Parameters #\n"
+                "#####################\n"
+                "    -huge_pages none/thp/explicit  Pages of the graph and the inverted lists: regular (default), transparent\n"
+                "                          or reserved 2MB huge pages (falls back to transparent if none are reserved)\n"
+                "    -numa none/interleave/replicate  Interleave the arrays over the NUMA nodes and pin the search threads,\n"
+                "                          replicate also copies the graph to each node (default none)\n"
                 "#########\n"
                 "# Paths #\n"
                 "#########\n"
@@ -183,6 +344,9 @@ struct Parser
                 "    -path_norm_pq filename            Path to the product quantizer for norms of reconstructed base points\n"
                 "    "
                 "    -path_index filename              Path to the constructed index\n"
+                "    -path_csv filename                Path to the CSV, which the benchmark appends a row per configuration to\n"
+                "    -path_params filename             Path to the search parameters written by the tuner, they override\n"
+                "                                      -nprobe, -max_codes, -efSearch and -pruning if the file exists\n"
         );
         exit(0);
     }
@@ -0,0 +1,24 @@
+#ifndef IVF_HNSW_LIB_RANGESEARCHRESULT_H
+#define IVF_HNSW_LIB_RANGESEARCHRESULT_H
+
+#include <vector>
+#include <cstddef>
+
+namespace ivfhnsw {
+    /** Results of the range search for nq queries
+      *
+      * The results of all queries are stored one after another, the results
+      * of the i-th query are at positions [lims[i], lims[i + 1]) of labels and distances.
+      * The results of a query are not sorted by the distance.
+    */
+    struct RangeSearchResult
+    {
+        size_t nq;                      ///< Number of queries
+        std::vector<size_t> lims;       ///< Bounds of the results of each query, size nq + 1
+        std::vector<long> labels;       ///< Labels of the results, size lims[nq]
+        std::vector<float> distances;   ///< Distances of the results, size lims[nq]
+
+        RangeSearchResult(): nq(0), lims(1, 0) {}
+    };
+}
+#endif //IVF_HNSW_LIB_RANGESEARCHRESULT_H
@@ -0,0 +1,83 @@
+#include "RawVectors.h"
+
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <faiss/utils.h>
+
+namespace ivfhnsw {
+
+    static bool ends_with(const std::string &s, const char *suffix)
+    {
+        const size_t len = strlen(suffix);
+        return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+    }
+
+    RawVectors::RawVectors(const char *path, size_t dim): file(new MappedFile(path)), d(dim)
+    {
+        elem_size = ends_with(path, ".bvecs") ? sizeof(uint8_t) : sizeof(float);
+        row_size = sizeof(uint32_t) + d * elem_size;
+
+        uint32_t file_dim;
+        memcpy(&file_dim, file->data, sizeof(uint32_t));
+        if (file_dim != d || file->size % row_size != 0)
+            throw std::runtime_error(std::string(path) + " does not contain vectors of dimension " + std::to_string(d));
+        n = file->size / row_size;
+
+        // Rows are read at random, the read-ahead would only load the neighbouring rows
+        madvise((void *) file->data, file->size, MADV_RANDOM);
+    }
+
+    void RawVectors::prefetch(size_t nids, const long *ids) const
+    {
+        static const size_t page_size = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < nids; i++) {
+            if (ids[i] < 0 || size_t(ids[i]) >= n)
+                continue;
+            const size_t begin = (ids[i] * row_size) / page_size * page_size;
+            const size_t end = (ids[i] + 1) * row_size;
+            madvise((void *) (file->data + begin), end - begin, MADV_WILLNEED);
+        }
+    }
+
+    float RawVectors::l2sqr(const float *x, idx_t id) const
+    {
+        const uint8_t *y = row(id);
+        if (elem_size == sizeof(float))
+            return faiss::fvec_L2sqr(x, (const float *) y, d);
+
+        float res = 0;
+        for (size_t i = 0; i < d; i++) {
+            const float diff = x[i] - y[i];
+            res += diff * diff;
+        }
+        return res;
+    }
+
+    float RawVectors::inner_product(const float *x, idx_t id) const
+    {
+        const uint8_t *y = row(id);
+        if (elem_size == sizeof(float))
+            return faiss::fvec_inner_product(x, (const float *) y, d);
+
+        float res = 0;
+        for (size_t i = 0; i < d; i++)
+            res += x[i] * y[i];
+        return res;
+    }
+
+    float RawVectors::norm_L2sqr(idx_t id) const
+    {
+        const uint8_t *y = row(id);
+        if (elem_size == sizeof(float))
+            return faiss::fvec_norm_L2sqr((const float *) y, d);
+
+        float res = 0;
+        for (size_t i = 0; i < d; i++)
+            res += float(y[i]) * y[i];
+        return res;
+    }
+}
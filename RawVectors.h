@@ -0,0 +1,58 @@
+#ifndef IVF_HNSW_LIB_RAWVECTORS_H
+#define IVF_HNSW_LIB_RAWVECTORS_H
+
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#include "IndexFile.h"
+
+namespace ivfhnsw {
+    /** Original vectors of the base set, used to re-rank the candidates of the PQ search
+      *
+      * The fvecs (float) or bvecs (uint8) file is memory-mapped, so only the rows of the
+      * candidates are read from the disk and the vectors are not kept in RAM. The mapping is
+      * advised for the random access, the rows are prefetched by prefetch() before they are used.
+    */
+    class RawVectors
+    {
+        std::unique_ptr<MappedFile> file;
+
+    public:
+        typedef uint32_t idx_t;
+
+        size_t d;              ///< Vector dimension
+        size_t n;              ///< Number of vectors in the file
+        size_t elem_size;      ///< 1 for bvecs, 4 for fvecs
+        size_t row_size;       ///< Bytes per vector including its dimension header
+
+        /** Map the file, the type of the vectors is given by the extension: .bvecs or .fvecs
+          *
+          * @param path   path to the base set
+          * @param dim    vector dimension, checked against the file
+        */
+        RawVectors(const char *path, size_t dim);
+
+        RawVectors(const RawVectors &) = delete;
+        RawVectors &operator=(const RawVectors &) = delete;
+
+        /// Components of the vector, elem_size bytes each, the id must be below n
+        inline const uint8_t *row(idx_t id) const { return file->data + id * row_size + sizeof(uint32_t); }
+
+        /** Ask the kernel to read the rows of the vectors in the background
+          *
+          * Returns at once, so the reads of all the rows overlap. Negative labels and ids beyond the file are skipped.
+        */
+        void prefetch(size_t nids, const long *ids) const;
+
+        /// Exact L2 square distance between x and the vector with the id
+        float l2sqr(const float *x, idx_t id) const;
+
+        /// Exact inner product between x and the vector with the id
+        float inner_product(const float *x, idx_t id) const;
+
+        /// Squared L2 norm of the vector with the id
+        float norm_L2sqr(idx_t id) const;
+    };
+}
+#endif //IVF_HNSW_LIB_RAWVECTORS_H
@@ -0,0 +1,80 @@
+#include "SearchParams.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <stdexcept>
+
+namespace ivfhnsw {
+
+    void write_search_params(const char *path, const TunedSearchParams &tuned, const char *comment)
+    {
+        std::ofstream output(path);
+        if (!output)
+            throw std::runtime_error(std::string("Could not open ") + path);
+
+        if (comment)
+            output << "# " << comment << std::endl;
+        output << "# target_recall " << tuned.target_recall << " target_p99 " << tuned.target_p99 << std::endl;
+        output << "# nprobe,max_codes,efSearch,pruning,recall,mean_us,p99_us" << std::endl;
+        for (const SearchParams &p : tuned.params)
+            output << p.nprobe << "," << p.max_codes << "," << p.efSearch << "," << (p.do_pruning ? "on" : "off")
+                   << "," << p.recall << "," << p.mean_us << "," << p.p99_us << std::endl;
+    }
+
+    TunedSearchParams read_search_params(const char *path)
+    {
+        std::ifstream input(path);
+        if (!input)
+            throw std::runtime_error(std::string("Could not open ") + path);
+
+        TunedSearchParams tuned;
+        std::string line;
+        while (std::getline(input, line)) {
+            if (line.empty())
+                continue;
+            if (line[0] == '#') {
+                sscanf(line.c_str(), "# target_recall %f target_p99 %lf", &tuned.target_recall, &tuned.target_p99);
+                continue;
+            }
+            SearchParams p;
+            char pruning[4] = {0};
+            if (sscanf(line.c_str(), "%zu,%zu,%zu,%3[^,],%f,%lf,%lf", &p.nprobe, &p.max_codes, &p.efSearch,
+                       pruning, &p.recall, &p.mean_us, &p.p99_us) != 7)
+                throw std::runtime_error(std::string("Invalid search parameters in ") + path + ": " + line);
+            p.do_pruning = std::string(pruning) == "on";
+            tuned.params.push_back(p);
+        }
+        if (tuned.params.empty())
+            throw std::runtime_error(std::string("No search parameters in ") + path);
+        return tuned;
+    }
+
+    SearchParams select_search_params(const TunedSearchParams &tuned, float min_recall, double max_p99_us)
+    {
+        // Files without the constraint are accepted for any
+        const bool tuned_any = tuned.target_recall <= 0 && tuned.target_p99 <= 0;
+        if (!tuned_any && ((min_recall > 0 && tuned.target_recall <= 0) || (max_p99_us > 0 && tuned.target_p99 <= 0)))
+            throw std::runtime_error("The search parameters are tuned for target_recall " +
+                                     std::to_string(tuned.target_recall) + " and target_p99 " +
+                                     std::to_string(tuned.target_p99) + ", tune them for the requested constraint");
+
+        const std::vector<SearchParams> &params = tuned.params;
+        const SearchParams *best = nullptr;
+        for (const SearchParams &p : params) {
+            if (p.recall < min_recall || (max_p99_us > 0 && p.p99_us > max_p99_us))
+                continue;
+            if (!best || (min_recall > 0 ? p.mean_us < best->mean_us : p.recall > best->recall))
+                best = &p;
+        }
+        if (best)
+            return *best;
+
+        // Nothing satisfies the constraints, come as close as possible
+        for (const SearchParams &p : params)
+            if (!best || (min_recall > 0 ? p.recall > best->recall : p.p99_us < best->p99_us))
+                best = &p;
+        return *best;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef IVF_HNSW_LIB_SEARCHPARAMS_H
+#define IVF_HNSW_LIB_SEARCHPARAMS_H
+
+#include <vector>
+#include <cstddef>
+
+namespace ivfhnsw {
+    /** Search parameters of the index together with their measured quality
+      *
+      * The tuner writes the Pareto-optimal configurations to a text file, one per line:
+      *     nprobe,max_codes,efSearch,pruning,recall,mean_us,p99_us
+      * Lines starting with '#' are comments, except the constraint of the tuning:
+      *     # target_recall 0.9 target_p99 0
+      * The index applies a configuration by set_search_params().
+    */
+    struct SearchParams
+    {
+        size_t nprobe;        ///< Number of probes at search time
+        size_t max_codes;     ///< Max number of codes to visit to do a query
+        size_t efSearch;      ///< Max number of candidate vertices in priority queue to observe during searching
+        bool do_pruning;      ///< Turn on/off pruning in the grouping scheme
+
+        float recall;         ///< Measured recall@k, k is given in the header of the file
+        double mean_us;       ///< Measured mean single-thread latency
+        double p99_us;        ///< Measured 99th percentile of the single-thread latency
+
+        SearchParams(): nprobe(0), max_codes(0), efSearch(0), do_pruning(false), recall(0), mean_us(0), p99_us(0) {}
+    };
+
+    /** Configurations tuned for a constraint
+      *
+      * The tuner keeps the configurations, which are the best for its constraint, so the file
+      * stores the constraint in its header and only the same kind of constraint may be applied.
+    */
+    struct TunedSearchParams
+    {
+        float target_recall;               ///< Recall constraint of the tuning, 0 - none
+        double target_p99;                 ///< Latency constraint of the tuning in us, 0 - none
+        std::vector<SearchParams> params;  ///< Pareto-optimal configurations
+
+        TunedSearchParams(): target_recall(0), target_p99(0) {}
+    };
+
+    /// Write the configurations, the comment is written to the header, e.g. the k of the recall
+    void write_search_params(const char *path, const TunedSearchParams &tuned, const char *comment);
+
+    /// Read the configurations, the constraint is 0 - none in the files without it
+    TunedSearchParams read_search_params(const char *path);
+
+    /** Choose a configuration from the tuned ones
+      *
+      * Among the configurations with recall >= min_recall and p99_us <= max_p99_us, returns the fastest one
+      * if min_recall is set, otherwise the most accurate one. If no configuration satisfies the constraints,
+      * the one closest to them is returned: the most accurate one for the recall constraint, the fastest one
+      * for the latency constraint.
+      *
+      * Throws if the configurations were tuned for the other kind of constraint, as they are not the best
+      * ones for it.
+      *
+      * @param min_recall   minimum recall, 0 - no constraint
+      * @param max_p99_us   maximum p99 latency in us, 0 - no constraint
+    */
+    SearchParams select_search_params(const TunedSearchParams &tuned, float min_recall, double max_p99_us);
+}
+#endif //IVF_HNSW_LIB_SEARCHPARAMS_H
@@ -0,0 +1,219 @@
+#include "SearchStats.h"
+
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+
+namespace ivfhnsw {
+
+    const char *search_stage_name(SearchStage stage)
+    {
+        static const char *names[nstages] = {"coarse", "rotation", "table", "norms", "scan", "refine", "total"};
+        return names[stage];
+    }
+
+    const char *search_counter_name(SearchCounter counter)
+    {
+        static const char *names[ncounters] = {"lists_probed", "codes_scanned", "heap_insertions",
+                                               "pruned_subgroups", "hnsw_hops", "hnsw_dist_calcs"};
+        return names[counter];
+    }
+
+    double ns_per_tick()
+    {
+        static const double value = [] {
+            const auto begin = std::chrono::steady_clock::now();
+            const uint64_t begin_ticks = stats_ticks();
+            auto end = begin;
+            while (end - begin < std::chrono::milliseconds(10))
+                end = std::chrono::steady_clock::now();
+            const uint64_t end_ticks = stats_ticks();
+            return std::chrono::duration<double, std::nano>(end - begin).count() / (end_ticks - begin_ticks);
+        }();
+        return value;
+    }
+
+    void QueryStats::reset()
+    {
+        for (size_t i = 0; i < nstages; i++)
+            ticks[i] = 0;
+        for (size_t i = 0; i < ncounters; i++)
+            counters[i] = 0;
+    }
+
+    //==========================
+    // Log-linear histogram
+    //==========================
+    // Values below 4 have their own buckets, then each power of two is split into 4 buckets
+
+    static size_t bucket_of(uint64_t value)
+    {
+        if (value < 4)
+            return value;
+        const int msb = 63 - __builtin_clzll(value);
+        return (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+    }
+
+    static uint64_t bucket_lower(size_t bucket)
+    {
+        if (bucket < 4)
+            return bucket;
+        const int msb = bucket / 4 + 1;
+        return (4 + bucket % 4) << (msb - 2);
+    }
+
+    static double bucket_middle(size_t bucket)
+    {
+        if (bucket < 4)
+            return bucket;
+        const int msb = bucket / 4 + 1;
+        return bucket_lower(bucket) + 0.5 * (uint64_t(1) << (msb - 2));
+    }
+
+    static double histogram_percentile(const std::atomic<uint64_t> *hist, size_t nbuckets, uint64_t count, double p)
+    {
+        if (count == 0)
+            return 0;
+        const uint64_t rank = std::max<uint64_t>(1, (uint64_t) std::ceil(p * count));
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < nbuckets; b++) {
+            cumulative += hist[b].load(std::memory_order_relaxed);
+            if (cumulative >= rank)
+                return bucket_middle(b);
+        }
+        return bucket_middle(nbuckets - 1);
+    }
+
+    //=======================
+    // SearchStatsCollector
+    //=======================
+    SearchStatsCollector::SearchStatsCollector()
+    {
+        // Calibrate the ticks now, not while a query is timed
+        ns_per_tick();
+        reset();
+    }
+
+    void SearchStatsCollector::reset()
+    {
+        count = 0;
+        for (size_t i = 0; i < nstages; i++) {
+            stage_sums[i] = 0;
+            for (size_t b = 0; b < nbuckets; b++)
+                stage_hists[i][b] = 0;
+        }
+        for (size_t i = 0; i < ncounters; i++) {
+            counter_sums[i] = 0;
+            for (size_t b = 0; b < nbuckets; b++)
+                counter_hists[i][b] = 0;
+        }
+    }
+
+    void SearchStatsCollector::add(const QueryStats &stats)
+    {
+        const double scale = ns_per_tick();
+        for (size_t i = 0; i < nstages; i++) {
+            const uint64_t ns = (uint64_t) (stats.ticks[i] * scale);
+            stage_sums[i].fetch_add(ns, std::memory_order_relaxed);
+            stage_hists[i][bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < ncounters; i++) {
+            counter_sums[i].fetch_add(stats.counters[i], std::memory_order_relaxed);
+            counter_hists[i][bucket_of(stats.counters[i])].fetch_add(1, std::memory_order_relaxed);
+        }
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    double SearchStatsCollector::mean_ns(SearchStage stage) const
+    {
+        const size_t n = nqueries();
+        return n ? (double) stage_sums[stage].load(std::memory_order_relaxed) / n : 0;
+    }
+
+    double SearchStatsCollector::percentile_ns(SearchStage stage, double p) const
+    {
+        return histogram_percentile(stage_hists[stage], nbuckets, nqueries(), p);
+    }
+
+    double SearchStatsCollector::mean(SearchCounter counter) const
+    {
+        const size_t n = nqueries();
+        return n ? (double) counter_sums[counter].load(std::memory_order_relaxed) / n : 0;
+    }
+
+    double SearchStatsCollector::percentile(SearchCounter counter, double p) const
+    {
+        return histogram_percentile(counter_hists[counter], nbuckets, nqueries(), p);
+    }
+
+    std::string SearchStatsCollector::to_text() const
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        out << "Search statistics of " << nqueries() << " queries" << std::endl;
+        out << std::setw(18) << "stage, us" << std::setw(10) << "mean" << std::setw(10) << "p50"
+            << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::endl;
+        for (size_t i = 0; i < nstages; i++) {
+            const SearchStage stage = (SearchStage) i;
+            out << std::setw(18) << search_stage_name(stage) << std::setw(10) << mean_ns(stage) / 1000;
+            for (double p : {0.5, 0.9, 0.99, 0.999})
+                out << std::setw(10) << percentile_ns(stage, p) / 1000;
+            out << std::endl;
+        }
+        out << std::setw(18) << "counter" << std::setw(10) << "mean" << std::setw(10) << "p50"
+            << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::endl;
+        for (size_t i = 0; i < ncounters; i++) {
+            const SearchCounter counter = (SearchCounter) i;
+            out << std::setw(18) << search_counter_name(counter) << std::setw(10) << mean(counter);
+            for (double p : {0.5, 0.9, 0.99, 0.999})
+                out << std::setw(10) << percentile(counter, p);
+            out << std::endl;
+        }
+        return out.str();
+    }
+
+    /// Non-empty buckets as [lower bound, count] pairs
+    static void write_histogram(std::ostream &out, const std::atomic<uint64_t> *hist, size_t nbuckets)
+    {
+        out << "[";
+        bool first = true;
+        for (size_t b = 0; b < nbuckets; b++) {
+            const uint64_t n = hist[b].load(std::memory_order_relaxed);
+            if (n == 0)
+                continue;
+            out << (first ? "" : ", ") << "[" << bucket_lower(b) << ", " << n << "]";
+            first = false;
+        }
+        out << "]";
+    }
+
+    std::string SearchStatsCollector::to_json() const
+    {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        out << "{\"queries\": " << nqueries() << ", \"stages_ns\": {";
+        for (size_t i = 0; i < nstages; i++) {
+            const SearchStage stage = (SearchStage) i;
+            out << (i ? ", " : "") << "\"" << search_stage_name(stage) << "\": {\"mean\": " << mean_ns(stage)
+                << ", \"p50\": " << percentile_ns(stage, 0.5) << ", \"p90\": " << percentile_ns(stage, 0.9)
+                << ", \"p99\": " << percentile_ns(stage, 0.99) << ", \"p999\": " << percentile_ns(stage, 0.999)
+                << ", \"histogram\": ";
+            write_histogram(out, stage_hists[i], nbuckets);
+            out << "}";
+        }
+        out << "}, \"counters\": {";
+        for (size_t i = 0; i < ncounters; i++) {
+            const SearchCounter counter = (SearchCounter) i;
+            out << (i ? ", " : "") << "\"" << search_counter_name(counter) << "\": {\"mean\": " << mean(counter)
+                << ", \"p50\": " << percentile(counter, 0.5) << ", \"p90\": " << percentile(counter, 0.9)
+                << ", \"p99\": " << percentile(counter, 0.99) << ", \"p999\": " << percentile(counter, 0.999)
+                << ", \"histogram\": ";
+            write_histogram(out, counter_hists[i], nbuckets);
+            out << "}";
+        }
+        out << "}}" << std::endl;
+        return out.str();
+    }
+}
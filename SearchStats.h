@@ -0,0 +1,119 @@
+#ifndef IVF_HNSW_LIB_SEARCHSTATS_H
+#define IVF_HNSW_LIB_SEARCHSTATS_H
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <x86intrin.h>
+
+/// Set to 0 to compile the statistics out of the search
+#ifndef IVFHNSW_SEARCH_STATS
+#define IVFHNSW_SEARCH_STATS 1
+#endif
+
+namespace ivfhnsw {
+    const bool search_stats_enabled = IVFHNSW_SEARCH_STATS;
+
+    /// Stages of a query, timed separately
+    enum SearchStage {
+        STAGE_COARSE = 0,   ///< HNSW search of the nearest centroids and the sub-centroid distances (Grouping)
+        STAGE_ROTATION,     ///< Normalization and OPQ rotation of the query, a share of the block in the batch search
+        STAGE_TABLE,        ///< Inner product table and its quantization (fast-scan)
+        STAGE_NORMS,        ///< Decoding of the norm codes
+        STAGE_SCAN,         ///< Scan of the codes and the result heap
+        STAGE_REFINE,       ///< Re-ranking by the exact distances
+        STAGE_TOTAL,        ///< Whole query
+        nstages
+    };
+
+    /// Work done by a query
+    enum SearchCounter {
+        COUNTER_LISTS_PROBED = 0,    ///< Non-empty inverted lists visited
+        COUNTER_CODES_SCANNED,       ///< Codes, whose distances are computed
+        COUNTER_HEAP_INSERTIONS,     ///< Codes, which entered the result heap
+        COUNTER_PRUNED_SUBGROUPS,    ///< Subgroups skipped by the pruning (Grouping)
+        COUNTER_HNSW_HOPS,           ///< Graph elements expanded by the coarse search
+        COUNTER_HNSW_DIST_CALCS,     ///< Distances computed by the coarse search
+        ncounters
+    };
+
+    const char *search_stage_name(SearchStage stage);
+    const char *search_counter_name(SearchCounter counter);
+
+    /// Time stamp counter, the stages are timed in its ticks
+    inline uint64_t stats_ticks() { return __rdtsc(); }
+
+    /// Duration of a tick, measured once against the steady clock
+    double ns_per_tick();
+
+    /** Statistics of one query
+      *
+      * Filled by the search if the index collects the statistics. The stages are timed by the time stamp
+      * counter, which takes a few ns to read, so the scan of each list can be timed.
+    */
+    struct QueryStats
+    {
+        uint64_t ticks[nstages];       ///< Time of each stage in ticks
+        uint64_t counters[ncounters];
+
+        QueryStats() { reset(); }
+
+        void reset();
+
+        /// Add the time since start to the stage, returns the current time, so the next stage starts from it
+        inline uint64_t lap(SearchStage stage, uint64_t start) {
+            const uint64_t now = stats_ticks();
+            ticks[stage] += now - start;
+            return now;
+        }
+
+        /// Time of the stage in ns
+        inline double ns(SearchStage stage) const { return ticks[stage] * ns_per_tick(); }
+    };
+
+    /** Thread-safe aggregate of the query statistics
+      *
+      * The sums and the histograms are atomic counters, so many search threads add their queries
+      * without a lock. Each histogram has 4 buckets per power of two, so a percentile is within 13%
+      * of the exact value.
+    */
+    class SearchStatsCollector
+    {
+    public:
+        static const size_t nbuckets = 256;
+
+        SearchStatsCollector();
+
+        SearchStatsCollector(const SearchStatsCollector &) = delete;
+        SearchStatsCollector &operator=(const SearchStatsCollector &) = delete;
+
+        void add(const QueryStats &stats);
+        void reset();
+
+        inline size_t nqueries() const { return count.load(std::memory_order_relaxed); }
+
+        /// Mean time of the stage in ns
+        double mean_ns(SearchStage stage) const;
+
+        /// Approximate p-th percentile (0 <= p <= 1) of the time of the stage in ns
+        double percentile_ns(SearchStage stage, double p) const;
+
+        double mean(SearchCounter counter) const;
+        double percentile(SearchCounter counter, double p) const;
+
+        /// Table of the means and percentiles
+        std::string to_text() const;
+
+        /// Means, percentiles and non-empty histogram buckets of each stage and counter
+        std::string to_json() const;
+
+    private:
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> stage_sums[nstages];     ///< Sums of the times in ns
+        std::atomic<uint64_t> counter_sums[ncounters];
+        std::atomic<uint64_t> stage_hists[nstages][nbuckets];
+        std::atomic<uint64_t> counter_hists[ncounters][nbuckets];
+    };
+}
+#endif //IVF_HNSW_LIB_SEARCHSTATS_H
@@ -0,0 +1,213 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <stdlib.h>
+#include <random>
+#include <limits>
+#include <algorithm>
+
+#include <faiss/utils.h>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/SearchStats.h>
+#include <ivf-hnsw/pq_scan.h>
+
+using namespace hnswlib;
+using namespace ivfhnsw;
+
+//==============================================================
+// Microbenchmark of the distance, look-up table and scan kernels
+//==============================================================
+// Each kernel runs on fixed-seed random inputs for
+// d in {96, 128, 256} and code sizes {8, 16, 32} and reports
+//  - ns/op:     time per distance, code or point
+//  - GB/s:      bytes of the vectors or codes read per second
+//  - cycles/op: time stamp counter ticks per operation
+// The fastest of the repetitions is reported. The distance
+// kernels are chosen at compile time: configure with
+// -DCMAKE_CXX_FLAGS=-mno-avx to measure the SSE ones. The PQ
+// scans are dispatched at runtime
+//==============================================================
+// Usage: bench_kernels [-n #vectors] [-kernel name]
+
+/// Grouping helpers are protected, the benchmark calls them directly
+struct GroupingKernels: IndexIVF_HNSW_Grouping
+{
+    GroupingKernels(size_t d, size_t code_size, size_t nsubc): IndexIVF_HNSW_Grouping(d, 1, code_size, 8, nsubc) {}
+
+    using IndexIVF_HNSW_Grouping::pq_L2sqr;
+    using IndexIVF_HNSW_Grouping::compute_subcentroid_idxs;
+    using IndexIVF_HNSW_Grouping::compute_alpha;
+};
+
+/// Keeps the results of the kernels alive
+static volatile float sink;
+
+static const char *kernel_filter = nullptr;
+
+/** Time run(), which performs nops operations reading nbytes, and print a row
+  *
+  * run() is repeated at least 5 times and for at least 50 ms, the fastest repetition is reported.
+*/
+template<typename Run>
+static void measure(const char *kernel, size_t d, size_t code_size, size_t nops, size_t nbytes, Run run)
+{
+    if (kernel_filter && !strstr(kernel, kernel_filter))
+        return;
+
+    sink = sink + run();
+    const uint64_t min_ticks = (uint64_t) (5e7 / ns_per_tick());
+    const uint64_t start = stats_ticks();
+    uint64_t best = std::numeric_limits<uint64_t>::max();
+    for (size_t rep = 0; rep < 5 || stats_ticks() - start < min_ticks; rep++) {
+        const uint64_t t0 = stats_ticks();
+        sink = sink + run();
+        best = std::min(best, stats_ticks() - t0);
+    }
+    const double ns = best * ns_per_tick();
+    printf("%-32s %5zu %10zu %10.2f %10.2f %10.1f\n", kernel, d, code_size,
+           ns / nops, nbytes / ns, (double) best / nops);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = 16384;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-n")) sscanf(argv[i + 1], "%zu", &n);
+        else if (!strcmp(argv[i], "-kernel")) kernel_filter = argv[i + 1];
+    }
+    std::mt19937 rng(123);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+
+#ifdef USE_AVX
+    printf("Distance kernels: AVX\n");
+#else
+    printf("Distance kernels: SSE\n");
+#endif
+    printf("PQ scan kernel: %s\n", pq_scan_kernel_name());
+
+    // Graphs of a single element only provide fstdistfunc, they are built before the table as they print their size
+    const size_t dims[] = {96, 128, 256};
+    std::vector<HierarchicalNSW *> graphs;
+    for (size_t d : dims)
+        graphs.push_back(new HierarchicalNSW(d, 1, 16, 32));
+
+    printf("%zu vectors or codes per repetition, %.3f ns per tick\n\n", n, ns_per_tick());
+    printf("%-32s %5s %10s %10s %10s %10s\n", "kernel", "d", "code_size", "ns/op", "GB/s", "cycles/op");
+
+    for (size_t t = 0; t < graphs.size(); t++) {
+        const size_t d = dims[t];
+        std::vector<float> query(d);
+        std::vector<float> x(n * d);
+        for (float &v : query) v = uniform(rng);
+        for (float &v : x) v = uniform(rng);
+
+        //==================
+        // Vector distances
+        //==================
+        measure("ivfhnsw::fvec_L2sqr", d, 0, n, n * d * sizeof(float), [&] {
+            float sum = 0;
+            for (size_t i = 0; i < n; i++)
+                sum += fvec_L2sqr(query.data(), x.data() + i * d, d);
+            return sum;
+        });
+
+        HierarchicalNSW &graph = *graphs[t];
+        measure("HierarchicalNSW::fstdistfunc", d, 0, n, n * d * sizeof(float), [&] {
+            float sum = 0;
+            for (size_t i = 0; i < n; i++)
+                sum += graph.fstdistfunc(query.data(), x.data() + i * d);
+            return sum;
+        });
+
+        //==================
+        // Grouping helpers
+        //==================
+        // A group of the points around a centroid and the vectors to its nsubc nearest centroids
+        for (size_t nsubc : {64}) {
+            GroupingKernels index(d, 16, nsubc);
+            const size_t group_size = std::min<size_t>(n, 4096);
+            std::vector<float> centroid_vectors(nsubc * d);
+            std::vector<float> centroid_vector_norms(nsubc);
+            for (float &v : centroid_vectors) v = uniform(rng);
+            faiss::fvec_norms_L2sqr(centroid_vector_norms.data(), centroid_vectors.data(), d, nsubc);
+            std::vector<idx_t> subcentroid_idxs(group_size);
+
+            measure("compute_subcentroid_idxs(64)", d, 0, group_size, group_size * nsubc * d * sizeof(float), [&] {
+                index.compute_subcentroid_idxs(subcentroid_idxs.data(), centroid_vectors.data(), x.data(), group_size);
+                return (float) subcentroid_idxs[0];
+            });
+            measure("compute_alpha(64)", d, 0, group_size, group_size * nsubc * d * sizeof(float), [&] {
+                return index.compute_alpha(centroid_vectors.data(), x.data(), query.data(),
+                                           centroid_vector_norms.data(), group_size);
+            });
+        }
+
+        //=============
+        // PQ distances
+        //=============
+        for (size_t code_size : {8, 16, 32}) {
+            GroupingKernels index(d, code_size, 64);
+            const size_t ksub = index.pq->ksub;
+
+            std::vector<float> table(code_size * ksub);
+            std::vector<uint8_t> codes(n * code_size);
+            std::vector<float> dis(n);
+            for (float &v : table) v = uniform(rng);
+            for (uint8_t &c : codes) c = rng();
+
+            measure("IndexIVF_HNSW::pq_L2sqr", d, code_size, n, n * code_size, [&] {
+                float sum = 0;
+                for (size_t i = 0; i < n; i++)
+                    sum += index.pq_L2sqr(codes.data() + i * code_size, table.data());
+                return sum;
+            });
+
+            const std::string scan_name = std::string("pq_scan_codes[") + pq_scan_kernel_name() + "]";
+            measure(scan_name.c_str(), d, code_size, n, n * code_size, [&] {
+                pq_scan_codes(n, codes.data(), code_size, ksub, table.data(), dis.data());
+                return dis[0];
+            });
+
+            // 4-bit codes of the same size have 2 * code_size sub-quantizers
+            const size_t M4 = 2 * code_size;
+            const size_t nblocks = (n + pq4_block_size - 1) / pq4_block_size;
+            std::vector<uint8_t> blocks(pq4_blocks_size(n, M4));
+            std::vector<uint8_t> idx(M4);
+            for (size_t i = 0; i < n; i++) {
+                for (uint8_t &c : idx) c = rng() & 15;
+                pq4_set_code(blocks.data(), i, M4, idx.data());
+            }
+            std::vector<float> table4(M4 * 16);
+            for (float &v : table4) v = uniform(rng);
+            std::vector<uint8_t> lut(M4 * 16);
+            float scale, bias;
+            pq4_quantize_lut(M4, table4.data(), 1, lut.data(), &scale, &bias);
+            std::vector<uint16_t> dis4(nblocks * pq4_block_size);
+
+            measure("pq4_scan_blocks", d, code_size, nblocks * pq4_block_size, blocks.size(), [&] {
+                pq4_scan_blocks(nblocks, blocks.data(), M4, lut.data(), dis4.data());
+                return (float) dis4[0];
+            });
+        }
+
+        //==============
+        // Norm decoding
+        //==============
+        {
+            GroupingKernels index(d, 16, 64);
+            for (float &v : index.norm_pq->centroids) v = uniform(rng);
+            std::vector<uint8_t> norm_codes(n);
+            std::vector<float> norms(n);
+            for (uint8_t &c : norm_codes) c = rng();
+
+            measure("norm_pq->decode", d, 1, n, n * (1 + sizeof(float)), [&] {
+                index.norm_pq->decode(norm_codes.data(), norms.data(), n);
+                return norms[0];
+            });
+        }
+    }
+    for (HierarchicalNSW *graph : graphs)
+        delete graph;
+    return 0;
+}
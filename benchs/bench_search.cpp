@@ -0,0 +1,129 @@
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
+#include <omp.h>
+
+#include "bench_utils.h"
+
+using namespace hnswlib;
+using namespace ivfhnsw;
+
+//=========================================================
+// Recall/QPS benchmark of a constructed IVF-HNSW index
+//=========================================================
+// Loads the index built by a test once and sweeps the grid
+// of the comma-separated search parameters, e.g.
+//     -nprobe 32,64,128 -efSearch 80,160 -pruning on,off
+// For each configuration it measures:
+//  - recall@1, @10 and @100 (for the ones <= k)
+//  - single-thread latency: mean, p50 and p99
+//  - QPS of the parallel batch search on <nthreads> threads
+// and appends a row to the CSV <path_csv>, so the runs of
+// several versions of the code (-label) can be compared
+//=========================================================
+
+int main(int argc, char **argv)
+{
+    //===============
+    // Parse Options
+    //===============
+    Parser opt = Parser(argc, argv);
+    if (opt.nprobe_values.empty() || opt.max_codes_values.empty() || opt.efSearch_values.empty()) {
+        std::cout << "-nprobe, -max_codes and -efSearch are required" << std::endl;
+        exit(1);
+    }
+    hnswlib::set_memory_policy(opt.memory_policy);
+    if (opt.memory_policy.numa != hnswlib::NUMA_NONE)
+        hnswlib::pin_threads_to_numa_nodes();
+
+    // The benchmark only searches, all the models are built by the tests
+    std::vector<idx_t> massQA = load_groundtruth(opt);
+    std::vector<float> massQ = load_queries(opt);
+    IndexIVF_HNSW *index = load_index(opt);
+    IndexIVF_HNSW_Grouping *grouping_index = dynamic_cast<IndexIVF_HNSW_Grouping *>(index);
+
+    if (opt.nthreads > 0)
+        omp_set_num_threads(opt.nthreads);
+    const size_t nthreads = opt.nthreads > 0 ? opt.nthreads : omp_get_max_threads();
+
+    //============
+    // Open CSV
+    //============
+    std::ofstream csv;
+    if (opt.path_csv) {
+        const bool new_file = !exists(opt.path_csv);
+        csv.open(opt.path_csv, std::ios::app);
+        if (!csv) {
+            std::cout << "Could not open " << opt.path_csv << std::endl;
+            exit(1);
+        }
+        if (new_file)
+            csv << "label,index,nq,k,nprobe,max_codes,efSearch,pruning,k_factor,"
+                   "recall@1,recall@10,recall@100,mean_us,p50_us,p99_us,nthreads,qps" << std::endl;
+    }
+
+    std::vector<float> distances(opt.nq * opt.k);
+    std::vector<long> labels(opt.nq * opt.k);
+    std::vector<float> batch_distances(opt.nq * opt.k);
+    std::vector<long> batch_labels(opt.nq * opt.k);
+
+    // Warm up the caches and the page tables with the first configuration
+    index->nprobe = opt.nprobe_values[0];
+    index->max_codes = opt.max_codes_values[0];
+    index->quantizer->efSearch = opt.efSearch_values[0];
+    index->search(opt.nq, massQ.data(), opt.k, batch_distances.data(), batch_labels.data());
+
+    std::cout << "label,index,nq,k,nprobe,max_codes,efSearch,pruning,k_factor,"
+                 "recall@1,recall@10,recall@100,mean_us,p50_us,p99_us,nthreads,qps" << std::endl;
+
+    //=========================
+    // Sweep search parameters
+    //=========================
+    // Pruning only exists in the grouping index
+    std::vector<bool> pruning_values(1, false);
+    if (grouping_index && !opt.pruning_values.empty())
+        pruning_values = opt.pruning_values;
+
+    for (size_t nprobe : opt.nprobe_values)
+    for (size_t max_codes : opt.max_codes_values)
+    for (size_t efSearch : opt.efSearch_values)
+    for (bool do_pruning : pruning_values) {
+        SearchParams params;
+        params.nprobe = nprobe;
+        params.max_codes = max_codes;
+        params.efSearch = efSearch;
+        params.do_pruning = do_pruning;
+        index->set_search_params(params);
+
+        // Latency of each query on a single thread
+        const Latencies latencies = search_timed(index, opt.nq, massQ.data(), opt.k, distances.data(), labels.data());
+
+        // Throughput of the parallel batch search
+        StopW stopw = StopW();
+        index->search(opt.nq, massQ.data(), opt.k, batch_distances.data(), batch_labels.data());
+        const double qps = opt.nq * 1e6 / stopw.getElapsedTimeMicro();
+
+        std::ostringstream row;
+        row << opt.label << "," << (grouping_index ? "grouping" : "ivfhnsw") << "," << opt.nq << "," << opt.k << ","
+            << nprobe << "," << max_codes << "," << efSearch << "," << (do_pruning ? "on" : "off") << ","
+            << opt.k_factor;
+        for (size_t r : {1, 10, 100}) {
+            row << ",";
+            if (r <= opt.k)
+                row << recall_at(r, opt.nq, opt.k, labels.data(), massQA.data(), opt.ngt);
+        }
+        row << "," << latencies.mean_us << "," << latencies.p50_us << "," << latencies.p99_us
+            << "," << nthreads << "," << qps;
+
+        std::cout << row.str() << std::endl;
+        if (csv.is_open())
+            csv << row.str() << std::endl;
+    }
+
+    delete index;
+    return 0;
+}
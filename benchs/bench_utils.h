@@ -0,0 +1,153 @@
+#ifndef IVF_HNSW_LIB_BENCH_UTILS_H
+#define IVF_HNSW_LIB_BENCH_UTILS_H
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <stdlib.h>
+#include <algorithm>
+
+#include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/Parser.h>
+
+//=================================================
+// Helpers of the benchmark and the tuner: loading
+// of the index built by the tests, timed search
+// and recall of the sorted results
+//=================================================
+namespace ivfhnsw {
+
+    inline std::vector<hnswlib::idx_t> load_groundtruth(const Parser &opt)
+    {
+        std::cout << "Loading groundtruth from " << opt.path_gt << std::endl;
+        std::vector<hnswlib::idx_t> massQA(opt.nq * opt.ngt);
+        std::ifstream gt_input(opt.path_gt, std::ios::binary);
+        readXvec<hnswlib::idx_t>(gt_input, massQA.data(), opt.ngt, opt.nq);
+        return massQA;
+    }
+
+    inline std::vector<float> load_queries(const Parser &opt)
+    {
+        std::cout << "Loading queries from " << opt.path_q << std::endl;
+        std::vector<float> massQ(opt.nq * opt.d);
+        std::ifstream query_input(opt.path_q, std::ios::binary);
+        if (strstr(opt.path_q, ".bvecs"))
+            readXvecFvec<uint8_t>(query_input, massQ.data(), opt.d, opt.nq);
+        else
+            readXvec<float>(query_input, massQ.data(), opt.d, opt.nq);
+        return massQ;
+    }
+
+    /** Load the index constructed by a test, the grouping index if nsubc is set
+      *
+      * The graph, the codebooks and the index have to exist. The quantizer is prepared for
+      * the search as in the tests: rotated, reordered, compressed and replicated by the options.
+    */
+    inline IndexIVF_HNSW *load_index(const Parser &opt)
+    {
+        for (const char *path : {opt.path_info, opt.path_edges, opt.path_pq, opt.path_norm_pq, opt.path_index})
+            if (!exists(path)) {
+                std::cout << path << " does not exist, construct the index by the test first" << std::endl;
+                exit(1);
+            }
+
+        IndexIVF_HNSW *index;
+        if (opt.nsubc > 0)
+            index = new IndexIVF_HNSW_Grouping(opt.d, opt.nc, opt.code_size, opt.nbits, opt.nsubc, opt.metric);
+        else
+            index = new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, opt.nbits, 65536, opt.metric);
+        index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction);
+        if (opt.reorder != hnswlib::REORDER_NONE)
+            index->quantizer->reorder(opt.reorder);
+        index->do_opq = opt.do_opq;
+
+        std::cout << "Loading Residual PQ codebook from " << opt.path_pq << std::endl;
+        if (index->pq) delete index->pq;
+        index->pq = faiss::read_ProductQuantizer(opt.path_pq);
+        if (opt.do_opq) {
+            std::cout << "Loading Residual OPQ rotation matrix from " << opt.path_opq_matrix << std::endl;
+            index->opq_matrix = dynamic_cast<faiss::LinearTransform *>(faiss::read_VectorTransform(opt.path_opq_matrix));
+        }
+        std::cout << "Loading Norm PQ codebook from " << opt.path_norm_pq << std::endl;
+        if (index->norm_pq) delete index->norm_pq;
+        index->norm_pq = faiss::read_ProductQuantizer(opt.path_norm_pq);
+
+        std::cout << "Loading index from " << opt.path_index << std::endl;
+        index->read(opt.path_index);
+
+        if (opt.do_opq)
+            index->rotate_quantizer();
+        if (opt.quantizer_storage != hnswlib::STORAGE_FLOAT)
+            index->quantizer->compress(opt.quantizer_storage);
+        if (opt.memory_policy.numa == hnswlib::NUMA_REPLICATE)
+            index->quantizer->replicate();
+        std::cout << hnswlib::memory_policy_report();
+
+        if (opt.k_factor > 0) {
+            std::cout << "Re-ranking " << opt.k_factor * opt.k << " candidates by the base vectors from " << opt.path_base << std::endl;
+            index->load_refine_vectors(opt.path_base, opt.k_factor);
+        }
+        return index;
+    }
+
+    /// The search returns the results of each query as a heap, sort them by the distance for recall@r
+    inline void sort_results(size_t nq, size_t k, float *distances, long *labels)
+    {
+        std::vector<std::pair<float, long>> results(k);
+        for (size_t i = 0; i < nq; i++) {
+            for (size_t j = 0; j < k; j++)
+                results[j] = std::make_pair(distances[i * k + j], labels[i * k + j]);
+            std::sort(results.begin(), results.end());
+            for (size_t j = 0; j < k; j++) {
+                distances[i * k + j] = results[j].first;
+                labels[i * k + j] = results[j].second;
+            }
+        }
+    }
+
+    /// Fraction of the queries, whose nearest neighbour is among the first r sorted results
+    inline float recall_at(size_t r, size_t nq, size_t k, const long *labels, const hnswlib::idx_t *gt, size_t ngt)
+    {
+        size_t correct = 0;
+        for (size_t i = 0; i < nq; i++)
+            for (size_t j = 0; j < std::min(r, k); j++)
+                if (labels[i * k + j] == gt[i * ngt]) {
+                    correct++;
+                    break;
+                }
+        return 1.0f * correct / nq;
+    }
+
+    /// Single-thread latencies of the queries
+    struct Latencies
+    {
+        double mean_us;
+        double p50_us;
+        double p99_us;
+    };
+
+    /// Search the nq queries one by one on the calling thread and sort their results
+    inline Latencies search_timed(const IndexIVF_HNSW *index, size_t nq, const float *x, size_t k,
+                                  float *distances, long *labels)
+    {
+        std::vector<double> times(nq);
+        IndexIVF_HNSW::SearchContext ctx;
+        for (size_t i = 0; i < nq; i++) {
+            StopW stopw = StopW();
+            index->search(k, x + i * index->d, distances + i * k, labels + i * k, ctx);
+            times[i] = stopw.getElapsedTimeMicro();
+        }
+        sort_results(nq, k, distances, labels);
+
+        Latencies latencies;
+        latencies.mean_us = 0;
+        for (double time : times)
+            latencies.mean_us += time;
+        latencies.mean_us /= nq;
+        std::sort(times.begin(), times.end());
+        latencies.p50_us = times[nq / 2];
+        latencies.p99_us = times[std::min(nq - 1, nq * 99 / 100)];
+        return latencies;
+    }
+}
+#endif //IVF_HNSW_LIB_BENCH_UTILS_H
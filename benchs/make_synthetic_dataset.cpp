@@ -0,0 +1,282 @@
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <stdlib.h>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <omp.h>
+
+#include <faiss/Clustering.h>
+#include <faiss/utils.h>
+
+#include <ivf-hnsw/utils.h>
+
+#ifndef FINTEGER
+#define FINTEGER long
+#endif
+
+extern "C" {
+int sgemm_(const char *transa, const char *transb, FINTEGER *m, FINTEGER *n, FINTEGER *k,
+           const float *alpha, const float *a, FINTEGER *lda, const float *b, FINTEGER *ldb,
+           float *beta, float *c, FINTEGER *ldc);
+}
+
+using namespace ivfhnsw;
+
+//==========================================================
+// Synthetic dataset for the tests and the benchmark
+//==========================================================
+// Draws the base, learn and query sets from a mixture of
+// <ncomponents> Gaussians, trains <nc> coarse centroids by
+// k-means on the learn set and computes the exact <ngt>
+// nearest neighbours of each query. The files are written
+// to <path_data>/<name>_{base,learn,queries,centroids}.fvecs
+// and <path_data>/<name>_groundtruth.ivecs, which are
+// passed to the DEEP1B tests and bench_search as they are.
+// The base set is generated and searched in blocks, so nb
+// is only bounded by the disk
+//==========================================================
+struct Options
+{
+    size_t d;             ///< Vector dimension
+    size_t nb;            ///< Number of base vectors
+    size_t nt;            ///< Number of learn vectors
+    size_t nq;            ///< Number of queries
+    size_t ngt;           ///< Number of groundtruth neighbours per query
+    size_t nc;            ///< Number of coarse centroids, 0 - do not train them
+    size_t ncomponents;   ///< Number of Gaussians in the mixture
+    float spread;         ///< Std of the Gaussian means, the std of each Gaussian is 1
+    size_t seed;
+    const char *path_data;
+    const char *name;
+
+    Options(int argc, char **argv)
+    {
+        d = 96;
+        nb = 1000000;
+        nt = 100000;
+        nq = 10000;
+        ngt = 100;
+        nc = 0;
+        ncomponents = 1000;
+        spread = 2;
+        seed = 1234;
+        path_data = ".";
+        name = "synthetic";
+
+        for (int i = 1; i < argc; i++) {
+            char *a = argv[i];
+            if (!strcmp (a, "-h") || !strcmp (a, "--help") || i == argc-1)
+                usage(argv[0]);
+            else if (!strcmp (a, "-d")) sscanf(argv[++i], "%zu", &d);
+            else if (!strcmp (a, "-nb")) sscanf(argv[++i], "%zu", &nb);
+            else if (!strcmp (a, "-nt")) sscanf(argv[++i], "%zu", &nt);
+            else if (!strcmp (a, "-nq")) sscanf(argv[++i], "%zu", &nq);
+            else if (!strcmp (a, "-ngt")) sscanf(argv[++i], "%zu", &ngt);
+            else if (!strcmp (a, "-nc")) sscanf(argv[++i], "%zu", &nc);
+            else if (!strcmp (a, "-ncomponents")) sscanf(argv[++i], "%zu", &ncomponents);
+            else if (!strcmp (a, "-spread")) sscanf(argv[++i], "%f", &spread);
+            else if (!strcmp (a, "-seed")) sscanf(argv[++i], "%zu", &seed);
+            else if (!strcmp (a, "-path_data")) path_data = argv[++i];
+            else if (!strcmp (a, "-name")) name = argv[++i];
+            else usage(argv[0]);
+        }
+        if (ngt > nb || nc > nt) {
+            std::cout << "ngt must not exceed nb and nc must not exceed nt" << std::endl;
+            exit(1);
+        }
+    }
+
+    void usage(const char *cmd)
+    {
+        printf("Usage: %s [options]\n"
+               "    -d #              Vector dimension (default 96)\n"
+               "    -nb #             Number of base vectors (default 1000000)\n"
+               "    -nt #             Number of learn vectors (default 100000)\n"
+               "    -nq #             Number of queries (default 10000)\n"
+               "    -ngt #            Number of groundtruth neighbours per query (default 100)\n"
+               "    -nc #             Number of coarse centroids trained by k-means on the learn set (default 0, none)\n"
+               "    -ncomponents #    Number of Gaussians in the mixture (default 1000)\n"
+               "    -spread #         Std of the Gaussian means, relative to the std of a Gaussian (default 2)\n"
+               "    -seed #           Seed of the generator (default 1234)\n"
+               "    -path_data dir    Directory of the output files (default .)\n"
+               "    -name name        Prefix of the output files (default synthetic)\n",
+               cmd);
+        exit(0);
+    }
+
+    std::string path(const char *suffix) const
+    {
+        return std::string(path_data) + "/" + name + "_" + suffix;
+    }
+};
+
+/** Draw vectors number i0..i0+n-1 of a stream
+  *
+  * Each vector has its own generator seeded by the seed, the stream and the number,
+  * so the sets do not depend on the block size and the number of threads.
+*/
+static void draw_vectors(const Options &opt, const std::vector<float> &means, size_t stream,
+                         size_t i0, size_t n, float *x)
+{
+#pragma omp parallel for
+    for (size_t i = 0; i < n; i++) {
+        std::mt19937_64 rng(opt.seed * 1000003 + stream * 7919 + (i0 + i) * 104729);
+        std::normal_distribution<float> normal(0, 1);
+        const float *mean = means.data() + (rng() % opt.ncomponents) * opt.d;
+        for (size_t j = 0; j < opt.d; j++)
+            x[i * opt.d + j] = mean[j] + normal(rng);
+    }
+}
+
+/// Write the vectors number 0..n-1 of the stream to the file in blocks
+static void write_vectors(const Options &opt, const std::vector<float> &means, size_t stream,
+                          size_t n, const std::string &path)
+{
+    std::cout << "Writing " << n << " vectors to " << path << std::endl;
+    std::ofstream output(path, std::ios::binary);
+    const size_t block_size = 65536;
+    std::vector<float> block(block_size * opt.d);
+    for (size_t i0 = 0; i0 < n; i0 += block_size) {
+        const size_t nblock = std::min(block_size, n - i0);
+        draw_vectors(opt, means, stream, i0, nblock, block.data());
+        writeXvec<float>(output, block.data(), opt.d, nblock);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt(argc, argv);
+    enum { STREAM_BASE = 1, STREAM_LEARN, STREAM_QUERIES };
+
+    //==================
+    // Mixture centers
+    //==================
+    std::vector<float> means(opt.ncomponents * opt.d);
+    {
+        std::mt19937_64 rng(opt.seed);
+        std::normal_distribution<float> normal(0, opt.spread);
+        for (float &x : means)
+            x = normal(rng);
+    }
+
+    //============================
+    // Learn set and the centroids
+    //============================
+    write_vectors(opt, means, STREAM_LEARN, opt.nt, opt.path("learn.fvecs"));
+    if (opt.nc > 0) {
+        std::vector<float> learn(opt.nt * opt.d);
+        draw_vectors(opt, means, STREAM_LEARN, 0, opt.nt, learn.data());
+
+        std::cout << "Training " << opt.nc << " centroids" << std::endl;
+        std::vector<float> centroids(opt.nc * opt.d);
+        faiss::kmeans_clustering(opt.d, opt.nt, opt.nc, learn.data(), centroids.data());
+
+        std::cout << "Writing centroids to " << opt.path("centroids.fvecs") << std::endl;
+        std::ofstream output(opt.path("centroids.fvecs"), std::ios::binary);
+        writeXvec<float>(output, centroids.data(), opt.d, opt.nc);
+    }
+
+    //=========
+    // Queries
+    //=========
+    std::vector<float> queries(opt.nq * opt.d);
+    draw_vectors(opt, means, STREAM_QUERIES, 0, opt.nq, queries.data());
+    {
+        std::cout << "Writing " << opt.nq << " queries to " << opt.path("queries.fvecs") << std::endl;
+        std::ofstream output(opt.path("queries.fvecs"), std::ios::binary);
+        writeXvec<float>(output, queries.data(), opt.d, opt.nq);
+    }
+    std::vector<float> query_norms(opt.nq);
+    faiss::fvec_norms_L2sqr(query_norms.data(), queries.data(), opt.d, opt.nq);
+
+    //===========================================
+    // Base set and the exact nearest neighbours
+    //===========================================
+    // Each block of the base set is written and compared with all queries by BLAS,
+    // a max-heap of ngt results per query is kept across the blocks
+    std::cout << "Writing " << opt.nb << " vectors to " << opt.path("base.fvecs")
+              << " and computing the groundtruth" << std::endl;
+    std::ofstream base_output(opt.path("base.fvecs"), std::ios::binary);
+
+    const size_t block_size = 65536;
+    const size_t query_block_size = 256;
+    const size_t ip_block_size = 4096;  // Base vectors per product with a query block, 4 MB per thread
+    std::vector<float> block(block_size * opt.d);
+    std::vector<float> block_norms(block_size);
+    std::vector<std::pair<float, int>> heaps(opt.nq * opt.ngt);
+    std::vector<size_t> heap_sizes(opt.nq, 0);
+
+    // Inner products of a query block with a part of the base block, allocated once per thread
+    std::vector<std::vector<float>> ip_blocks(omp_get_max_threads());
+
+    StopW stopw = StopW();
+    for (size_t j0 = 0; j0 < opt.nb; j0 += block_size) {
+        if ((j0 / block_size) % 16 == 0)
+            std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
+                      << (100. * j0) / opt.nb << "%" << std::endl;
+
+        const size_t nblock = std::min(block_size, opt.nb - j0);
+        draw_vectors(opt, means, STREAM_BASE, j0, nblock, block.data());
+        writeXvec<float>(base_output, block.data(), opt.d, nblock);
+        faiss::fvec_norms_L2sqr(block_norms.data(), block.data(), opt.d, nblock);
+
+#pragma omp parallel
+        {
+            std::vector<float> &ip_block = ip_blocks[omp_get_thread_num()];
+            ip_block.resize(query_block_size * ip_block_size);
+
+#pragma omp for schedule(dynamic)
+            for (size_t i0 = 0; i0 < opt.nq; i0 += query_block_size) {
+                const size_t i1 = std::min(opt.nq, i0 + query_block_size);
+
+                for (size_t jb0 = 0; jb0 < nblock; jb0 += ip_block_size) {
+                    const size_t njb = std::min(ip_block_size, nblock - jb0);
+
+                    // ip_block[i * njb + j] = <q_i, x_{jb0 + j}>
+                    {
+                        float one = 1, zero = 0;
+                        FINTEGER nyi = njb, nxi = i1 - i0, di = opt.d;
+                        sgemm_("Transpose", "Not transpose", &nyi, &nxi, &di, &one, block.data() + jb0 * opt.d, &di,
+                               queries.data() + i0 * opt.d, &di, &zero, ip_block.data(), &nyi);
+                    }
+                    for (size_t i = i0; i < i1; i++) {
+                        const float *ip = ip_block.data() + (i - i0) * njb;
+                        std::pair<float, int> *heap = heaps.data() + i * opt.ngt;
+                        size_t &heap_size = heap_sizes[i];
+
+                        for (size_t j = 0; j < njb; j++) {
+                            const float dist = query_norms[i] + block_norms[jb0 + j] - 2 * ip[j];
+                            const int id = (int) (j0 + jb0 + j);
+                            if (heap_size < opt.ngt) {
+                                heap[heap_size++] = std::make_pair(dist, id);
+                                std::push_heap(heap, heap + heap_size);
+                            } else if (dist < heap[0].first) {
+                                std::pop_heap(heap, heap + opt.ngt);
+                                heap[opt.ngt - 1] = std::make_pair(dist, id);
+                                std::push_heap(heap, heap + opt.ngt);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    base_output.close();
+
+    std::cout << "Writing groundtruth to " << opt.path("groundtruth.ivecs") << std::endl;
+    {
+        std::ofstream output(opt.path("groundtruth.ivecs"), std::ios::binary);
+        std::vector<int> gt(opt.ngt);
+        for (size_t i = 0; i < opt.nq; i++) {
+            std::pair<float, int> *heap = heaps.data() + i * opt.ngt;
+            std::sort_heap(heap, heap + opt.ngt);
+            for (size_t j = 0; j < opt.ngt; j++)
+                gt[j] = heap[j].second;
+            writeXvec<int>(output, gt.data(), opt.ngt);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,185 @@
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <algorithm>
+
+#include "bench_utils.h"
+
+using namespace hnswlib;
+using namespace ivfhnsw;
+
+//=========================================================
+// Auto-tuning of the search parameters
+//=========================================================
+// Searches the grid of the comma-separated -nprobe,
+// -max_codes, -efSearch and -pruning for the configurations
+// with recall@k >= -target_recall or p99 <= -target_p99 us
+// by successive halving: all configurations are measured on
+// a small subset of the held-out queries, the better half
+// on a twice larger subset and so on, until the survivors
+// run on all queries. The Pareto-optimal configurations of
+// the last round (recall vs latency) are written to
+// -path_params with the constraint, as the survivors are
+// chosen for it. The tests choose one of them by the same
+// kind of constraint
+//=========================================================
+
+static const size_t min_survivors = 8;   ///< Halving stops at this number of configurations
+static const size_t min_queries = 100;   ///< Queries of the first round
+
+/// Measure recall@k and the single-thread latencies of the configuration on the first nq queries
+static void evaluate(IndexIVF_HNSW *index, SearchParams &params, size_t nq, const Parser &opt,
+                     const std::vector<float> &queries, const std::vector<idx_t> &groundtruth)
+{
+    std::vector<float> distances(nq * opt.k);
+    std::vector<long> labels(nq * opt.k);
+
+    index->set_search_params(params);
+    const Latencies latencies = search_timed(index, nq, queries.data(), opt.k, distances.data(), labels.data());
+    params.recall = recall_at(opt.k, nq, opt.k, labels.data(), groundtruth.data(), opt.ngt);
+    params.mean_us = latencies.mean_us;
+    params.p99_us = latencies.p99_us;
+}
+
+/** Whether the configuration satisfies the constraints on nq queries
+  *
+  * The recall measured on a subset is noisy, so it may be up to two standard errors below the target.
+*/
+static bool feasible(const SearchParams &p, const Parser &opt, size_t nq)
+{
+    const float t = opt.target_recall;
+    if (t > 0 && p.recall + 2 * std::sqrt(t * (1 - t) / nq) < t)
+        return false;
+    return opt.target_p99 <= 0 || p.p99_us <= opt.target_p99;
+}
+
+/// Order of the configurations: the feasible ones first, then the closest to the constraints
+static bool better(const SearchParams &a, const SearchParams &b, const Parser &opt, size_t nq)
+{
+    const bool feasible_a = feasible(a, opt, nq);
+    const bool feasible_b = feasible(b, opt, nq);
+    if (feasible_a != feasible_b)
+        return feasible_a;
+    if (feasible_a)
+        return opt.target_recall > 0 ? a.mean_us < b.mean_us : a.recall > b.recall;
+    return opt.target_recall > 0 ? a.recall > b.recall : a.p99_us < b.p99_us;
+}
+
+int main(int argc, char **argv)
+{
+    //===============
+    // Parse Options
+    //===============
+    Parser opt = Parser(argc, argv);
+    if (opt.nprobe_values.empty() || opt.max_codes_values.empty() || opt.efSearch_values.empty()) {
+        std::cout << "-nprobe, -max_codes and -efSearch are required" << std::endl;
+        exit(1);
+    }
+    if (opt.target_recall <= 0 && opt.target_p99 <= 0) {
+        std::cout << "-target_recall or -target_p99 is required" << std::endl;
+        exit(1);
+    }
+    if (!opt.path_params) {
+        std::cout << "-path_params is required" << std::endl;
+        exit(1);
+    }
+    hnswlib::set_memory_policy(opt.memory_policy);
+    if (opt.memory_policy.numa != hnswlib::NUMA_NONE)
+        hnswlib::pin_threads_to_numa_nodes();
+
+    std::vector<idx_t> massQA = load_groundtruth(opt);
+    std::vector<float> massQ = load_queries(opt);
+    IndexIVF_HNSW *index = load_index(opt);
+    const bool grouping = dynamic_cast<IndexIVF_HNSW_Grouping *>(index) != nullptr;
+
+    //=================
+    // Candidate grid
+    //=================
+    // Pruning only exists in the grouping index
+    std::vector<bool> pruning_values(1, false);
+    if (grouping && !opt.pruning_values.empty())
+        pruning_values = opt.pruning_values;
+
+    std::vector<SearchParams> candidates;
+    for (size_t nprobe : opt.nprobe_values)
+    for (size_t max_codes : opt.max_codes_values)
+    for (size_t efSearch : opt.efSearch_values)
+    for (bool do_pruning : pruning_values) {
+        SearchParams params;
+        params.nprobe = nprobe;
+        params.max_codes = max_codes;
+        params.efSearch = efSearch;
+        params.do_pruning = do_pruning;
+        candidates.push_back(params);
+    }
+
+    // Warm up the caches and the page tables
+    {
+        std::vector<float> distances(opt.nq * opt.k);
+        std::vector<long> labels(opt.nq * opt.k);
+        index->set_search_params(candidates[0]);
+        index->search(opt.nq, massQ.data(), opt.k, distances.data(), labels.data());
+    }
+
+    //====================
+    // Successive halving
+    //====================
+    size_t nrounds = 0;
+    for (size_t n = candidates.size(); n > min_survivors; n = (n + 1) / 2)
+        nrounds++;
+
+    StopW stopw = StopW();
+    for (size_t round = 0; round <= nrounds; round++) {
+        const size_t nq = round == nrounds ? opt.nq
+                                           : std::min(opt.nq, std::max(min_queries, opt.nq >> (nrounds - round)));
+        for (SearchParams &params : candidates)
+            evaluate(index, params, nq, opt, massQ, massQA);
+        std::sort(candidates.begin(), candidates.end(),
+                  [&](const SearchParams &a, const SearchParams &b) { return better(a, b, opt, nq); });
+
+        const SearchParams &best = candidates[0];
+        std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] Round " << round << ": "
+                  << candidates.size() << " configurations on " << nq << " queries, best: nprobe " << best.nprobe
+                  << ", max_codes " << best.max_codes << ", efSearch " << best.efSearch
+                  << ", pruning " << (best.do_pruning ? "on" : "off") << ", recall@" << opt.k << " " << best.recall
+                  << ", mean " << best.mean_us << " us, p99 " << best.p99_us << " us" << std::endl;
+
+        if (round < nrounds)
+            candidates.resize(std::max(min_survivors, (candidates.size() + 1) / 2));
+    }
+
+    //==============================
+    // Pareto-optimal configurations
+    //==============================
+    // A configuration is kept if no faster one is at least as accurate. The speed is the mean latency
+    // for the recall constraint and the p99 latency for the latency constraint
+    const bool by_p99 = opt.target_recall <= 0;
+    auto latency = [by_p99](const SearchParams &p) { return by_p99 ? p.p99_us : p.mean_us; };
+    std::sort(candidates.begin(), candidates.end(), [&](const SearchParams &a, const SearchParams &b) {
+        return latency(a) < latency(b) || (latency(a) == latency(b) && a.recall > b.recall);
+    });
+    TunedSearchParams tuned;
+    tuned.target_recall = opt.target_recall;
+    tuned.target_p99 = opt.target_p99;
+    std::vector<SearchParams> &pareto = tuned.params;
+    for (const SearchParams &params : candidates)
+        if (pareto.empty() || params.recall > pareto.back().recall)
+            pareto.push_back(params);
+
+    const std::string comment = "recall@" + std::to_string(opt.k) + " of " + std::to_string(opt.nq)
+                                + " queries, latency of a single thread";
+    std::cout << "Saving " << pareto.size() << " Pareto-optimal configurations to " << opt.path_params << std::endl;
+    write_search_params(opt.path_params, tuned, comment.c_str());
+
+    const SearchParams selected = select_search_params(tuned, opt.target_recall, opt.target_p99);
+    if (!feasible(selected, opt, opt.nq))
+        std::cout << "No configuration satisfies the constraints, extend the grid" << std::endl;
+    std::cout << "Selected: nprobe " << selected.nprobe << ", max_codes " << selected.max_codes
+              << ", efSearch " << selected.efSearch << ", pruning " << (selected.do_pruning ? "on" : "off")
+              << ", recall@" << opt.k << " " << selected.recall << ", mean " << selected.mean_us
+              << " us, p99 " << selected.p99_us << " us" << std::endl;
+
+    delete index;
+    return 0;
+}
@@ -0,0 +1,98 @@
+#!/bin/bash
+
+# Sweeps the search parameters of the index built by run_deep1b_grouping.sh
+# and appends recall, latency and QPS of each configuration to ${path_csv}
+
+################################
+# HNSW construction parameters #
+################################
+
+M="16"                # Min number of edges per point
+efConstruction="500"  # Max number of candidate vertices in priority queue to observe during construction
+
+###################
+# Data parameters #
+###################
+
+nc="999973"           # Number of centroids for HNSW quantizer
+nsubc="64"            # Number of subcentroids per group
+
+nq="10000"            # Number of queries
+ngt="1"               # Number of groundtruth neighbours per query
+
+d="96"                # Vector dimension
+
+#################
+# PQ parameters #
+#################
+
+code_size="16"        # Code size per vector in bytes
+opq="off"             # Turn on/off opq encoding
+
+#####################
+# Search parameters #
+#####################
+# Comma-separated lists, the benchmark runs each combination
+
+k="100"                         # Number of the closest vertices to search, recall@1,10,100 are reported
+nprobe="32,64,128,210"          # Number of probes at query time
+max_codes="10000,30000,100000"  # Max number of codes to visit to do a query
+efSearch="80,130,210"           # Max number of candidate vertices in priority queue to observe during seaching
+pruning="on,off"                # Turn on/off pruning
+
+########################
+# Benchmark parameters #
+########################
+
+nthreads="0"                                        # Threads of the QPS measurement, 0 - all
+label="$(git rev-parse --short HEAD 2>/dev/null)"  # Name of the run in the CSV
+
+#########
+# Paths #
+#########
+
+path_data="${PWD}/data/DEEP1B"
+path_model="${PWD}/models/DEEP1B"
+
+path_gt="${path_data}/deep1B_groundtruth.ivecs"
+path_q="${path_data}/deep1B_queries.fvecs"
+path_centroids="${path_data}/centroids_deep1b.fvecs"
+
+path_edges="${path_model}/hnsw_M${M}_ef${efConstruction}.ivecs"
+path_info="${path_model}/hnsw_M${M}_ef${efConstruction}.bin"
+
+path_pq="${path_model}/pq${code_size}_nsubc${nsubc}.pq"
+path_norm_pq="${path_model}/norm_pq${code_size}_nsubc${nsubc}.pq"
+path_index="${path_model}/ivfhnsw_PQ${code_size}_nsubc${nsubc}.index"
+
+path_csv="${PWD}/bench_deep1b_grouping.csv"
+
+#######
+# Run #
+#######
+${PWD}/bin/bench_search \
+                                -M ${M} \
+                                -efConstruction ${efConstruction} \
+                                -nc ${nc} \
+                                -nsubc ${nsubc} \
+                                -nq ${nq} \
+                                -ngt ${ngt} \
+                                -d ${d} \
+                                -code_size ${code_size} \
+                                -opq ${opq} \
+                                -k ${k} \
+                                -nprobe ${nprobe} \
+                                -max_codes ${max_codes} \
+                                -efSearch ${efSearch} \
+                                -pruning ${pruning} \
+                                -nthreads ${nthreads} \
+                                -label "${label}" \
+                                -path_gt ${path_gt} \
+                                -path_q ${path_q} \
+                                -path_centroids ${path_centroids} \
+                                -path_edges ${path_edges} \
+                                -path_info ${path_info} \
+                                -path_pq ${path_pq} \
+                                -path_norm_pq ${path_norm_pq} \
+                                -path_index ${path_index} \
+                                -path_csv ${path_csv}
@@ -0,0 +1,120 @@
+#!/bin/bash
+
+# Generates a 1M synthetic dataset (if it does not exist) and runs IVF-HNSW + Grouping on it,
+# the full pipeline takes minutes on a laptop
+
+################################
+# HNSW construction parameters #
+################################
+
+M="16"                # Min number of edges per point
+efConstruction="500"  # Max number of candidate vertices in priority queue to observe during construction
+
+###################
+# Data parameters #
+###################
+
+nb="1000000"          # Number of base vectors
+
+nt="200000"           # Number of learn vectors
+nsubt="65536"         # Number of learn vectors to train (random subset of the learn set)
+
+nc="16384"            # Number of centroids for HNSW quantizer
+nsubc="32"            # Number of subcentroids per group
+
+nq="10000"            # Number of queries
+ngt="100"             # Number of groundtruth neighbours per query
+
+d="96"                # Vector dimension
+
+ncomponents="4096"    # Number of Gaussians in the mixture
+spread="2"            # Std of the Gaussian means, relative to the std of a Gaussian
+
+#################
+# PQ parameters #
+#################
+
+code_size="16"        # Code size per vector in bytes
+opq="off"             # Turn on/off opq encoding
+
+#####################
+# Search parameters #
+#####################
+
+k="10"                # Number of the closest vertices to search
+nprobe="64"           # Number of probes at query time
+max_codes="30000"     # Max number of codes to visit to do a query
+efSearch="100"        # Max number of candidate vertices in priority queue to observe during seaching
+pruning="on"          # Turn on/off pruning
+
+#########
+# Paths #
+#########
+
+path_data="${PWD}/data/SYNTHETIC"
+path_model="${PWD}/models/SYNTHETIC"
+name="synthetic_d${d}_nb${nb}"
+
+path_base="${path_data}/${name}_base.fvecs"
+path_learn="${path_data}/${name}_learn.fvecs"
+path_gt="${path_data}/${name}_groundtruth.ivecs"
+path_q="${path_data}/${name}_queries.fvecs"
+path_centroids="${path_data}/${name}_centroids.fvecs"
+
+path_precomputed_idxs="${path_data}/precomputed_idxs_${name}_nc${nc}.ivecs"
+
+path_edges="${path_model}/hnsw_nc${nc}_M${M}_ef${efConstruction}.ivecs"
+path_info="${path_model}/hnsw_nc${nc}_M${M}_ef${efConstruction}.bin"
+
+path_pq="${path_model}/pq${code_size}_nsubc${nsubc}.pq"
+path_norm_pq="${path_model}/norm_pq${code_size}_nsubc${nsubc}.pq"
+path_index="${path_model}/ivfhnsw_PQ${code_size}_nsubc${nsubc}.index"
+
+#######
+# Run #
+#######
+mkdir -p ${path_data} ${path_model}
+
+if [ ! -f ${path_centroids} ]; then
+    ${PWD}/bin/make_synthetic_dataset \
+                                -d ${d} \
+                                -nb ${nb} \
+                                -nt ${nt} \
+                                -nq ${nq} \
+                                -ngt ${ngt} \
+                                -nc ${nc} \
+                                -ncomponents ${ncomponents} \
+                                -spread ${spread} \
+                                -path_data ${path_data} \
+                                -name ${name}
+fi
+
+${PWD}/bin/test_ivfhnsw_grouping_deep1b \
+                                -M ${M} \
+                                -efConstruction ${efConstruction} \
+                                -nb ${nb} \
+                                -nt ${nt} \
+                                -nsubt ${nsubt} \
+                                -nc ${nc} \
+                                -nsubc ${nsubc} \
+                                -nq ${nq} \
+                                -ngt ${ngt} \
+                                -d ${d} \
+                                -code_size ${code_size} \
+                                -opq ${opq} \
+                                -k ${k} \
+                                -nprobe ${nprobe} \
+                                -max_codes ${max_codes} \
+                                -efSearch ${efSearch} \
+                                -path_base ${path_base} \
+                                -path_learn ${path_learn} \
+                                -path_gt ${path_gt} \
+                                -path_q ${path_q} \
+                                -path_centroids ${path_centroids} \
+                                -path_precomputed_idx ${path_precomputed_idxs} \
+                                -path_edges ${path_edges} \
+                                -path_info ${path_info} \
+                                -path_pq ${path_pq} \
+                                -path_norm_pq ${path_norm_pq} \
+                                -path_index ${path_index} \
+                                -pruning ${pruning}
@@ -6,6 +6,9 @@ namespace hnswlib {
                                      const std::string &dataLocation,
                                      const std::string &edgeLocation)
     {
+        inner_product_ = false;
+        storage_ = STORAGE_FLOAT;
+        float_data_ = nullptr;
         LoadInfo(infoLocation);
         LoadData(dataLocation);
         LoadEdges(edgeLocation);
@@ -27,85 +30,191 @@ namespace hnswlib {
     offset_data = size_links_level0;
 
     std::cout << (data_level0_memory_ ? 1 : 0) << std::endl;
-    data_level0_memory_ = (char *) malloc(maxelements_ * size_data_per_element);
+    data_level0_memory_ = (char *) alloc_memory(maxelements_ * size_data_per_element);
     std::cout << (data_level0_memory_ ? 1 : 0) << std::endl;
 
     std::cout << "Size Mb: " << (maxelements_ * size_data_per_element) / (1000 * 1000) << std::endl;
 
     visitedlistpool = new VisitedListPool(1, maxelements_);
+    link_list_locks_ = std::vector<std::mutex>(maxelements_);
+
+    // Upper levels keep up to M links per element
+    size_links_per_element_ = M * sizeof(idx_t) + sizeof(uint8_t);
+    mult_ = 1 / log(1.0 * M);
+    element_levels_.resize(maxelements_, 0);
+    linkLists_ = (char **) calloc(maxelements_, sizeof(char *));
+    inserted_.resize(maxelements_, false);
 
     enterpoint_node = 0;
+    maxlevel_ = -1;
     cur_element_count = 0;
+    dist_calc = 0;
+    inner_product_ = false;
+    metric_ = 0;
+    storage_ = STORAGE_FLOAT;
+    float_data_ = nullptr;
 }
 
 HierarchicalNSW::~HierarchicalNSW()
 {
-    free(data_level0_memory_);
+    for (size_t i = 0; i < maxelements_; i++)
+        free(linkLists_[i]);
+    free(linkLists_);
+    dropReplicas();
+    free_memory(data_level0_memory_);
+    free_memory(float_data_);
     delete visitedlistpool;
 }
 
+int HierarchicalNSW::getRandomLevel(idx_t cur_c) const
+{
+    // splitmix64 of the id gives a uniform number in (0, 1)
+    uint64_t z = cur_c + 100 + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = z ^ (z >> 31);
+    const double r = ((z >> 11) + 0.5) / 9007199254740992.0;
+
+    const int level = (int) (-log(r) * mult_);
+    return std::min(level, 255);
+}
+
 
-std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(const float *point, size_t ef)
+std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchBaseLayer(idx_t ep, const float *point, size_t ef,
+                                                                              int level, bool lock_links,
+                                                                              SearchCounters *counters)
 {
     VisitedList *vl = visitedlistpool->getFreeVisitedList();
+    std::vector<std::pair<float, idx_t>> topResults;
+    std::vector<std::pair<float, idx_t>> candidateSet;
+
+    searchLayer(ep, point, ef, level, lock_links, vl, topResults, candidateSet, counters);
+
+    visitedlistpool->releaseVisitedList(vl);
+    return std::priority_queue<std::pair<float, idx_t>>(std::less<std::pair<float, idx_t>>(), std::move(topResults));
+}
+
+void HierarchicalNSW::searchLayer(idx_t ep, const float *point, size_t ef, int level, bool lock_links,
+                                  VisitedList *vl, std::vector<std::pair<float, idx_t>> &topResults,
+                                  std::vector<std::pair<float, idx_t>> &candidateSet, SearchCounters *counters)
+{
+    vl->reset();
     vl_type *massVisited = vl->mass;
     vl_type currentV = vl->curV;
-    std::priority_queue<std::pair<float, idx_t >> topResults;
-    std::priority_queue<std::pair<float, idx_t >> candidateSet;
+    topResults.clear();
+    candidateSet.clear();
 
-    float dist = fstdistfunc(point, getDataByInternalId(enterpoint_node));
-    dist_calc++;
+    // The work is counted locally and published once, the searches of many threads do not share a counter
+    size_t ndist = 1;
+    size_t nhops = 0;
+    float dist = distToElement(point, ep);
 
-    topResults.emplace(dist, enterpoint_node);
-    candidateSet.emplace(-dist, enterpoint_node);
-    massVisited[enterpoint_node] = currentV;
+    topResults.emplace_back(dist, ep);
+    candidateSet.emplace_back(-dist, ep);
+    massVisited[ep] = currentV;
     float lowerBound = dist;
 
+    // Both sets are binary max-heaps, the candidates are stored with negated distances
     while (!candidateSet.empty())
     {
-        std::pair<float, idx_t> curr_el_pair = candidateSet.top();
+        std::pair<float, idx_t> curr_el_pair = candidateSet.front();
         if (-curr_el_pair.first > lowerBound)
             break;
 
-        candidateSet.pop();
+        std::pop_heap(candidateSet.begin(), candidateSet.end());
+        candidateSet.pop_back();
         idx_t curNodeNum = curr_el_pair.second;
+        nhops++;
+
+        std::unique_lock<std::mutex> lock;
+        if (lock_links)
+            lock = std::unique_lock<std::mutex>(link_list_locks_[curNodeNum]);
 
-        uint8_t *ll_cur = get_linklist0(curNodeNum);
+        uint8_t *ll_cur = get_linklist(curNodeNum, level);
         size_t size = *ll_cur;
         idx_t *data = (idx_t *)(ll_cur + 1);
 
         _mm_prefetch((char *) (massVisited + *data), _MM_HINT_T0);
         _mm_prefetch((char *) (massVisited + *data + 64), _MM_HINT_T0);
-        _mm_prefetch(getDataByInternalId(*data), _MM_HINT_T0);
+        _mm_prefetch((char *) getCodeByInternalId(*data), _MM_HINT_T0);
 
         for (size_t j = 0; j < size; ++j) {
             size_t tnum = *(data + j);
 
-            _mm_prefetch((char *) (massVisited + *(data + j + 1)), _MM_HINT_T0);
-            _mm_prefetch(getDataByInternalId(*(data + j + 1)), _MM_HINT_T0);
+            // Upper level lists end right after the last link, so the next one is prefetched only if it exists
+            if (j + 1 < size) {
+                _mm_prefetch((char *) (massVisited + *(data + j + 1)), _MM_HINT_T0);
+                _mm_prefetch((char *) getCodeByInternalId(*(data + j + 1)), _MM_HINT_T0);
+            }
 
             if (!(massVisited[tnum] == currentV)) {
                 massVisited[tnum] = currentV;
 
-                float dist = fstdistfunc(point, getDataByInternalId(tnum));
-                dist_calc++;
+                float dist = distToElement(point, tnum);
+                ndist++;
 
-                if (topResults.top().first > dist || topResults.size() < ef) {
-                    candidateSet.emplace(-dist, tnum);
+                if (topResults.front().first > dist || topResults.size() < ef) {
+                    candidateSet.emplace_back(-dist, tnum);
+                    std::push_heap(candidateSet.begin(), candidateSet.end());
 
-                    _mm_prefetch(get_linklist0(candidateSet.top().second), _MM_HINT_T0);
-                    topResults.emplace(dist, tnum);
+                    _mm_prefetch(get_linklist0(candidateSet.front().second), _MM_HINT_T0);
+                    topResults.emplace_back(dist, tnum);
+                    std::push_heap(topResults.begin(), topResults.end());
 
-                    if (topResults.size() > ef)
-                        topResults.pop();
+                    if (topResults.size() > ef) {
+                        std::pop_heap(topResults.begin(), topResults.end());
+                        topResults.pop_back();
+                    }
+                    lowerBound = topResults.front().first;
+                }
+            }
+        }
+    }
+    dist_calc.fetch_add(ndist, std::memory_order_relaxed);
+    if (counters) {
+        counters->hops += nhops;
+        counters->dist_calcs += ndist;
+    }
+}
 
-                    lowerBound = topResults.top().first;
+idx_t HierarchicalNSW::greedySearch(idx_t ep, const float *point, int from_level, int to_level, bool lock_links,
+                                    SearchCounters *counters)
+{
+    size_t ndist = 1;
+    size_t nhops = 0;
+    idx_t currObj = ep;
+    float curdist = distToElement(point, currObj);
+
+    for (int level = from_level; level > to_level; level--) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+
+            std::unique_lock<std::mutex> lock;
+            if (lock_links)
+                lock = std::unique_lock<std::mutex>(link_list_locks_[currObj]);
+
+            uint8_t *ll_cur = get_linklist(currObj, level);
+            size_t size = *ll_cur;
+            idx_t *data = (idx_t *)(ll_cur + 1);
+            nhops++;
+            ndist += size;
+            for (size_t j = 0; j < size; j++) {
+                float dist = distToElement(point, data[j]);
+                if (dist < curdist) {
+                    curdist = dist;
+                    currObj = data[j];
+                    changed = true;
                 }
             }
         }
     }
-    visitedlistpool->releaseVisitedList(vl);
-    return topResults;
+    dist_calc.fetch_add(ndist, std::memory_order_relaxed);
+    if (counters) {
+        counters->hops += nhops;
+        counters->dist_calcs += ndist;
+    }
+    return currObj;
 }
 
 
@@ -144,7 +253,7 @@ void HierarchicalNSW::getNeighborsByHeuristic(std::priority_queue<std::pair<floa
 }
 
 void HierarchicalNSW::mutuallyConnectNewElement(const float *point, idx_t cur_c,
-                               std::priority_queue<std::pair<float, idx_t>> topResults)
+                               std::priority_queue<std::pair<float, idx_t>> topResults, int level)
 {
     getNeighborsByHeuristic(topResults, M_);
 
@@ -155,25 +264,29 @@ void HierarchicalNSW::mutuallyConnectNewElement(const float *point, idx_t cur_c,
         topResults.pop();
     }
     {
-        uint8_t *ll_cur = get_linklist0(cur_c);
-        if (*ll_cur)
-            throw std::runtime_error("Should be blank");
-
-        *ll_cur = res.size();
-
+        std::unique_lock<std::mutex> lock(link_list_locks_[cur_c]);
+        uint8_t *ll_cur = get_linklist(cur_c, level);
         idx_t *data = (idx_t *)(ll_cur + 1);
-        for (size_t idx = 0; idx < res.size(); idx++) {
-            if (data[idx])
-                throw std::runtime_error("Should be blank");
-            data[idx] = res[idx];
-        }
+
+        // In the parallel construction, elements inserted concurrently may have already linked
+        // to the new element at this level. Their links are kept after the selected neighbors
+        std::vector<idx_t> links(res);
+        for (size_t j = 0; j < *ll_cur; j++)
+            if (std::find(res.begin(), res.end(), data[j]) == res.end())
+                links.push_back(data[j]);
+        links.resize(std::min(links.size(), (level == 0) ? maxM_ : M_));
+
+        *ll_cur = links.size();
+        for (size_t idx = 0; idx < links.size(); idx++)
+            data[idx] = links[idx];
     }
     for (size_t idx = 0; idx < res.size(); idx++) {
         if (res[idx] == cur_c)
             throw std::runtime_error("Connection to the same element");
 
-        size_t resMmax = maxM_;
-        uint8_t *ll_other = get_linklist0(res[idx]);
+        size_t resMmax = (level == 0) ? maxM_ : M_;
+        std::unique_lock<std::mutex> lock(link_list_locks_[res[idx]]);
+        uint8_t *ll_other = get_linklist(res[idx], level);
         uint8_t sz_link_list_other = *ll_other;
 
         if (sz_link_list_other > resMmax || sz_link_list_other < 0)
@@ -209,28 +322,106 @@ void HierarchicalNSW::mutuallyConnectNewElement(const float *point, idx_t cur_c,
 
 void HierarchicalNSW::addPoint(const float *point)
 {
-    if (cur_element_count >= maxelements_) {
-        std::cout << "The number of elements exceeds the specified limit\n";
-        throw std::runtime_error("The number of elements exceeds the specified limit");
+    idx_t cur_c;
+    {
+        std::unique_lock<std::mutex> lock(cur_element_count_guard_);
+        if (cur_element_count >= maxelements_) {
+            std::cout << "The number of elements exceeds the specified limit\n";
+            throw std::runtime_error("The number of elements exceeds the specified limit");
+        }
+        cur_c = cur_element_count++;
+        if (inserted_[cur_c])
+            throw std::runtime_error("The next free id is taken by an element inserted with its id");
+        inserted_[cur_c] = true;
     }
-    idx_t cur_c = cur_element_count++;
+    insertElement(point, cur_c);
+};
+
+void HierarchicalNSW::addPoint(const float *point, idx_t cur_c)
+{
+    {
+        std::unique_lock<std::mutex> lock(cur_element_count_guard_);
+        if (cur_c >= maxelements_ || cur_element_count >= maxelements_) {
+            std::cout << "The number of elements exceeds the specified limit\n";
+            throw std::runtime_error("The number of elements exceeds the specified limit");
+        }
+        // A second insertion would overwrite the links of the element
+        if (inserted_[cur_c])
+            throw std::runtime_error("The element " + std::to_string(cur_c) + " is already inserted");
+        inserted_[cur_c] = true;
+        cur_element_count++;
+    }
+    insertElement(point, cur_c);
+};
+
+void HierarchicalNSW::insertElement(const float *point, idx_t cur_c)
+{
+    if (storage_ != STORAGE_FLOAT)
+        throw std::runtime_error("Elements cannot be inserted into the graph with the compressed vectors");
+    if (!internal_to_external_.empty())
+        throw std::runtime_error("Elements cannot be inserted into the reordered graph");
+    if (!level0_replicas_.empty())
+        throw std::runtime_error("Elements cannot be inserted into the replicated graph");
+    const int curlevel = getRandomLevel(cur_c);
+
+    // The element is not reachable until it is linked, so its memory is written without the lock
     memset((char *) get_linklist0(cur_c), 0, size_data_per_element);
     memcpy(getDataByInternalId(cur_c), point, data_size_);
+    element_levels_[cur_c] = curlevel;
+    if (curlevel > 0)
+        linkLists_[cur_c] = (char *) calloc(curlevel, size_links_per_element_);
+
+    // The lock is held during the whole insertion, if the element becomes the new enter point
+    std::unique_lock<std::mutex> templock(global);
+    const int maxlevelcopy = maxlevel_;
+    idx_t currObj = enterpoint_node;
+    if (curlevel <= maxlevelcopy)
+        templock.unlock();
 
     // Do nothing for the first element
-    if (cur_c != 0) {
-        std::priority_queue <std::pair<float, idx_t>> topResults = searchBaseLayer(point, efConstruction_);
-        mutuallyConnectNewElement(point, cur_c, topResults);
+    if (maxlevelcopy >= 0) {
+        currObj = greedySearch(currObj, point, maxlevelcopy, curlevel, true);
+
+        for (int level = std::min(curlevel, maxlevelcopy); level >= 0; level--) {
+            std::priority_queue <std::pair<float, idx_t>> found =
+                    searchBaseLayer(currObj, point, efConstruction_, level, true);
+
+            // Concurrent insertions may have already linked to the element, so it can be found itself.
+            // The closest of the other elements is the enter point of the next level
+            std::priority_queue <std::pair<float, idx_t>> topResults;
+            while (found.size() > 0) {
+                if (found.top().second != cur_c) {
+                    topResults.push(found.top());
+                    currObj = found.top().second;
+                }
+                found.pop();
+            }
+            mutuallyConnectNewElement(point, cur_c, topResults, level);
+        }
     }
-};
+    if (curlevel > maxlevelcopy) {
+        enterpoint_node = cur_c;
+        maxlevel_ = curlevel;
+    }
+}
 
-std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchKnn(const float *query, size_t k)
+std::priority_queue<std::pair<float, idx_t>> HierarchicalNSW::searchKnn(const float *query, size_t k,
+                                                                        SearchCounters *counters)
 {
-    auto topResults = searchBaseLayer(query, efSearch);
+    // Descend through the upper levels to the element closest to the query
+    const idx_t currObj = greedySearch(enterpoint_node, query, maxlevel_, 0, false, counters);
+
+    auto topResults = searchBaseLayer(currObj, query, efSearch, 0, false, counters);
     while (topResults.size() > k)
         topResults.pop();
-
-    return topResults;
+    if (internal_to_external_.empty())
+        return topResults;
+
+    std::vector<std::pair<float, idx_t>> results;
+    results.reserve(topResults.size());
+    for (; !topResults.empty(); topResults.pop())
+        results.emplace_back(topResults.top().first, getExternalLabel(topResults.top().second));
+    return std::priority_queue<std::pair<float, idx_t>>(results.begin(), results.end());
 };
 
 void HierarchicalNSW::SaveInfo(const std::string &location)
@@ -238,14 +429,22 @@ void HierarchicalNSW::SaveInfo(const std::string &location)
     std::cout << "Saving info to " << location << std::endl;
     std::ofstream output(location, std::ios::binary);
 
+    // The vectors are loaded from the fp32 data file, so the layout of the fp32 storage is written
+    const size_t float_data_size = d_ * sizeof(float);
+    const size_t float_size_per_element = size_links_level0 + float_data_size;
+
     writeBinaryPOD(output, maxelements_);
-    writeBinaryPOD(output, enterpoint_node);
-    writeBinaryPOD(output, data_size_);
+    writeBinaryPOD(output, getExternalLabel(enterpoint_node));
+    writeBinaryPOD(output, float_data_size);
     writeBinaryPOD(output, offset_data);
-    writeBinaryPOD(output, size_data_per_element);
+    writeBinaryPOD(output, float_size_per_element);
     writeBinaryPOD(output, M_);
     writeBinaryPOD(output, maxM_);
     writeBinaryPOD(output, size_links_level0);
+
+    // Appended in the multi-level version, files without it keep level 0 only
+    writeBinaryPOD(output, maxlevel_);
+    writeBinaryPOD(output, metric_);
 }
 
 
@@ -254,13 +453,32 @@ void HierarchicalNSW::SaveEdges(const std::string &location)
     std::cout << "Saving edges to " << location << std::endl;
     std::ofstream output(location, std::ios::binary);
 
-    for (size_t i = 0; i < maxelements_; i++) {
-        uint8_t *ll_cur = get_linklist0(i);
+    // Elements and links are written by the labels, in the order of the data file
+    std::vector<idx_t> links;
+    auto write_links = [&](const uint8_t *ll_cur) {
         uint32_t size = *ll_cur;
+        const idx_t *data = (const idx_t *)(ll_cur + 1);
+        links.resize(size);
+        for (size_t j = 0; j < size; j++)
+            links[j] = getExternalLabel(data[j]);
 
         output.write((char *) &size, sizeof(uint32_t));
-        idx_t *data = (idx_t *)(ll_cur + 1);
-        output.write((char *) data, sizeof(idx_t) * size);
+        output.write((char *) links.data(), sizeof(idx_t) * size);
+    };
+
+    for (size_t label = 0; label < maxelements_; label++)
+        write_links(get_linklist0(getInternalId(label)));
+
+    // Upper levels follow the level 0: the top level of each element and its link lists
+    if (maxlevel_ <= 0)
+        return;
+    for (size_t label = 0; label < maxelements_; label++) {
+        const idx_t i = getInternalId(label);
+        uint32_t level = element_levels_[i];
+        output.write((char *) &level, sizeof(uint32_t));
+
+        for (int l = 1; l <= element_levels_[i]; l++)
+            write_links(get_linklist(i, l));
     }
 }
 
@@ -278,11 +496,28 @@ void HierarchicalNSW::LoadInfo(const std::string &location)
     readBinaryPOD(input, maxM_);
     readBinaryPOD(input, size_links_level0);
 
+    // Files written before the upper levels were added end here
+    readBinaryPOD(input, maxlevel_);
+    if (!input)
+        maxlevel_ = 0;
+
+    // Files written before the metric was stored are built for L2
+    readBinaryPOD(input, metric_);
+    if (!input)
+        metric_ = 0;
+
     d_ = data_size_ / sizeof(float);
-    data_level0_memory_ = (char *) malloc(maxelements_ * size_data_per_element);
+    data_level0_memory_ = (char *) alloc_memory(maxelements_ * size_data_per_element);
+
+    size_links_per_element_ = M_ * sizeof(idx_t) + sizeof(uint8_t);
+    mult_ = 1 / log(1.0 * M_);
+    element_levels_.resize(maxelements_, 0);
+    linkLists_ = (char **) calloc(maxelements_, sizeof(char *));
 
     efConstruction_ = 0;
     cur_element_count = maxelements_;
+    inserted_.assign(maxelements_, true);
+    dist_calc = 0;
 
     visitedlistpool = new VisitedListPool(1, maxelements_);
 }
@@ -321,10 +556,350 @@ void HierarchicalNSW::LoadEdges(const std::string &location)
 
         input.read((char *) data, size * sizeof(idx_t));
     }
+
+    if (maxlevel_ <= 0)
+        return;
+    for (size_t i = 0; i < maxelements_; i++) {
+        uint32_t level;
+        input.read((char *) &level, sizeof(uint32_t));
+        element_levels_[i] = level;
+        if (level == 0)
+            continue;
+
+        linkLists_[i] = (char *) calloc(level, size_links_per_element_);
+        for (uint32_t l = 1; l <= level; l++) {
+            input.read((char *) &size, sizeof(uint32_t));
+
+            uint8_t *ll_cur = get_linklist(i, l);
+            *ll_cur = size;
+            idx_t *data = (idx_t *)(ll_cur + 1);
+
+            input.read((char *) data, size * sizeof(idx_t));
+        }
+    }
+}
+
+/// Convert a float to the nearest half precision float
+static inline uint16_t float_to_half(float f)
+{
+#ifdef __F16C__
+    return _cvtss_sh(f, 0);
+#else
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(float));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 0x1f)
+        return sign | 0x7c00;
+    if (exponent <= 0) {
+        // Subnormal, rounded to the nearest even
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        if (rest > (1u << (shift - 1)) || (rest == (1u << (shift - 1)) && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    // The carry of the rounding may increment the exponent, up to the infinity
+    uint32_t half = (exponent << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+#endif
+}
+
+/// Convert a half precision float to a float
+static inline float half_to_float(uint16_t h)
+{
+#ifdef __F16C__
+    return _cvtsh_ss(h);
+#else
+    const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        exponent = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(float));
+    return f;
+#endif
+}
+
+void HierarchicalNSW::compress(StorageType storage, bool keep_float_data)
+{
+    if (storage_ != STORAGE_FLOAT)
+        throw std::runtime_error("The vectors are already compressed");
+    if (storage == STORAGE_FLOAT)
+        return;
+    dropReplicas();
+
+    // Range of each dimension for the scalar quantizer
+    if (storage == STORAGE_SQ8) {
+        sq_offset_.assign(d_, std::numeric_limits<float>::max());
+        std::vector<float> vmax(d_, std::numeric_limits<float>::lowest());
+        for (size_t i = 0; i < maxelements_; i++) {
+            const float *x = getDataByInternalId(i);
+            for (size_t j = 0; j < d_; j++) {
+                sq_offset_[j] = std::min(sq_offset_[j], x[j]);
+                vmax[j] = std::max(vmax[j], x[j]);
+            }
+        }
+        sq_scale_.resize(d_);
+        for (size_t j = 0; j < d_; j++)
+            sq_scale_[j] = (vmax[j] - sq_offset_[j]) / 255;
+    }
+
+    const size_t code_size = (storage == STORAGE_FP16) ? d_ * sizeof(uint16_t) : d_;
+    const size_t code_size_per_element = size_links_level0 + code_size;
+    char *code_level0_memory = (char *) alloc_memory(maxelements_ * code_size_per_element);
+    if (keep_float_data)
+        float_data_ = (float *) alloc_memory(maxelements_ * d_ * sizeof(float));
+
+#pragma omp parallel for
+    for (size_t i = 0; i < maxelements_; i++) {
+        const float *x = getDataByInternalId(i);
+        char *element = code_level0_memory + i * code_size_per_element;
+        memcpy(element, get_linklist0(i), size_links_level0);
+
+        if (storage == STORAGE_FP16) {
+            uint16_t *code = (uint16_t *) (element + offset_data);
+            for (size_t j = 0; j < d_; j++)
+                code[j] = float_to_half(x[j]);
+        } else {
+            uint8_t *code = (uint8_t *) (element + offset_data);
+            for (size_t j = 0; j < d_; j++) {
+                const float v = sq_scale_[j] > 0 ? std::round((x[j] - sq_offset_[j]) / sq_scale_[j]) : 0;
+                code[j] = (uint8_t) std::max(0.f, std::min(255.f, v));
+            }
+        }
+        if (keep_float_data)
+            memcpy(float_data_ + i * d_, x, d_ * sizeof(float));
+    }
+    free_memory(data_level0_memory_);
+    data_level0_memory_ = code_level0_memory;
+    data_size_ = code_size;
+    size_data_per_element = code_size_per_element;
+    storage_ = storage;
+
+    std::cout << "Compressed vectors to " << (storage == STORAGE_FP16 ? "fp16" : "SQ8")
+              << ", size Mb: " << (maxelements_ * size_data_per_element) / (1000 * 1000) << std::endl;
+}
+
+void HierarchicalNSW::dropFloatData()
+{
+    if (storage_ == STORAGE_FLOAT)
+        return;
+    free_memory(float_data_);
+    float_data_ = nullptr;
+}
+
+void HierarchicalNSW::replicate()
+{
+    dropReplicas();
+    const int nnodes = numa_node_count();
+    if (nnodes < 2)
+        return;
+
+    const size_t size = maxelements_ * size_data_per_element;
+    for (int node = 0; node < nnodes; node++) {
+        char *replica = (char *) alloc_memory_on_node(size, node);
+        if (!replica)
+            throw std::runtime_error("Could not allocate the replica of the level 0");
+        memcpy(replica, data_level0_memory_, size);
+        level0_replicas_.push_back(replica);
+    }
+    std::cout << "Replicated the level 0 to " << nnodes << " NUMA nodes, size Mb: " << nnodes * size / (1000 * 1000) << std::endl;
+}
+
+void HierarchicalNSW::dropReplicas()
+{
+    for (char *replica : level0_replicas_)
+        free_memory(replica);
+    level0_replicas_.clear();
+}
+
+void HierarchicalNSW::reorder(ReorderType type)
+{
+    if (type == REORDER_NONE || maxelements_ == 0)
+        return;
+    dropReplicas();
+
+    // order[new internal id] = old internal id
+    std::vector<idx_t> order;
+    order.reserve(maxelements_);
+    std::vector<bool> visited(maxelements_, false);
+
+    auto degree = [this](idx_t i) { return (size_t) *get_linklist0(i); };
+
+    // Candidates to start the traversal of each disconnected part: the enter point, then the other elements.
+    // RCM starts from the elements of the smallest degree instead
+    std::vector<idx_t> starts(maxelements_);
+    for (size_t i = 0; i < maxelements_; i++)
+        starts[i] = i;
+    if (type == REORDER_RCM)
+        std::stable_sort(starts.begin(), starts.end(), [&](idx_t a, idx_t b) { return degree(a) < degree(b); });
+    else
+        std::swap(starts[0], starts[enterpoint_node]);
+
+    size_t next_start = 0;
+    std::vector<idx_t> neighbors;
+    while (order.size() < maxelements_) {
+        while (visited[starts[next_start]])
+            next_start++;
+        const idx_t start = starts[next_start];
+
+        // The order vector is the BFS queue
+        size_t head = order.size();
+        order.push_back(start);
+        visited[start] = true;
+        for (; head < order.size(); head++) {
+            const uint8_t *ll_cur = get_linklist0(order[head]);
+            const idx_t *data = (const idx_t *)(ll_cur + 1);
+            neighbors.assign(data, data + *ll_cur);
+            if (type == REORDER_RCM)
+                std::stable_sort(neighbors.begin(), neighbors.end(),
+                                 [&](idx_t a, idx_t b) { return degree(a) < degree(b); });
+            for (idx_t neighbor : neighbors) {
+                if (!visited[neighbor]) {
+                    visited[neighbor] = true;
+                    order.push_back(neighbor);
+                }
+            }
+        }
+    }
+    if (type == REORDER_RCM)
+        std::reverse(order.begin(), order.end());
+
+    std::vector<idx_t> new_id(maxelements_);
+    for (size_t i = 0; i < maxelements_; i++)
+        new_id[order[i]] = i;
+
+    // Move the elements to the new positions and renumber the links
+    auto renumber = [&](uint8_t *ll_cur) {
+        idx_t *data = (idx_t *)(ll_cur + 1);
+        for (size_t j = 0; j < *ll_cur; j++)
+            data[j] = new_id[data[j]];
+    };
+    char *new_level0_memory = (char *) alloc_memory(maxelements_ * size_data_per_element);
+    char **new_link_lists = (char **) calloc(maxelements_, sizeof(char *));
+    std::vector<uint8_t> new_levels(maxelements_);
+    float *new_float_data = float_data_ ? (float *) alloc_memory(maxelements_ * d_ * sizeof(float)) : nullptr;
+    std::vector<idx_t> new_internal_to_external(maxelements_);
+
+#pragma omp parallel for
+    for (size_t i = 0; i < maxelements_; i++) {
+        const idx_t old = order[i];
+        memcpy(new_level0_memory + i * size_data_per_element, get_linklist0(old), size_data_per_element);
+        renumber((uint8_t *) (new_level0_memory + i * size_data_per_element));
+
+        new_levels[i] = element_levels_[old];
+        new_link_lists[i] = linkLists_[old];
+        for (int l = 1; l <= new_levels[i]; l++)
+            renumber((uint8_t *) (new_link_lists[i] + (l - 1) * size_links_per_element_));
+
+        if (new_float_data)
+            memcpy(new_float_data + i * d_, float_data_ + old * d_, d_ * sizeof(float));
+        new_internal_to_external[i] = getExternalLabel(old);
+    }
+    free_memory(data_level0_memory_);
+    free(linkLists_);
+    free_memory(float_data_);
+    data_level0_memory_ = new_level0_memory;
+    linkLists_ = new_link_lists;
+    float_data_ = new_float_data;
+    element_levels_.swap(new_levels);
+    enterpoint_node = new_id[enterpoint_node];
+
+    internal_to_external_.swap(new_internal_to_external);
+    external_to_internal_.resize(maxelements_);
+    for (size_t i = 0; i < maxelements_; i++)
+        external_to_internal_[internal_to_external_[i]] = i;
+
+    std::cout << "Reordered " << maxelements_ << " elements by " << (type == REORDER_BFS ? "BFS" : "RCM") << std::endl;
+}
+
+const float *HierarchicalNSW::getVector(idx_t label, float *buf) const
+{
+    const idx_t internal_id = getInternalId(label);
+    const float *x = getDataByInternalId(internal_id);
+    if (x)
+        return x;
+    decode(getCodeByInternalId(internal_id), buf);
+    return buf;
+}
+
+void HierarchicalNSW::decode(const uint8_t *code, float *x) const
+{
+    if (storage_ == STORAGE_FP16) {
+        const uint16_t *half_code = (const uint16_t *) code;
+        for (size_t j = 0; j < d_; j++)
+            x[j] = half_to_float(half_code[j]);
+    } else {
+        for (size_t j = 0; j < d_; j++)
+            x[j] = sq_offset_[j] + code[j] * sq_scale_[j];
+    }
+}
+
+float HierarchicalNSW::fstdistfunc_code(const float *x, const uint8_t *code)
+{
+    float res = 0;
+    size_t j = 0;
+#if defined(__AVX2__) && defined(__F16C__)
+    __m256 sum = _mm256_set1_ps(0);
+    for (; j + 8 <= d_; j += 8) {
+        __m256 y;
+        if (storage_ == STORAGE_FP16) {
+            y = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (code + 2 * j)));
+        } else {
+            const __m256 c = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (code + j))));
+            y = _mm256_add_ps(_mm256_loadu_ps(sq_offset_.data() + j), _mm256_mul_ps(c, _mm256_loadu_ps(sq_scale_.data() + j)));
+        }
+        const __m256 v = _mm256_loadu_ps(x + j);
+        if (inner_product_) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(v, y));
+        } else {
+            const __m256 diff = _mm256_sub_ps(v, y);
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+        }
+    }
+    float PORTABLE_ALIGN32 TmpRes[8];
+    _mm256_store_ps(TmpRes, sum);
+    res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+#endif
+    for (; j < d_; j++) {
+        const float y = (storage_ == STORAGE_FP16) ? half_to_float(((const uint16_t *) code)[j])
+                                                   : sq_offset_[j] + code[j] * sq_scale_[j];
+        res += inner_product_ ? x[j] * y : (x[j] - y) * (x[j] - y);
+    }
+    return inner_product_ ? -res : res;
 }
 
 float HierarchicalNSW::fstdistfunc(const float *x, const float *y)
 {
+    if (inner_product_)
+        return -fstinnerproduct(x, y);
+
     float PORTABLE_ALIGN32 TmpRes[8];
 #ifdef USE_AVX
     size_t qty16 = d_ >> 4;
@@ -397,4 +972,57 @@ float HierarchicalNSW::fstdistfunc(const float *x, const float *y)
     return (res);
 #endif
 }
-}
\ No newline at end of file
+
+float HierarchicalNSW::fstinnerproduct(const float *x, const float *y)
+{
+    float PORTABLE_ALIGN32 TmpRes[8];
+#ifdef USE_AVX
+    size_t qty16 = d_ >> 4;
+
+    const float *pEnd1 = x + (qty16 << 4);
+
+    __m256 v1, v2;
+    __m256 sum = _mm256_set1_ps(0);
+
+    while (x < pEnd1) {
+        v1 = _mm256_loadu_ps(x);
+        x += 8;
+        v2 = _mm256_loadu_ps(y);
+        y += 8;
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(v1, v2));
+
+        v1 = _mm256_loadu_ps(x);
+        x += 8;
+        v2 = _mm256_loadu_ps(y);
+        y += 8;
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(v1, v2));
+    }
+
+    _mm256_store_ps(TmpRes, sum);
+    float res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+
+    return (res);
+#else
+    size_t qty16 = d_ >> 4;
+
+    const float *pEnd1 = x + (qty16 << 4);
+
+    __m128 v1, v2;
+    __m128 sum = _mm_set1_ps(0);
+
+    while (x < pEnd1) {
+        for (int i = 0; i < 4; i++) {
+            v1 = _mm_loadu_ps(x);
+            x += 4;
+            v2 = _mm_loadu_ps(y);
+            y += 4;
+            sum = _mm_add_ps(sum, _mm_mul_ps(v1, v2));
+        }
+    }
+    _mm_store_ps(TmpRes, sum);
+    float res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3];
+
+    return (res);
+#endif
+}
+}
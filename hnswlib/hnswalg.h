@@ -1,6 +1,7 @@
 #pragma once
 
 #include "visited_list_pool.h"
+#include "memory_policy.h"
 #include <random>
 #include <iostream>
 #include <fstream>
@@ -12,6 +13,12 @@
 #include <map>
 #include <cmath>
 #include <queue>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <limits>
+#include <stdexcept>
+#include <atomic>
 
 #include <faiss/Heap.h>
 
@@ -24,7 +31,10 @@
 #include <x86intrin.h>
 #endif
 
+// The SSE kernels are used if the code is compiled without AVX, e.g. with -mno-avx
+#ifdef __AVX__
 #define USE_AVX
+#endif
 #if defined(__GNUC__)
 #define PORTABLE_ALIGN32 __attribute__((aligned(32)))
 #else
@@ -44,6 +54,29 @@ static void readBinaryPOD(std::istream &in, T &podRef) {
 namespace hnswlib {
     typedef uint32_t idx_t;
 
+    /// Type of the vectors stored next to the level 0 links
+    enum StorageType {
+        STORAGE_FLOAT = 0,   ///< 32-bit floats, the graph is built in this storage
+        STORAGE_FP16 = 1,    ///< Half precision floats, half of the bytes
+        STORAGE_SQ8 = 2      ///< 8-bit codes of a per-dimension scalar quantizer, a quarter of the bytes
+    };
+
+    /// Order of the elements in memory
+    enum ReorderType {
+        REORDER_NONE = 0,    ///< Order of the insertion, i.e. of the centroid file
+        REORDER_BFS = 1,     ///< Breadth-first traversal of the level 0 from the enter point
+        REORDER_RCM = 2      ///< Reverse Cuthill-McKee: BFS visiting the neighbors by the ascending degree, reversed
+    };
+
+    /// Work of a graph search, added up by the search functions
+    struct SearchCounters
+    {
+        size_t hops;         ///< Elements, whose links are expanded
+        size_t dist_calcs;   ///< Computed distances
+
+        SearchCounters(): hops(0), dist_calcs(0) {}
+    };
+
     struct HierarchicalNSW
     {
         size_t maxelements_;
@@ -52,12 +85,22 @@ namespace hnswlib {
 
         VisitedListPool *visitedlistpool;
 
-        std::mutex cur_element_count_guard_;
+        std::mutex cur_element_count_guard_;       ///< Guards cur_element_count and inserted_
+        std::vector<bool> inserted_;               ///< Whether each internal id is taken by an inserted element
+        std::vector<std::mutex> link_list_locks_;  ///< Guard the link lists while the graph is built in parallel
+        std::mutex global;                         ///< Guards the enter point and the max level
         idx_t enterpoint_node;
+        int maxlevel_;                             ///< Level of the enter point, -1 for the empty graph
 
-        size_t dist_calc;
+        std::vector<uint8_t> element_levels_;      ///< Top level of each element
+        char **linkLists_;                         ///< Link lists of levels 1..element_levels_[i] of each element
+        size_t size_links_per_element_;            ///< Size of a link list of an upper level: up to M_ links
+        double mult_;                              ///< Normalization factor of the level generation
 
-        char *data_level0_memory_;
+        std::atomic<size_t> dist_calc;             ///< Distances computed by all searches, added once per search
+
+        char *data_level0_memory_;                 ///< Allocated by alloc_memory(), so it follows the memory policy
+        std::vector<char *> level0_replicas_;      ///< Copies of the level 0 on each NUMA node, empty if not replicated
 
         size_t d_;
         size_t data_size_;
@@ -68,28 +111,161 @@ namespace hnswlib {
         size_t size_links_level0;
         size_t efSearch;
 
+        bool inner_product_;   ///< Distance is the negative inner product instead of the L2 square distance
+        uint32_t metric_;      ///< Metric of the index the graph is built for, stored in the info file, 0 (L2) in the older files
+
+        StorageType storage_;             ///< Type of the stored vectors, set by compress()
+        float *float_data_;               ///< Optional fp32 copy of the compressed vectors, size maxelements_ * d_
+        std::vector<float> sq_offset_;    ///< SQ8 only: value of the code 0 in each dimension
+        std::vector<float> sq_scale_;     ///< SQ8 only: step between the consecutive codes in each dimension
+
+        /** Labels of the elements after reorder(), empty if the internal ids are the labels
+          *
+          * The search returns and the files store the labels, so the reordering is invisible outside of the graph.
+        */
+        std::vector<idx_t> internal_to_external_;
+        std::vector<idx_t> external_to_internal_;   ///< Inverse of internal_to_external_
+
     public:
         HierarchicalNSW(const std::string &infoLocation, const std::string &dataLocation, const std::string &edgeLocation);
         HierarchicalNSW(size_t d, size_t maxelements, size_t M, size_t maxM, size_t efConstruction = 500);
         ~HierarchicalNSW();
 
+        /// Level 0 read by the calling thread: the replica of its NUMA node if the graph is replicated
+        inline char *level0_memory() const {
+            return level0_replicas_.empty() ? data_level0_memory_ : level0_replicas_[current_numa_node()];
+        }
+
+        /// Stored (possibly compressed) vector of the element, data_size_ bytes
+        inline uint8_t *getCodeByInternalId(idx_t internal_id) const {
+            return (uint8_t *) (level0_memory() + internal_id * size_data_per_element + offset_data);
+        }
+
+        /// fp32 vector of the element, nullptr if the storage is compressed and the fp32 copy is not kept
         inline float *getDataByInternalId(idx_t internal_id) const {
-            return (float *) (data_level0_memory_ + internal_id * size_data_per_element + offset_data);
+            if (storage_ == STORAGE_FLOAT)
+                return (float *) getCodeByInternalId(internal_id);
+            return float_data_ ? float_data_ + (size_t) internal_id * d_ : nullptr;
+        }
+
+        /// Label of the element with the internal id
+        inline idx_t getExternalLabel(idx_t internal_id) const {
+            return internal_to_external_.empty() ? internal_id : internal_to_external_[internal_id];
+        }
+
+        /// Internal id of the element with the label
+        inline idx_t getInternalId(idx_t label) const {
+            return external_to_internal_.empty() ? label : external_to_internal_[label];
+        }
+
+        /** fp32 vector of the element with the label in any storage
+          *
+          * @param label   label of the element, e.g. the centroid index
+          * @param buf     d_ floats to decode the vector to, if there is no fp32 vector
+          * @return        either the fp32 vector or buf
+        */
+        const float *getVector(idx_t label, float *buf) const;
+
+        /** Permute the elements in memory, so the neighbors of an element are stored close to it
+          *
+          * The level 0 blocks, the upper level link lists and the fp32 copy are moved to the new positions
+          * and the links are renumbered. The elements visited one after another by the search then share
+          * the cache lines and the pages. Elements cannot be inserted into the reordered graph.
+          *
+          * @param type    traversal, which defines the new order
+        */
+        void reorder(ReorderType type);
+
+        /** Compress the stored vectors of the built graph
+          *
+          * The level 0 is rewritten with the codes next to the links, so the graph search reads
+          * 2 (fp16) or 4 (SQ8) times less vector data. The SQ8 range of each dimension is the min
+          * and max over all vectors. Elements cannot be inserted into the compressed graph.
+          *
+          * @param storage           fp16 or SQ8
+          * @param keep_float_data   keep the fp32 vectors aside, e.g. for the residuals computed while
+          *                          the index is built. Otherwise getVector() decodes the codes
+        */
+        void compress(StorageType storage, bool keep_float_data = false);
+
+        /// Free the fp32 copy of the compressed vectors
+        void dropFloatData();
+
+        /** Copy the level 0 to each NUMA node
+          *
+          * The threads pinned by pin_threads_to_numa_nodes() then search the local copy, so the graph
+          * search, which is bound by the memory latency, does not cross the socket interconnect. Takes
+          * numa_node_count() times the memory of the level 0. Call it once the graph is compressed and
+          * reordered, elements cannot be inserted into the replicated graph. Does nothing on a single node.
+        */
+        void replicate();
+
+        /// Free the copies of the level 0
+        void dropReplicas();
+
+        /// Distance between the query and the stored vector of the element
+        inline float distToElement(const float *x, idx_t internal_id) {
+            return storage_ == STORAGE_FLOAT ? fstdistfunc(x, (const float *) getCodeByInternalId(internal_id))
+                                             : fstdistfunc_code(x, getCodeByInternalId(internal_id));
         }
 
         inline uint8_t *get_linklist0(idx_t internal_id) const {
-            return (uint8_t *) (data_level0_memory_ + internal_id * size_data_per_element);
+            return (uint8_t *) (level0_memory() + internal_id * size_data_per_element);
         }
 
-        std::priority_queue<std::pair<float, idx_t>> searchBaseLayer(const float *x, size_t ef);
+        /// Link list of the element at the level, the level has to be at most element_levels_[internal_id]
+        inline uint8_t *get_linklist(idx_t internal_id, int level) const {
+            return level == 0 ? get_linklist0(internal_id)
+                              : (uint8_t *) (linkLists_[internal_id] + (level - 1) * size_links_per_element_);
+        }
+
+        /** Search the level of the graph starting from the element ep
+          *
+          * @param lock_links   lock each link list while it is read, has to be set when
+          *                     the graph is searched concurrently with the insertions
+        */
+        std::priority_queue<std::pair<float, idx_t>> searchBaseLayer(idx_t ep, const float *x, size_t ef,
+                                                                     int level = 0, bool lock_links = false,
+                                                                     SearchCounters *counters = nullptr);
+
+        /** Allocation-free version of searchBaseLayer for callers, which keep their own scratch space
+          *
+          * @param vl            visited list of at least maxelements_ entries, it is reset by the search
+          * @param topResults    output max-heap of the ef closest elements (std::push_heap order)
+          * @param candidateSet  scratch heap of the candidates
+          * @param counters      if non-null, the hops and the distances of the search are added to it
+        */
+        void searchLayer(idx_t ep, const float *x, size_t ef, int level, bool lock_links, VisitedList *vl,
+                         std::vector<std::pair<float, idx_t>> &topResults,
+                         std::vector<std::pair<float, idx_t>> &candidateSet, SearchCounters *counters = nullptr);
+
+        /// Greedy search of the closest element from the level of ep down to the level to_level + 1
+        idx_t greedySearch(idx_t ep, const float *x, int from_level, int to_level, bool lock_links = false,
+                           SearchCounters *counters = nullptr);
 
         void getNeighborsByHeuristic(std::priority_queue<std::pair<float, idx_t>> &topResults, size_t NN);
 
-        void mutuallyConnectNewElement(const float *x, idx_t id, std::priority_queue<std::pair<float, idx_t>> topResults);
+        void mutuallyConnectNewElement(const float *x, idx_t id, std::priority_queue<std::pair<float, idx_t>> topResults,
+                                       int level);
+
+        /// Level of the new element. It depends only on the id, so the parallel construction gives the same levels
+        int getRandomLevel(idx_t cur_c) const;
 
+        /// Insert the point with the next free internal id
         void addPoint(const float *point);
 
-        std::priority_queue<std::pair<float, idx_t >> searchKnn(const float *query_data, size_t k);
+        /** Insert the point with the preassigned internal id
+          *
+          * Several threads may insert points concurrently. Throws if the id is already inserted.
+        */
+        void addPoint(const float *point, idx_t cur_c);
+
+        /// Write the element to its slot and link it to the graph
+        void insertElement(const float *point, idx_t cur_c);
+
+        /// k nearest elements of the query, the work of the search is added to counters if it is non-null
+        std::priority_queue<std::pair<float, idx_t >> searchKnn(const float *query_data, size_t k,
+                                                                SearchCounters *counters = nullptr);
 
         void SaveInfo(const std::string &location);
         void SaveEdges(const std::string &location);
@@ -99,5 +275,14 @@ namespace hnswlib {
         void LoadEdges(const std::string &location);
         
         float fstdistfunc(const float *x, const float *y);
+
+    private:
+        float fstinnerproduct(const float *x, const float *y);
+
+        /// Distance between the fp32 query and a compressed vector, the codes are decoded 8 components at a time
+        float fstdistfunc_code(const float *x, const uint8_t *code);
+
+        /// Decode a compressed vector to d_ floats
+        void decode(const uint8_t *code, float *x) const;
     };
 }
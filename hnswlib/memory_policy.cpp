@@ -0,0 +1,252 @@
+#include "memory_policy.h"
+
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <omp.h>
+
+// Memory policies of mbind(2), the syscall is called directly so libnuma is not needed
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+namespace hnswlib {
+
+    __thread int thread_numa_node = 0;
+
+    static const size_t huge_page_size = 2 << 20;
+
+    /// Kept in front of each array, so free_memory() knows how it was allocated
+    struct AllocationHeader
+    {
+        size_t mapped_size;   ///< Size of the mapping, 0 if the array comes from malloc
+        uint64_t pad[7];      ///< The array starts at a cache line boundary of the mapping
+    };
+
+    static MemoryPolicy policy;
+
+    // Statistics of the report
+    static std::atomic<size_t> bytes_malloc(0);
+    static std::atomic<size_t> bytes_explicit(0);
+    static std::atomic<size_t> bytes_transparent(0);
+    static std::atomic<size_t> bytes_regular(0);
+    static std::atomic<size_t> bytes_interleaved(0);
+    static std::atomic<size_t> bytes_bound(0);
+    static std::atomic<size_t> bytes_advised_files(0);
+    static std::atomic<size_t> explicit_failures(0);
+    static std::atomic<size_t> mbind_failures(0);
+    static std::atomic<int> pinned_threads(0);
+
+    /// Parse a list like "0-3,8,10-11" of /sys/devices/system/node
+    static std::vector<int> read_list(const std::string &path)
+    {
+        std::vector<int> res;
+        std::ifstream input(path);
+        std::string item;
+        while (std::getline(input, item, ',')) {
+            int first, last;
+            const int n = sscanf(item.c_str(), "%d-%d", &first, &last);
+            if (n < 1)
+                continue;
+            if (n == 1)
+                last = first;
+            for (int i = first; i <= last; i++)
+                res.push_back(i);
+        }
+        return res;
+    }
+
+    static const std::vector<int> &online_nodes()
+    {
+        static const std::vector<int> nodes = read_list("/sys/devices/system/node/online");
+        return nodes;
+    }
+
+    int numa_node_count()
+    {
+        return std::max<int>(online_nodes().size(), 1);
+    }
+
+    static bool mbind_nodes(void *ptr, size_t nbytes, int mode, const std::vector<int> &nodes)
+    {
+        unsigned long mask[16] = {0};
+        const unsigned long bits = sizeof(unsigned long) * 8;
+        for (int node : nodes)
+            if (node >= 0 && node < (int) (16 * bits))
+                mask[node / bits] |= 1UL << (node % bits);
+        return syscall(SYS_mbind, ptr, nbytes, mode, mask, 16 * bits, 0) == 0;
+    }
+
+    void set_memory_policy(const MemoryPolicy &new_policy)
+    {
+        policy = new_policy;
+    }
+
+    const MemoryPolicy &get_memory_policy()
+    {
+        return policy;
+    }
+
+    void *alloc_memory(size_t nbytes)
+    {
+        return alloc_memory_on_node(nbytes, -1);
+    }
+
+    void *alloc_memory_on_node(size_t nbytes, int node)
+    {
+        const bool default_policy = policy.huge_pages == HUGEPAGES_NONE && policy.numa == NUMA_NONE;
+        AllocationHeader *header;
+
+        if (node < 0 && (default_policy || nbytes < huge_page_size)) {
+            header = (AllocationHeader *) malloc(sizeof(AllocationHeader) + nbytes);
+            if (!header)
+                return nullptr;
+            header->mapped_size = 0;
+            bytes_malloc += nbytes;
+            return header + 1;
+        }
+
+        const size_t mapped_size = (sizeof(AllocationHeader) + nbytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+        void *ptr = MAP_FAILED;
+        if (policy.huge_pages == HUGEPAGES_EXPLICIT) {
+            ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (ptr == MAP_FAILED)
+                explicit_failures++;
+            else
+                bytes_explicit += nbytes;
+        }
+        if (ptr == MAP_FAILED) {
+            ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED)
+                return nullptr;
+            if (policy.huge_pages != HUGEPAGES_NONE && madvise(ptr, mapped_size, MADV_HUGEPAGE) == 0)
+                bytes_transparent += nbytes;
+            else
+                bytes_regular += nbytes;
+        }
+
+        // The pages are not touched yet, so they are placed by the policy set here
+        if (node >= 0) {
+            const int node_id = node < (int) online_nodes().size() ? online_nodes()[node] : node;
+            if (mbind_nodes(ptr, mapped_size, MPOL_BIND, std::vector<int>(1, node_id)))
+                bytes_bound += nbytes;
+            else
+                mbind_failures++;
+        }
+        else if (policy.numa != NUMA_NONE && numa_node_count() > 1) {
+            if (mbind_nodes(ptr, mapped_size, MPOL_INTERLEAVE, online_nodes()))
+                bytes_interleaved += nbytes;
+            else
+                mbind_failures++;
+        }
+
+        header = (AllocationHeader *) ptr;
+        header->mapped_size = mapped_size;
+        return header + 1;
+    }
+
+    void free_memory(void *ptr)
+    {
+        if (!ptr)
+            return;
+        AllocationHeader *header = (AllocationHeader *) ptr - 1;
+        if (header->mapped_size == 0)
+            free(header);
+        else
+            munmap(header, header->mapped_size);
+    }
+
+    void advise_memory(const void *ptr, size_t nbytes)
+    {
+        if (policy.huge_pages == HUGEPAGES_NONE)
+            return;
+
+        // Only the whole huge pages inside the range can be backed by them
+        const size_t begin = ((size_t) ptr + huge_page_size - 1) / huge_page_size * huge_page_size;
+        const size_t end = ((size_t) ptr + nbytes) / huge_page_size * huge_page_size;
+        if (begin < end && madvise((void *) begin, end - begin, MADV_HUGEPAGE) == 0)
+            bytes_advised_files += end - begin;
+    }
+
+    void pin_threads_to_numa_nodes()
+    {
+        const std::vector<int> &nodes = online_nodes();
+        if (nodes.size() < 2)
+            return;
+
+        std::vector<std::vector<int>> node_cpus(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++)
+            node_cpus[i] = read_list("/sys/devices/system/node/node" + std::to_string(nodes[i]) + "/cpulist");
+
+        pinned_threads = 0;
+#pragma omp parallel
+        {
+            const int nthreads = omp_get_num_threads();
+            const int node = (int) ((size_t) omp_get_thread_num() * nodes.size() / nthreads);
+
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            for (int cpu : node_cpus[node])
+                CPU_SET(cpu, &cpus);
+            if (sched_setaffinity(0, sizeof(cpus), &cpus) == 0) {
+                thread_numa_node = node;
+                pinned_threads++;
+            }
+        }
+    }
+
+    static std::string transparent_hugepage_mode()
+    {
+        std::ifstream input("/sys/kernel/mm/transparent_hugepage/enabled");
+        std::string line;
+        if (!std::getline(input, line))
+            return "unavailable";
+        const size_t begin = line.find('[');
+        const size_t end = line.find(']');
+        return (begin != std::string::npos && end > begin) ? line.substr(begin + 1, end - begin - 1) : line;
+    }
+
+    std::string memory_policy_report()
+    {
+        static const char *huge_page_names[] = {"none", "transparent", "explicit"};
+        static const char *numa_names[] = {"none", "interleave", "replicate"};
+        const size_t mb = 1 << 20;
+
+        std::ostringstream report;
+        report << "Memory policy: huge pages " << huge_page_names[policy.huge_pages]
+               << ", NUMA " << numa_names[policy.numa] << std::endl;
+        report << "  System: " << numa_node_count() << " NUMA node(s), transparent huge pages ["
+               << transparent_hugepage_mode() << "]" << std::endl;
+        report << "  Allocated: " << bytes_explicit / mb << " MB in explicit huge pages, "
+               << bytes_transparent / mb << " MB advised for transparent huge pages, "
+               << bytes_regular / mb << " MB in regular mappings, "
+               << bytes_malloc / mb << " MB from malloc" << std::endl;
+        if (bytes_advised_files > 0)
+            report << "  Mapped files: " << bytes_advised_files / mb << " MB advised for transparent huge pages" << std::endl;
+        if (explicit_failures > 0)
+            report << "  " << explicit_failures << " allocation(s) fell back from the explicit huge pages, "
+                   << "reserve them in /proc/sys/vm/nr_hugepages" << std::endl;
+        if (policy.numa != NUMA_NONE) {
+            report << "  NUMA: " << bytes_interleaved / mb << " MB interleaved, "
+                   << bytes_bound / mb << " MB bound to a node, "
+                   << pinned_threads << " thread(s) pinned" << std::endl;
+            if (mbind_failures > 0)
+                report << "  " << mbind_failures << " mbind call(s) failed" << std::endl;
+        }
+        return report.str();
+    }
+}
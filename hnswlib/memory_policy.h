@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+
+namespace hnswlib {
+
+    /// Pages backing the large arrays: the level 0 of the graph and the arenas of the inverted lists
+    enum HugePagePolicy {
+        HUGEPAGES_NONE = 0,         ///< Regular pages from malloc
+        HUGEPAGES_TRANSPARENT = 1,  ///< Anonymous mappings advised with MADV_HUGEPAGE, the kernel backs them by 2MB pages
+        HUGEPAGES_EXPLICIT = 2      ///< MAP_HUGETLB from the reserved pool, the transparent ones if the pool is empty
+    };
+
+    /// Placement of the large arrays on the NUMA nodes
+    enum NumaPolicy {
+        NUMA_NONE = 0,         ///< First touch: the pages are on the node of the thread, which fills them
+        NUMA_INTERLEAVE = 1,   ///< Pages are spread round-robin over all nodes, so no node serves all the reads
+        NUMA_REPLICATE = 2     ///< Interleave, plus a copy of the graph level 0 on each node, see HierarchicalNSW::replicate()
+    };
+
+    struct MemoryPolicy
+    {
+        HugePagePolicy huge_pages;
+        NumaPolicy numa;
+
+        MemoryPolicy(): huge_pages(HUGEPAGES_NONE), numa(NUMA_NONE) {}
+    };
+
+    /** Set the process-wide policy of the arrays allocated by alloc_memory()
+      *
+      * Arrays allocated before the call keep their pages. Set it before the index is built or loaded.
+    */
+    void set_memory_policy(const MemoryPolicy &policy);
+    const MemoryPolicy &get_memory_policy();
+
+    /** Allocate nbytes with the current policy, freed by free_memory()
+      *
+      * Arrays smaller than a huge page come from malloc. Returns nullptr if the memory is exhausted.
+    */
+    void *alloc_memory(size_t nbytes);
+
+    /// Allocate nbytes on the node number 0..numa_node_count()-1, the huge pages follow the current policy
+    void *alloc_memory_on_node(size_t nbytes, int node);
+
+    void free_memory(void *ptr);
+
+    /// Advise the huge pages for a mapped file, which is searched in place
+    void advise_memory(const void *ptr, size_t nbytes);
+
+    /// Number of the online NUMA nodes, 1 if the system is not NUMA
+    int numa_node_count();
+
+    /** Pin each thread of the OpenMP pool to the CPUs of one NUMA node
+      *
+      * The threads are split into equal consecutive blocks, one per node. The pool keeps its threads,
+      * so the parallel search loops run on the pinned threads, which read the replica of their node.
+      * Does nothing on a single node system.
+    */
+    void pin_threads_to_numa_nodes();
+
+    /// Node of the calling thread set by pin_threads_to_numa_nodes(), 0 for the other threads
+    extern __thread int thread_numa_node __attribute__((tls_model("initial-exec")));
+
+    inline int current_numa_node() { return thread_numa_node; }
+
+    /// Active policy and the pages, which the arrays actually got
+    std::string memory_policy_report();
+
+    /// Allocator of the std::vector arenas, which follow the memory policy
+    template<typename T>
+    struct PolicyAllocator
+    {
+        typedef T value_type;
+
+        PolicyAllocator() {}
+        template<typename U>
+        PolicyAllocator(const PolicyAllocator<U> &) {}
+
+        T *allocate(size_t n) {
+            T *ptr = (T *) alloc_memory(n * sizeof(T));
+            if (!ptr && n > 0)
+                throw std::bad_alloc();
+            return ptr;
+        }
+
+        void deallocate(T *ptr, size_t) { free_memory(ptr); }
+    };
+
+    template<typename T, typename U>
+    inline bool operator==(const PolicyAllocator<T> &, const PolicyAllocator<U> &) { return true; }
+
+    template<typename T, typename U>
+    inline bool operator!=(const PolicyAllocator<T> &, const PolicyAllocator<U> &) { return false; }
+}
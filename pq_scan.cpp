@@ -0,0 +1,376 @@
+#include "pq_scan.h"
+
+#include <cmath>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PQ_SCAN_DISPATCH
+#define PQ_SCAN_TARGET(arch) __attribute__((target(arch)))
+#endif
+
+namespace ivfhnsw {
+
+    typedef void (*pq_scan_func_t)(size_t, const uint8_t *, size_t, size_t, const float *, float *);
+
+    static void pq_scan_scalar(size_t n, const uint8_t *codes, size_t M, size_t ksub,
+                               const float *table, float *dis)
+    {
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t *code = codes + i * M;
+            const float *tab = table;
+            float result = 0.;
+            for (size_t m = 0; m < M; m += 4) {
+                result += tab[code[m]]; tab += ksub;
+                result += tab[code[m + 1]]; tab += ksub;
+                result += tab[code[m + 2]]; tab += ksub;
+                result += tab[code[m + 3]]; tab += ksub;
+            }
+            dis[i] = result;
+        }
+    }
+
+#ifdef PQ_SCAN_DISPATCH
+    /// 4 codes per iteration, the lookups of different codes are independent
+    PQ_SCAN_TARGET("sse4.1")
+    static void pq_scan_sse4(size_t n, const uint8_t *codes, size_t M, size_t ksub,
+                             const float *table, float *dis)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            const uint8_t *c0 = codes + i * M;
+            const uint8_t *c1 = c0 + M;
+            const uint8_t *c2 = c1 + M;
+            const uint8_t *c3 = c2 + M;
+            const float *tab = table;
+
+            __m128 sum = _mm_setzero_ps();
+            for (size_t m = 0; m < M; m++) {
+                sum = _mm_add_ps(sum, _mm_setr_ps(tab[c0[m]], tab[c1[m]], tab[c2[m]], tab[c3[m]]));
+                tab += ksub;
+            }
+            _mm_storeu_ps(dis + i, sum);
+        }
+        pq_scan_scalar(n - i, codes + i * M, M, ksub, table, dis + i);
+    }
+
+    /** 8 codes per iteration.
+      * One 32-bit gather loads 4 consecutive sub-quantizer indices of each of the 8 codes,
+      * then each byte is used as an index for a table gather.
+    */
+    PQ_SCAN_TARGET("avx2")
+    static void pq_scan_avx2(size_t n, const uint8_t *codes, size_t M, size_t ksub,
+                             const float *table, float *dis)
+    {
+        const int stride = M;
+        const __m256i offsets = _mm256_setr_epi32(0, stride, 2 * stride, 3 * stride,
+                                                  4 * stride, 5 * stride, 6 * stride, 7 * stride);
+        const __m256i mask = _mm256_set1_epi32(0xff);
+
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            const uint8_t *code = codes + i * M;
+            const float *tab = table;
+
+            __m256 sum = _mm256_setzero_ps();
+            for (size_t m = 0; m < M; m += 4) {
+                const __m256i packed = _mm256_i32gather_epi32((const int *) (code + m), offsets, 1);
+
+                __m256i idx = _mm256_and_si256(packed, mask);
+                sum = _mm256_add_ps(sum, _mm256_i32gather_ps(tab, idx, 4));
+                tab += ksub;
+
+                idx = _mm256_and_si256(_mm256_srli_epi32(packed, 8), mask);
+                sum = _mm256_add_ps(sum, _mm256_i32gather_ps(tab, idx, 4));
+                tab += ksub;
+
+                idx = _mm256_and_si256(_mm256_srli_epi32(packed, 16), mask);
+                sum = _mm256_add_ps(sum, _mm256_i32gather_ps(tab, idx, 4));
+                tab += ksub;
+
+                idx = _mm256_srli_epi32(packed, 24);
+                sum = _mm256_add_ps(sum, _mm256_i32gather_ps(tab, idx, 4));
+                tab += ksub;
+            }
+            _mm256_storeu_ps(dis + i, sum);
+        }
+        pq_scan_scalar(n - i, codes + i * M, M, ksub, table, dis + i);
+    }
+
+    /// Same as the AVX2 kernel with 16 codes per iteration
+    PQ_SCAN_TARGET("avx512f")
+    static void pq_scan_avx512(size_t n, const uint8_t *codes, size_t M, size_t ksub,
+                               const float *table, float *dis)
+    {
+        const int stride = M;
+        const __m512i offsets = _mm512_mullo_epi32(
+                _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                _mm512_set1_epi32(stride));
+        const __m512i mask = _mm512_set1_epi32(0xff);
+
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            const uint8_t *code = codes + i * M;
+            const float *tab = table;
+
+            __m512 sum = _mm512_setzero_ps();
+            for (size_t m = 0; m < M; m += 4) {
+                const __m512i packed = _mm512_i32gather_epi32(offsets, (const int *) (code + m), 1);
+
+                __m512i idx = _mm512_and_si512(packed, mask);
+                sum = _mm512_add_ps(sum, _mm512_i32gather_ps(idx, tab, 4));
+                tab += ksub;
+
+                idx = _mm512_and_si512(_mm512_srli_epi32(packed, 8), mask);
+                sum = _mm512_add_ps(sum, _mm512_i32gather_ps(idx, tab, 4));
+                tab += ksub;
+
+                idx = _mm512_and_si512(_mm512_srli_epi32(packed, 16), mask);
+                sum = _mm512_add_ps(sum, _mm512_i32gather_ps(idx, tab, 4));
+                tab += ksub;
+
+                idx = _mm512_srli_epi32(packed, 24);
+                sum = _mm512_add_ps(sum, _mm512_i32gather_ps(idx, tab, 4));
+                tab += ksub;
+            }
+            _mm512_storeu_ps(dis + i, sum);
+        }
+        pq_scan_avx2(n - i, codes + i * M, M, ksub, table, dis + i);
+    }
+#endif
+
+    //=========================================
+    // 4-bit PQ codes with in-register LUTs
+    //=========================================
+    void pq4_set_code(uint8_t *blocks, size_t i, size_t M, const uint8_t *idx)
+    {
+        uint8_t *block = blocks + (i / pq4_block_size) * M * 16;
+        const size_t j = i % pq4_block_size;
+        const int shift = (j < 16) ? 0 : 4;
+        for (size_t m = 0; m < M; m++) {
+            uint8_t &byte = block[m * 16 + (j & 15)];
+            byte = (byte & ~(0x0f << shift)) | ((idx[m] & 0x0f) << shift);
+        }
+    }
+
+    void pq4_get_code(const uint8_t *blocks, size_t i, size_t M, uint8_t *idx)
+    {
+        const uint8_t *block = blocks + (i / pq4_block_size) * M * 16;
+        const size_t j = i % pq4_block_size;
+        const int shift = (j < 16) ? 0 : 4;
+        for (size_t m = 0; m < M; m++)
+            idx[m] = (block[m * 16 + (j & 15)] >> shift) & 0x0f;
+    }
+
+    void pq4_quantize_lut(size_t M, const float *table, float a, uint8_t *lut, float *scale, float *bias)
+    {
+        float max_span = 0;
+        float min_sum = 0;
+        for (size_t m = 0; m < M; m++) {
+            float min_val = a * table[m * 16];
+            float max_val = min_val;
+            for (size_t j = 1; j < 16; j++) {
+                min_val = std::min(min_val, a * table[m * 16 + j]);
+                max_val = std::max(max_val, a * table[m * 16 + j]);
+            }
+            max_span = std::max(max_span, max_val - min_val);
+            min_sum += min_val;
+        }
+        const float s = (max_span > 0) ? 255 / max_span : 1;
+
+        for (size_t m = 0; m < M; m++) {
+            float min_val = a * table[m * 16];
+            for (size_t j = 1; j < 16; j++)
+                min_val = std::min(min_val, a * table[m * 16 + j]);
+            for (size_t j = 0; j < 16; j++) {
+                const float q = std::floor((a * table[m * 16 + j] - min_val) * s + 0.5f);
+                lut[m * 16 + j] = (uint8_t) std::min(q, 255.0f);
+            }
+        }
+        *scale = s;
+        *bias = min_sum;
+    }
+
+    typedef void (*pq4_scan_func_t)(size_t, const uint8_t *, size_t, const uint8_t *, uint16_t *);
+
+    static void pq4_scan_scalar(size_t nblocks, const uint8_t *blocks, size_t M, const uint8_t *lut, uint16_t *dis)
+    {
+        for (size_t b = 0; b < nblocks; b++) {
+            const uint8_t *block = blocks + b * M * 16;
+            uint16_t *res = dis + b * pq4_block_size;
+            std::fill(res, res + pq4_block_size, 0);
+
+            for (size_t m = 0; m < M; m++) {
+                const uint8_t *c = block + m * 16;
+                const uint8_t *tab = lut + m * 16;
+                for (size_t j = 0; j < 16; j++) {
+                    res[j] += tab[c[j] & 0x0f];
+                    res[j + 16] += tab[c[j] >> 4];
+                }
+            }
+        }
+    }
+
+#ifdef PQ_SCAN_DISPATCH
+    /// One sub-quantizer per shuffle
+    PQ_SCAN_TARGET("ssse3")
+    static void pq4_scan_ssse3(size_t nblocks, const uint8_t *blocks, size_t M, const uint8_t *lut, uint16_t *dis)
+    {
+        const __m128i mask = _mm_set1_epi8(0x0f);
+        const __m128i zero = _mm_setzero_si128();
+
+        for (size_t b = 0; b < nblocks; b++) {
+            const uint8_t *block = blocks + b * M * 16;
+            __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+            for (size_t m = 0; m < M; m++) {
+                const __m128i c = _mm_loadu_si128((const __m128i *) (block + m * 16));
+                const __m128i tab = _mm_loadu_si128((const __m128i *) (lut + m * 16));
+
+                const __m128i lo = _mm_shuffle_epi8(tab, _mm_and_si128(c, mask));
+                const __m128i hi = _mm_shuffle_epi8(tab, _mm_and_si128(_mm_srli_epi16(c, 4), mask));
+
+                acc0 = _mm_add_epi16(acc0, _mm_unpacklo_epi8(lo, zero));
+                acc1 = _mm_add_epi16(acc1, _mm_unpackhi_epi8(lo, zero));
+                acc2 = _mm_add_epi16(acc2, _mm_unpacklo_epi8(hi, zero));
+                acc3 = _mm_add_epi16(acc3, _mm_unpackhi_epi8(hi, zero));
+            }
+            __m128i *res = (__m128i *) (dis + b * pq4_block_size);
+            _mm_storeu_si128(res, acc0);
+            _mm_storeu_si128(res + 1, acc1);
+            _mm_storeu_si128(res + 2, acc2);
+            _mm_storeu_si128(res + 3, acc3);
+        }
+    }
+
+    /** Two sub-quantizers per shuffle: the 128-bit lanes hold the codes and the
+      * table of sub-quantizers m and m + 1 respectively
+    */
+    PQ_SCAN_TARGET("avx2")
+    static void pq4_scan_avx2(size_t nblocks, const uint8_t *blocks, size_t M, const uint8_t *lut, uint16_t *dis)
+    {
+        const __m256i mask = _mm256_set1_epi8(0x0f);
+
+        for (size_t b = 0; b < nblocks; b++) {
+            const uint8_t *block = blocks + b * M * 16;
+            __m256i acc_lo = _mm256_setzero_si256();
+            __m256i acc_hi = _mm256_setzero_si256();
+
+            for (size_t m = 0; m < M; m += 2) {
+                const __m256i c = _mm256_loadu_si256((const __m256i *) (block + m * 16));
+                const __m256i tab = _mm256_loadu_si256((const __m256i *) (lut + m * 16));
+
+                const __m256i lo = _mm256_shuffle_epi8(tab, _mm256_and_si256(c, mask));
+                const __m256i hi = _mm256_shuffle_epi8(tab, _mm256_and_si256(_mm256_srli_epi16(c, 4), mask));
+
+                acc_lo = _mm256_add_epi16(acc_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(lo)));
+                acc_lo = _mm256_add_epi16(acc_lo, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(lo, 1)));
+                acc_hi = _mm256_add_epi16(acc_hi, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(hi)));
+                acc_hi = _mm256_add_epi16(acc_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(hi, 1)));
+            }
+            __m256i *res = (__m256i *) (dis + b * pq4_block_size);
+            _mm256_storeu_si256(res, acc_lo);
+            _mm256_storeu_si256(res + 1, acc_hi);
+        }
+    }
+
+    /** Four sub-quantizers per shuffle. The 512-bit accumulators keep the sums of the
+      * even and odd sub-quantizers in separate halves, they are added at the end of the block.
+    */
+    PQ_SCAN_TARGET("avx512f,avx512bw")
+    static void pq4_scan_avx512(size_t nblocks, const uint8_t *blocks, size_t M, const uint8_t *lut, uint16_t *dis)
+    {
+        const __m512i mask = _mm512_set1_epi8(0x0f);
+        const __m256i mask256 = _mm256_set1_epi8(0x0f);
+
+        for (size_t b = 0; b < nblocks; b++) {
+            const uint8_t *block = blocks + b * M * 16;
+            __m512i acc_lo = _mm512_setzero_si512();
+            __m512i acc_hi = _mm512_setzero_si512();
+
+            size_t m = 0;
+            for (; m + 4 <= M; m += 4) {
+                const __m512i c = _mm512_loadu_si512((const void *) (block + m * 16));
+                const __m512i tab = _mm512_loadu_si512((const void *) (lut + m * 16));
+
+                const __m512i lo = _mm512_shuffle_epi8(tab, _mm512_and_si512(c, mask));
+                const __m512i hi = _mm512_shuffle_epi8(tab, _mm512_and_si512(_mm512_srli_epi16(c, 4), mask));
+
+                acc_lo = _mm512_add_epi16(acc_lo, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(lo)));
+                acc_lo = _mm512_add_epi16(acc_lo, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(lo, 1)));
+                acc_hi = _mm512_add_epi16(acc_hi, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(hi)));
+                acc_hi = _mm512_add_epi16(acc_hi, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(hi, 1)));
+            }
+            __m256i res_lo = _mm256_add_epi16(_mm512_castsi512_si256(acc_lo), _mm512_extracti64x4_epi64(acc_lo, 1));
+            __m256i res_hi = _mm256_add_epi16(_mm512_castsi512_si256(acc_hi), _mm512_extracti64x4_epi64(acc_hi, 1));
+
+            // The last pair of sub-quantizers if M is not a multiple of 4
+            if (m < M) {
+                const __m256i c = _mm256_loadu_si256((const __m256i *) (block + m * 16));
+                const __m256i tab = _mm256_loadu_si256((const __m256i *) (lut + m * 16));
+
+                const __m256i lo = _mm256_shuffle_epi8(tab, _mm256_and_si256(c, mask256));
+                const __m256i hi = _mm256_shuffle_epi8(tab, _mm256_and_si256(_mm256_srli_epi16(c, 4), mask256));
+
+                res_lo = _mm256_add_epi16(res_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(lo)));
+                res_lo = _mm256_add_epi16(res_lo, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(lo, 1)));
+                res_hi = _mm256_add_epi16(res_hi, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(hi)));
+                res_hi = _mm256_add_epi16(res_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(hi, 1)));
+            }
+            __m256i *res = (__m256i *) (dis + b * pq4_block_size);
+            _mm256_storeu_si256(res, res_lo);
+            _mm256_storeu_si256(res + 1, res_hi);
+        }
+    }
+#endif
+
+    struct PQScanKernel {
+        pq_scan_func_t func;
+        pq4_scan_func_t pq4_func;
+        const char *name;
+
+        PQScanKernel(): func(pq_scan_scalar), pq4_func(pq4_scan_scalar), name("scalar")
+        {
+#ifdef PQ_SCAN_DISPATCH
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) {
+                func = pq_scan_avx512; name = "avx512";
+            } else if (__builtin_cpu_supports("avx2")) {
+                func = pq_scan_avx2; name = "avx2";
+            } else if (__builtin_cpu_supports("sse4.1")) {
+                func = pq_scan_sse4; name = "sse4";
+            }
+
+            if (__builtin_cpu_supports("avx512bw"))
+                pq4_func = pq4_scan_avx512;
+            else if (__builtin_cpu_supports("avx2"))
+                pq4_func = pq4_scan_avx2;
+            else if (__builtin_cpu_supports("ssse3"))
+                pq4_func = pq4_scan_ssse3;
+#endif
+        }
+    };
+
+    /// The kernel is selected once, on the first call
+    static const PQScanKernel &get_pq_scan_kernel()
+    {
+        static const PQScanKernel kernel;
+        return kernel;
+    }
+
+    void pq_scan_codes(size_t n, const uint8_t *codes, size_t M, size_t ksub,
+                       const float *table, float *dis)
+    {
+        get_pq_scan_kernel().func(n, codes, M, ksub, table, dis);
+    }
+
+    const char *pq_scan_kernel_name()
+    {
+        return get_pq_scan_kernel().name;
+    }
+
+    void pq4_scan_blocks(size_t nblocks, const uint8_t *blocks, size_t M, const uint8_t *lut, uint16_t *dis)
+    {
+        get_pq_scan_kernel().pq4_func(nblocks, blocks, M, lut, dis);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef IVF_HNSW_LIB_PQ_SCAN_H
+#define IVF_HNSW_LIB_PQ_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ivfhnsw {
+    /** Scan n PQ codes against a look-up table
+      *
+      * For each code computes dis[i] = sum_m table[m * ksub + codes[i * M + m]],
+      * i.e. the value pq_L2sqr returns for a single code. The codes are stored one
+      * byte per sub-quantizer (nbits = 8), M has to be a multiple of 4.
+      *
+      * The kernel is chosen at runtime depending on the CPU: AVX-512 and AVX2 kernels
+      * use gather instructions and score 16 and 8 codes per iteration respectively,
+      * the SSE4 kernel interleaves 4 codes, otherwise the scalar loop is used.
+      *
+      * The sums equal the ones of pq_L2sqr only up to rounding: the library is built with -Ofast,
+      * which reassociates the floating-point additions, so the kernels may differ in the last ulp.
+      *
+      * @param n       number of codes
+      * @param codes   PQ codes, size n * M
+      * @param M       number of sub-quantizers
+      * @param ksub    number of centroids per sub-quantizer
+      * @param table   look-up table, size M * ksub
+      * @param dis     output sums, size n
+    */
+    void pq_scan_codes(size_t n, const uint8_t *codes, size_t M, size_t ksub,
+                       const float *table, float *dis);
+
+    /// Name of the kernel used by pq_scan_codes on this CPU: "avx512", "avx2", "sse4" or "scalar"
+    const char *pq_scan_kernel_name();
+
+    //=========================================
+    // 4-bit PQ codes with in-register LUTs
+    //=========================================
+    /** Codes of 4-bit product quantizers (ksub = 16) are stored in blocks of <pq4_block_size> vectors.
+      *
+      * Inside a block, sub-quantizer m occupies 16 consecutive bytes at offset m * 16:
+      * byte j holds the index of vector j in the low nibble and the index of vector j + 16
+      * in the high nibble. A block takes M * 16 bytes, i.e. M / 2 bytes per vector.
+      *
+      * Look-up tables are quantized to uint8, so the table of one sub-quantizer fits
+      * into a 128-bit register and the lookups are done by pshufb.
+    */
+    const size_t pq4_block_size = 32;
+
+    /// Number of bytes taken by the blocks containing n codes
+    inline size_t pq4_blocks_size(size_t n, size_t M) {
+        return (n + pq4_block_size - 1) / pq4_block_size * M * 16;
+    }
+
+    /** Write the i-th code to the blocks
+      *
+      * @param blocks   code blocks, the block containing the i-th code has to be allocated
+      * @param i        position of the code
+      * @param M        number of sub-quantizers
+      * @param idx      sub-quantizer indices of the code, size M
+    */
+    void pq4_set_code(uint8_t *blocks, size_t i, size_t M, const uint8_t *idx);
+
+    /// Read the sub-quantizer indices of the i-th code from the blocks
+    void pq4_get_code(const uint8_t *blocks, size_t i, size_t M, uint8_t *idx);
+
+    /** Quantize the look-up table a * table to uint8
+      *
+      * Values are shifted by the minimum of each sub-quantizer and multiplied by the same
+      * scale, so a sum of M float entries is approximated by bias + (sum of quantized entries) / scale.
+      * The sum of M quantized entries fits in uint16.
+      *
+      * @param M        number of sub-quantizers, M <= 256
+      * @param table    float look-up table, size M * 16
+      * @param a        factor applied to the table values
+      * @param lut      output quantized table, size M * 16
+      * @param scale    output scale of the quantized values
+      * @param bias     output sum of the sub-quantizer minimums
+    */
+    void pq4_quantize_lut(size_t M, const float *table, float a, uint8_t *lut, float *scale, float *bias);
+
+    /** Scan nblocks blocks of codes against a quantized look-up table
+      *
+      * Dispatched at runtime between AVX-512BW (4 sub-quantizers per shuffle),
+      * AVX2 (2 sub-quantizers per shuffle), SSSE3 and scalar kernels.
+      *
+      * @param nblocks   number of blocks
+      * @param blocks    code blocks, size nblocks * M * 16
+      * @param M         number of sub-quantizers, has to be even
+      * @param lut       quantized look-up table, size M * 16
+      * @param dis       output sums of the quantized table entries, size nblocks * pq4_block_size
+    */
+    void pq4_scan_blocks(size_t nblocks, const uint8_t *blocks, size_t M, const uint8_t *lut, uint16_t *dis);
+}
+#endif //IVF_HNSW_LIB_PQ_SCAN_H
@@ -3,9 +3,12 @@
 #include <cstdio>
 #include <stdlib.h>
 #include <queue>
+#include <algorithm>
 #include <unordered_set>
+#include <omp.h>
 
 #include <ivf-hnsw/IndexIVF_HNSW_Grouping.h>
+#include <ivf-hnsw/GroupBuilder.h>
 #include <ivf-hnsw/Parser.h>
 
 using namespace hnswlib;
@@ -24,6 +27,9 @@ int main(int argc, char **argv)
     // Parse Options 
     //===============
     Parser opt = Parser(argc, argv);
+    hnswlib::set_memory_policy(opt.memory_policy);
+    if (opt.memory_policy.numa != hnswlib::NUMA_NONE)
+        hnswlib::pin_threads_to_numa_nodes();
 
     //==================
     // Load Groundtruth 
@@ -47,8 +53,11 @@ int main(int argc, char **argv)
     //==================
     // Initialize Index 
     //==================
-    IndexIVF_HNSW_Grouping *index = new IndexIVF_HNSW_Grouping(opt.d, opt.nc, opt.code_size, 8, opt.nsubc);
+    IndexIVF_HNSW_Grouping *index = new IndexIVF_HNSW_Grouping(opt.d, opt.nc, opt.code_size, opt.nbits, opt.nsubc, opt.metric);
     index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction);
+    // Neighbors in the graph are stored close in memory, the centroid indices are not changed
+    if (opt.reorder != hnswlib::REORDER_NONE)
+        index->quantizer->reorder(opt.reorder);
     index->do_opq = opt.do_opq;
 
     //==========
@@ -101,23 +110,27 @@ int main(int argc, char **argv)
         std::ofstream output(opt.path_precomputed_idxs, std::ios::binary);
 
         const uint32_t batch_size = 1000000;
-        const size_t nbatches = opt.nb / batch_size;
+        const size_t nbatches = (opt.nb + batch_size - 1) / batch_size;
 
         std::vector<float> batch(batch_size * opt.d);
         std::vector<idx_t> precomputed_idx(batch_size);
 
         index->quantizer->efSearch = 220;
+        index->assign_mode = opt.exact_assign ? BulkAssigner::EXACT : BulkAssigner::HNSW;
         for (size_t i = 0; i < nbatches; i++) {
             if (i % 10 == 0) {
                 std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
                           << (100.*i) / nbatches << "%" << std::endl;
             }
-            readXvec<float>(input, batch.data(), opt.d, batch_size);
-            index->assign(batch_size, batch.data(), precomputed_idx.data());
+            // The last batch is shorter if nb is not a multiple of batch_size
+            const uint32_t n = std::min<size_t>(batch_size, opt.nb - i * batch_size);
+            readXvec<float>(input, batch.data(), opt.d, n);
+            index->assign(n, batch.data(), precomputed_idx.data());
 
-            output.write((char *) &batch_size, sizeof(int));
-            output.write((char *) precomputed_idx.data(), batch_size * sizeof(idx_t));
+            output.write((char *) &n, sizeof(uint32_t));
+            output.write((char *) precomputed_idx.data(), n * sizeof(idx_t));
         }
+        index->assigner->report();
         input.close();
         output.close();
     }
@@ -131,73 +144,21 @@ int main(int argc, char **argv)
         index->read(opt.path_index);
     } else {
         // Adding groups to index
+        // Base vectors are sorted by groups into partition files next to the index in one pass,
+        // then the partitions are added one by one within the memory budget
         std::cout << "Adding groups to index" << std::endl;
-        StopW stopw = StopW();
-
-        const size_t batch_size = 1000000;
-        const size_t nbatches = opt.nb / batch_size;
-        size_t groups_per_iter = 250000;
-
-        std::vector<float> batch(batch_size * opt.d);
-        std::vector<idx_t> idx_batch(batch_size);
-
-        // Adding batches of groups to the index (batch size - <groups_per_iter> groups per iteration)
-        for (size_t ngroups_added = 0; ngroups_added < opt.nc; ngroups_added += groups_per_iter)
-        {
-            std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
-                      << ngroups_added << " / " << opt.nc << std::endl;
-
-            std::vector<std::vector<float>> data(groups_per_iter);
-            std::vector<std::vector<idx_t>> ids(groups_per_iter);
-
-            // Iterate through the dataset extracting points from groups,
-            // whose idxs lie in [ngroups_added, ngroups_added + groups_per_iter)
-            std::ifstream base_input(opt.path_base, std::ios::binary);
-            std::ifstream idx_input(opt.path_precomputed_idxs, std::ios::binary);
-
-            for (size_t b = 0; b < nbatches; b++) {
-                readXvec<float>(base_input, batch.data(), opt.d, batch_size);
-                readXvec<idx_t>(idx_input, idx_batch.data(), batch_size, 1);
-
-                for (size_t i = 0; i < batch_size; i++) {
-                    if (idx_batch[i] < ngroups_added ||
-                        idx_batch[i] >= ngroups_added + groups_per_iter)
-                        continue;
-
-                    idx_t idx = idx_batch[i] % groups_per_iter;
-                    for (size_t j = 0; j < opt.d; j++)
-                        data[idx].push_back(batch[i * opt.d + j]);
-                    ids[idx].push_back(b * batch_size + i);
-                }
-            }
-            base_input.close();
-            idx_input.close();
+        GroupBuilder builder(index, opt.build_memory << 30, std::string(opt.path_index) + ".part");
+        builder.build<float>(opt.path_base, opt.path_precomputed_idxs, opt.nb);
 
-            // If <opt.nc> is not a multiple of groups_per_iter, change <groups_per_iter> on the last iteration
-            if (opt.nc - ngroups_added <= groups_per_iter)
-                groups_per_iter = opt.nc - ngroups_added;
-
-            size_t j = 0;
-#pragma omp parallel for
-            for (size_t i = 0; i < groups_per_iter; i++) {
-#pragma omp critical
-                {
-                    if (j % 10000 == 0) {
-                        std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
-                                  << (100. * (ngroups_added+j)) / opt.nc << "%" << std::endl;
-                    }
-                    j++;
-                }
-                const size_t group_size = ids[i].size();
-                index->add_group(ngroups_added + i, group_size, data[i].data(), ids[i].data());
-            }
-        }
         // Computing centroid norms and inter-centroid distances
         std::cout << "Computing centroid norms"<< std::endl;
         index->compute_centroid_norms();
         std::cout << "Computing centroid dists"<< std::endl;
         index->compute_inter_centroid_dists();
 
+        // Pack the inverted lists
+        index->finalize();
+
         // Save index, pq and norm_pq
         std::cout << "Saving index to " << opt.path_index << std::endl;
         index->write(opt.path_index);
@@ -207,6 +168,12 @@ int main(int argc, char **argv)
         std::cout << "Rotating centroids"<< std::endl;
         index->rotate_quantizer();
     }
+    // Compress the centroids in the graph for the search, the fp32 centroids are not needed anymore
+    if (opt.quantizer_storage != hnswlib::STORAGE_FLOAT)
+        index->quantizer->compress(opt.quantizer_storage);
+    if (opt.memory_policy.numa == hnswlib::NUMA_REPLICATE)
+        index->quantizer->replicate();
+    std::cout << hnswlib::memory_policy_report();
 
     //===================
     // Parse groundtruth
@@ -224,18 +191,36 @@ int main(int argc, char **argv)
     index->max_codes = opt.max_codes;
     index->quantizer->efSearch = opt.efSearch;
     index->do_pruning = opt.do_pruning;
+    // The tuned parameters override the ones above
+    if (opt.path_params && exists(opt.path_params)) {
+        std::cout << "Loading search parameters from " << opt.path_params << std::endl;
+        const SearchParams params = select_search_params(read_search_params(opt.path_params),
+                                                         opt.target_recall, opt.target_p99);
+        index->set_search_params(params);
+        std::cout << "nprobe: " << params.nprobe << ", max_codes: " << params.max_codes
+                  << ", efSearch: " << params.efSearch << std::endl;
+    }
+    if (opt.k_factor > 0) {
+        std::cout << "Re-ranking " << opt.k_factor * opt.k << " candidates by the base vectors from " << opt.path_base << std::endl;
+        index->load_refine_vectors(opt.path_base, opt.k_factor);
+    }
 
     //========
     // Search 
     //========
     size_t correct = 0;
-    float distances[opt.k];
-    long labels[opt.k];
+    std::vector<float> distances(opt.nq * opt.k);
+    std::vector<long> labels(opt.nq * opt.k);
+
+    SearchStatsCollector search_stats;
+    if (opt.stats_format)
+        index->stats = &search_stats;
 
     StopW stopw = StopW();
-    for (size_t i = 0; i < opt.nq; i++) {
-        index->search(opt.k, massQ.data() + i*opt.d, distances, labels);
+    index->search(opt.nq, massQ.data(), opt.k, distances.data(), labels.data());
+    const float time_us_per_query = stopw.getElapsedTimeMicro() / opt.nq;
 
+    for (size_t i = 0; i < opt.nq; i++) {
         std::priority_queue<std::pair<float, idx_t >> gt(answers[i]);
         std::unordered_set<idx_t> g;
 
@@ -245,7 +230,7 @@ int main(int argc, char **argv)
         }
 
         for (size_t j = 0; j < opt.k; j++)
-            if (g.count(labels[j]) != 0) {
+            if (g.count(labels[i * opt.k + j]) != 0) {
                 correct++;
                 break;
             }
@@ -253,9 +238,11 @@ int main(int argc, char **argv)
     //===================
     // Represent results 
     //===================
-    const float time_us_per_query = stopw.getElapsedTimeMicro() / opt.nq;
     std::cout << "Recall@" << opt.k << ": " << 1.0f * correct / opt.nq << std::endl;
-    std::cout << "Time per query: " << time_us_per_query << " us" << std::endl;
+    // The queries run in parallel, so this is the inverse throughput rather than the latency of a query
+    std::cout << "Wall time per query, " << omp_get_max_threads() << " threads: " << time_us_per_query << " us" << std::endl;
+    if (opt.stats_format)
+        std::cout << (strcmp(opt.stats_format, "json") ? search_stats.to_text() : search_stats.to_json());
 
     delete index;
     return 0;
@@ -3,7 +3,9 @@
 #include <cstdio>
 #include <stdlib.h>
 #include <queue>
+#include <algorithm>
 #include <unordered_set>
+#include <omp.h>
 
 #include <ivf-hnsw/IndexIVF_HNSW.h>
 #include <ivf-hnsw/Parser.h>
@@ -20,6 +22,9 @@ int main(int argc, char **argv)
     // Parse Options
     //===============
     Parser opt = Parser(argc, argv);
+    hnswlib::set_memory_policy(opt.memory_policy);
+    if (opt.memory_policy.numa != hnswlib::NUMA_NONE)
+        hnswlib::pin_threads_to_numa_nodes();
 
     //==================
     // Load Groundtruth
@@ -43,8 +48,11 @@ int main(int argc, char **argv)
     //==================
     // Initialize Index
     //==================
-    IndexIVF_HNSW *index = new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, 8);
+    IndexIVF_HNSW *index = new IndexIVF_HNSW(opt.d, opt.nc, opt.code_size, opt.nbits, 65536, opt.metric);
     index->build_quantizer(opt.path_centroids, opt.path_info, opt.path_edges, opt.M, opt.efConstruction);
+    // Neighbors in the graph are stored close in memory, the centroid indices are not changed
+    if (opt.reorder != hnswlib::REORDER_NONE)
+        index->quantizer->reorder(opt.reorder);
     index->do_opq = opt.do_opq;
 
     //==========
@@ -99,23 +107,27 @@ int main(int argc, char **argv)
         std::ofstream output(opt.path_precomputed_idxs, std::ios::binary);
 
         const uint32_t batch_size = 1000000;
-        const size_t nbatches = opt.nb / batch_size;
+        const size_t nbatches = (opt.nb + batch_size - 1) / batch_size;
 
-        std::vector<float> batch(batch_size * opt.d);
+        std::vector<uint8_t> batch(batch_size * opt.d);
         std::vector<idx_t> precomputed_idx(batch_size);
 
         index->quantizer->efSearch = 220;
+        index->assign_mode = opt.exact_assign ? BulkAssigner::EXACT : BulkAssigner::HNSW;
         for (size_t i = 0; i < nbatches; i++) {
             if (i % 10 == 0) {
                 std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] "
                           << (100.*i) / nbatches << "%" << std::endl;
             }
-            readXvecFvec<uint8_t>(input, batch.data(), opt.d, batch_size);
-            index->assign(batch_size, batch.data(), precomputed_idx.data());
+            // The last batch is shorter if nb is not a multiple of batch_size
+            const uint32_t n = std::min<size_t>(batch_size, opt.nb - i * batch_size);
+            readXvec<uint8_t>(input, batch.data(), opt.d, n);
+            index->assign(n, batch.data(), VECTOR_UINT8, precomputed_idx.data());
 
-            output.write((char *) &batch_size, sizeof(uint32_t));
-            output.write((char *) precomputed_idx.data(), batch_size * sizeof(idx_t));
+            output.write((char *) &n, sizeof(uint32_t));
+            output.write((char *) precomputed_idx.data(), n * sizeof(idx_t));
         }
+        index->assigner->report();
     }
 
     /******************************/
@@ -133,8 +145,8 @@ int main(int argc, char **argv)
         std::ifstream idx_input(opt.path_precomputed_idxs, std::ios::binary);
 
         const size_t batch_size = 1000000;
-        const size_t nbatches = opt.nb / batch_size;
-        std::vector<float> batch(batch_size * opt.d);
+        const size_t nbatches = (opt.nb + batch_size - 1) / batch_size;
+        std::vector<uint8_t> batch(batch_size * opt.d);
         std::vector <idx_t> idx_batch(batch_size);
         std::vector <idx_t> ids_batch(batch_size);
 
@@ -142,19 +154,23 @@ int main(int argc, char **argv)
             if (b % 10 == 0) {
                 std::cout << "[" << stopw.getElapsedTimeMicro() / 1000000 << "s] " << (100. * b) / nbatches << "%\n";
             }
-            readXvec<idx_t>(idx_input, idx_batch.data(), batch_size, 1);
-            readXvecFvec<uint8_t>(base_input, batch.data(), opt.d, batch_size);
+            const size_t n = std::min(batch_size, opt.nb - b * batch_size);
+            readXvec<idx_t>(idx_input, idx_batch.data(), n, 1);
+            readXvec<uint8_t>(base_input, batch.data(), opt.d, n);
 
-            for (size_t i = 0; i < batch_size; i++)
+            for (size_t i = 0; i < n; i++)
                 ids_batch[i] = batch_size * b + i;
 
-            index->add_batch(batch_size, batch.data(), ids_batch.data(), idx_batch.data());
+            index->add_batch(n, batch.data(), VECTOR_UINT8, ids_batch.data(), idx_batch.data());
         }
 
         // Computing Centroid Norms
         std::cout << "Computing centroid norms"<< std::endl;
         index->compute_centroid_norms();
 
+        // Pack the inverted lists
+        index->finalize();
+
         // Save index, pq and norm_pq
         std::cout << "Saving index to " << opt.path_index << std::endl;
         index->write(opt.path_index);
@@ -164,6 +180,12 @@ int main(int argc, char **argv)
         std::cout << "Rotating centroids"<< std::endl;
         index->rotate_quantizer();
     }
+    // Compress the centroids in the graph for the search, the fp32 centroids are not needed anymore
+    if (opt.quantizer_storage != hnswlib::STORAGE_FLOAT)
+        index->quantizer->compress(opt.quantizer_storage);
+    if (opt.memory_policy.numa == hnswlib::NUMA_REPLICATE)
+        index->quantizer->replicate();
+    std::cout << hnswlib::memory_policy_report();
 
     //===================
     // Parse groundtruth
@@ -180,17 +202,36 @@ int main(int argc, char **argv)
     index->nprobe = opt.nprobe;
     index->max_codes = opt.max_codes;
     index->quantizer->efSearch = opt.efSearch;
+    // The tuned parameters override the ones above
+    if (opt.path_params && exists(opt.path_params)) {
+        std::cout << "Loading search parameters from " << opt.path_params << std::endl;
+        const SearchParams params = select_search_params(read_search_params(opt.path_params),
+                                                         opt.target_recall, opt.target_p99);
+        index->set_search_params(params);
+        std::cout << "nprobe: " << params.nprobe << ", max_codes: " << params.max_codes
+                  << ", efSearch: " << params.efSearch << std::endl;
+    }
+    if (opt.k_factor > 0) {
+        std::cout << "Re-ranking " << opt.k_factor * opt.k << " candidates by the base vectors from " << opt.path_base << std::endl;
+        index->load_refine_vectors(opt.path_base, opt.k_factor);
+    }
 
     //========
     // Search
     //========
     size_t correct = 0;
-    float distances[opt.k];
-    long labels[opt.k];
+    std::vector<float> distances(opt.nq * opt.k);
+    std::vector<long> labels(opt.nq * opt.k);
+
+    SearchStatsCollector search_stats;
+    if (opt.stats_format)
+        index->stats = &search_stats;
 
     StopW stopw = StopW();
+    index->search(opt.nq, massQ.data(), opt.k, distances.data(), labels.data());
+    const float time_us_per_query = stopw.getElapsedTimeMicro() / opt.nq;
+
     for (size_t i = 0; i < opt.nq; i++) {
-        index->search(opt.k, massQ.data() + i*opt.d, distances, labels);
         std::priority_queue<std::pair<float, idx_t >> gt(answers[i]);
         std::unordered_set<idx_t> g;
 
@@ -200,18 +241,21 @@ int main(int argc, char **argv)
         }
 
         for (size_t j = 0; j < opt.k; j++)
-            if (g.count(labels[j]) != 0) {
+            if (g.count(labels[i * opt.k + j]) != 0) {
                 correct++;
                 break;
             }
     }
 
+
     //===================
     // Represent results
     //===================
-    const float time_us_per_query = stopw.getElapsedTimeMicro() / opt.nq;
     std::cout << "Recall@" << opt.k << ": " << 1.0f * correct / opt.nq << std::endl;
-    std::cout << "Time per query: " << time_us_per_query << " us" << std::endl;
+    // The queries run in parallel, so this is the inverse throughput rather than the latency of a query
+    std::cout << "Wall time per query, " << omp_get_max_threads() << " threads: " << time_us_per_query << " us" << std::endl;
+    if (opt.stats_format)
+        std::cout << (strcmp(opt.stats_format, "json") ? search_stats.to_text() : search_stats.to_json());
 
     delete index;
     return 0;
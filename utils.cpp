@@ -1,6 +1,10 @@
 
 #include "utils.h"
 
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
 namespace ivfhnsw {
 
     void random_subset(const float *x, float *x_out, size_t d, size_t nx, size_t sub_nx) {
@@ -13,6 +17,83 @@ namespace ivfhnsw {
     }
 
 
+    size_t vector_type_size(VectorType type)
+    {
+        switch (type) {
+            case VECTOR_FLOAT: return sizeof(float);
+            case VECTOR_UINT8: return sizeof(uint8_t);
+            case VECTOR_INT8: return sizeof(int8_t);
+            case VECTOR_FLOAT16: return sizeof(uint16_t);
+        }
+        throw std::runtime_error("Unknown vector type " + std::to_string(type));
+    }
+
+    /// Convert a half precision float to a float, including subnormals, infinities and NaNs
+    static inline float fp16_to_float(uint16_t h)
+    {
+#ifdef __F16C__
+        return _cvtsh_ss(h);
+#else
+        const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ff;
+        uint32_t bits;
+        if (exponent == 0x1f) {
+            bits = sign | 0x7f800000 | (mantissa << 13);
+        } else if (exponent != 0) {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        } else if (mantissa == 0) {
+            bits = sign;
+        } else {
+            // Subnormal: shift the mantissa until its leading bit becomes the implicit one
+            exponent = 113;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+        float f;
+        memcpy(&f, &bits, sizeof(float));
+        return f;
+#endif
+    }
+
+    void convert_vectors(VectorType type, size_t n, size_t d, const void *x, float *out)
+    {
+        const size_t size = n * d;
+        switch (type) {
+            case VECTOR_FLOAT:
+                memcpy(out, x, size * sizeof(float));
+                break;
+            case VECTOR_UINT8: {
+                const uint8_t *src = (const uint8_t *) x;
+                for (size_t i = 0; i < size; i++)
+                    out[i] = src[i];
+                break;
+            }
+            case VECTOR_INT8: {
+                const int8_t *src = (const int8_t *) x;
+                for (size_t i = 0; i < size; i++)
+                    out[i] = src[i];
+                break;
+            }
+            case VECTOR_FLOAT16: {
+                const uint16_t *src = (const uint16_t *) x;
+                size_t i = 0;
+#ifdef __F16C__
+                for (; i + 8 <= size; i += 8)
+                    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (src + i))));
+#endif
+                for (; i < size; i++)
+                    out[i] = fp16_to_float(src[i]);
+                break;
+            }
+            default:
+                throw std::runtime_error("Unknown vector type " + std::to_string(type));
+        }
+    }
+
     float fvec_L2sqr(const float *x, const float *y, size_t d) {
         float PORTABLE_ALIGN32 TmpRes[8];
         #ifdef USE_AVX
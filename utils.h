@@ -2,6 +2,8 @@
 #define IVF_HNSW_LIB_UTILS_H
 
 #include <queue>
+#include <vector>
+#include <cstdint>
 #include <limits>
 #include <cmath>
 #include <chrono>
@@ -20,7 +22,10 @@
 #include <x86intrin.h>
 #endif
 
+// The SSE kernels are used if the code is compiled without AVX, e.g. with -mno-avx
+#ifdef __AVX__
 #define USE_AVX
+#endif
 #if defined(__GNUC__)
 #define PORTABLE_ALIGN32 __attribute__((aligned(32)))
 #else
@@ -125,6 +130,54 @@ namespace ivfhnsw {
         }
     }
 
+    /// Measure of the similarity between vectors
+    enum MetricType: uint32_t {
+        METRIC_L2 = 0,              ///< L2 square distance
+        METRIC_INNER_PRODUCT = 1,   ///< Maximum inner product search, distances are the negative inner products
+        METRIC_COSINE = 2           ///< Inner product of the vectors normalized at add and search time
+    };
+
+    /** Element type of the input vectors
+      *
+      * The vectors of the other types are converted to floats block by block inside the index,
+      * so the callers keep the batches in the compact input type.
+    */
+    enum VectorType: uint32_t {
+        VECTOR_FLOAT = 0,       ///< 32-bit float
+        VECTOR_UINT8 = 1,       ///< Unsigned byte, e.g. SIFT1B bvecs
+        VECTOR_INT8 = 2,        ///< Signed byte
+        VECTOR_FLOAT16 = 3      ///< IEEE half precision float stored as uint16_t
+    };
+
+    /// Type of the input vectors with the components of type T
+    inline VectorType vector_type_of(const float *) { return VECTOR_FLOAT; }
+    inline VectorType vector_type_of(const uint8_t *) { return VECTOR_UINT8; }
+    inline VectorType vector_type_of(const int8_t *) { return VECTOR_INT8; }
+
+    /// Size of a vector component in bytes
+    size_t vector_type_size(VectorType type);
+
+    /** Convert n vectors of dimension d to floats
+      *
+      * @param type    element type of x
+      * @param x       input vectors, size n * d elements of the type
+      * @param out     output float vectors, size n * d
+    */
+    void convert_vectors(VectorType type, size_t n, size_t d, const void *x, float *out);
+
+    /** Return the float vectors either as is or converted into buf
+      *
+      * The float vectors are not copied, the vectors of the other types are converted to buf.
+    */
+    inline const float *to_float_vectors(VectorType type, size_t n, size_t d, const void *x, std::vector<float> &buf)
+    {
+        if (type == VECTOR_FLOAT)
+            return (const float *) x;
+        buf.resize(n * d);
+        convert_vectors(type, n, d, x, buf.data());
+        return buf.data();
+    }
+
     /// Check if file exists
     inline bool exists(const char *path) {
         std::ifstream f(path);